@@ -32,7 +32,7 @@
 #include "ndtypes.h"
 #include "ruby_ndtypes.h"
 #include "gumath.h"
-#include "gufunc_object.h"
+#include "ruby_gumath_internal.h"
 #include "ruby_gumath.h"
 #include "util.h"
 
@@ -45,27 +45,6 @@ static gm_tbl_t *table = NULL;
 static VALUE mGumath_Examples;
 static int initialized = 0;
 
-/****************************************************************************/
-/*                              Singleton methods                           */
-/****************************************************************************/
-static VALUE
-mGumath_Examples_s_method_missing(int argc, VALUE *argv, VALUE module)
-{
-  VALUE method_name = argv[0];
-  VALUE method_hash = rb_ivar_get(module, GUMATH_FUNCTION_HASH);
-  VALUE gumath_method = rb_hash_aref(method_hash, method_name);
-  int is_present = RTEST(gumath_method);
-  
-  if (is_present) {
-    rb_funcall2(gumath_method, rb_intern("call"), argc-1, &argv[1]);
-  }
-  else {
-    VALUE str = rb_funcall(method_name, rb_intern("to_s"), 0, NULL);
-    rb_raise(rb_eNoMethodError, "Method %s not present in this gumath module.",
-             StringValueCStr(str));
-  }
-}
-
 void
 Init_gumath_examples(void)
 {
@@ -119,8 +98,4 @@ Init_gumath_examples(void)
     mGumath_Examples = Qundef;
     rb_raise(rb_eLoadError, "failed to load functions into Gumath::Examples module.");
   }
-
-  /* Singleton methods */
-  rb_define_singleton_method(mGumath_Examples, "method_missing",
-                             mGumath_Examples_s_method_missing, -1);
 }
@@ -82,7 +82,11 @@ dir_config("gumath", [headers], [binaries])
 # for macOS
 append_ldflags("-Wl,-rpath #{binaries}")
 
-basenames = %w{util gufunc_object examples functions ruby_gumath}
+have_header("pthread.h")
+have_library("dl", "dlopen") if unix?
+have_header("dlfcn.h")
+
+basenames = %w{util gufunc_object examples functions thread_pool reduce fuse ruby_gumath}
 $objs = basenames.map { |b| "#{b}.o"   }
 $srcs = basenames.map { |b| "#{b}.c" }
 
@@ -39,35 +39,6 @@ static gm_tbl_t *table = NULL;
 static VALUE mGumath_Functions;
 static int initialized = 0;
 
-/****************************************************************************/
-/*                              Singleton methods                           */
-/****************************************************************************/
-/* Gumath::GumathFunctions::method_missing
- *
- * The method_missing gets called on the module when a user invokes Fn.f_name
- * where f_name is the name of a method. We then perform a lookup in the hash
- * representing the method names and lambdas and then use the 'call' method
- * for calling the lambda.
- */
-static VALUE
-mGumath_Functions_s_method_missing(int argc, VALUE *argv, VALUE module)
-{
-  VALUE method_name = argv[0];
-  VALUE method_hash = rb_ivar_get(module, GUMATH_FUNCTION_HASH);
-  VALUE gumath_method = rb_hash_aref(method_hash, method_name);
-  int is_present = RTEST(gumath_method);
-  
-  if (is_present) {
-/* pass argc-1 since the first argument is the name of the method in method_missing. */
-    rb_funcall2(gumath_method, rb_intern("call"), argc-1, &argv[1]);
-  }
-  else {
-    VALUE str = rb_funcall(method_name, rb_intern("to_s"), 0, NULL);
-    rb_raise(rb_eNoMethodError, "Method %s not present in this gumath module.",
-             StringValueCStr(str));
-  }
-}
-
 void Init_gumath_functions(void)
 {
   /* Initialize gumath built-in function table. */
@@ -107,8 +78,4 @@ void Init_gumath_functions(void)
     mGumath_Functions = Qundef;
     rb_raise(rb_eLoadError, "failed to load functions into module Gumath::Functions.");
   }
-
-  /* Singleton methods */
-  rb_define_singleton_method(mGumath_Functions, "method_missing",
-                             mGumath_Functions_s_method_missing, -1);
 }
@@ -0,0 +1,532 @@
+/* BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Quansight and Sameer Deshmukh
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Fused elementwise expressions.
+ *
+ * An expression recorded by Gumath.fuse is a program of function calls on
+ * registers: the inputs come first, then the result of each call, and the
+ * last register is the output. Evaluating it call by call would write a
+ * full size temporary for every call and read it back for the next one.
+ *
+ * Here the outermost dimension is cut into tiles of a few rows that fit
+ * into the cache, and the whole program runs on one tile before going on
+ * to the next. Intermediate results live in scratch registers of one tile,
+ * so each input is read once and the output is written once. The tiles
+ * are split between the threads of the pool, each with its own scratch.
+ *
+ * Calls that do not depend on any tiled register, for example on scalar
+ * constants only, run once before the tiles.
+ */
+
+#include "ruby_gumath_internal.h"
+#include "thread_pool.h"
+
+/* Maximum number of registers of a program. */
+#define FUSE_MAX_REGS 64
+
+/* Bytes of the largest register in a tile. */
+#define FUSE_TILE_BYTES (1 << 14)
+
+/* Kernel plans for full tiles and for the last tile. Calls that are not
+   tiled only use the first one. */
+#define FUSE_FULL 0
+#define FUSE_LAST 1
+
+typedef struct {
+  GufuncObject *func;
+  int nargs;                    /* number of operands */
+  int args[NDT_MAX_ARGS];       /* operand registers */
+  gm_kernel_t kernel[2];
+  ndt_apply_spec_t spec[2];
+} fuse_instr_t;
+
+typedef struct fuse_prog fuse_prog_t;
+
+/* Tiles first..last-1, run by one thread. */
+typedef struct {
+  const fuse_prog_t *prog;
+  xnd_master_t *scratch[FUSE_MAX_REGS];
+  int64_t first;
+  int64_t last;
+  ndt_context_t ctx;
+  int ret;
+} fuse_part_t;
+
+struct fuse_prog {
+  int nin;
+  int ninstr;
+  int nregs;
+  fuse_instr_t instr[FUSE_MAX_REGS];
+  xnd_t base[FUSE_MAX_REGS];          /* inputs, untiled results, output */
+  const ndt_t *full[FUSE_MAX_REGS];   /* complete types of the registers */
+  bool tiled[FUSE_MAX_REGS];
+  xnd_master_t *whole[FUSE_MAX_REGS]; /* untiled intermediate results */
+  int64_t n;                          /* length of the tiled dimension */
+  int64_t rows;                       /* rows of a full tile */
+  int64_t ntiles;
+  fuse_part_t *parts;
+  int64_t nparts;
+};
+
+/* Return the rows of register r that start at row r0. */
+static xnd_t
+fuse_rows(const xnd_t *x, int64_t r0)
+{
+  xnd_t rows = *x;
+
+  rows.index += r0 * x->type->Concrete.FixedDim.step;
+  return rows;
+}
+
+static int
+fuse_tile(const fuse_prog_t *p, fuse_part_t *part, int64_t tile)
+{
+  const int plan = tile == p->ntiles-1 ? FUSE_LAST : FUSE_FULL;
+  const int64_t r0 = tile * p->rows;
+  xnd_t regs[FUSE_MAX_REGS];
+  xnd_t stack[NDT_MAX_ARGS];
+
+  for (int r = 0; r < p->nregs; r++) {
+    if (!p->tiled[r]) {
+      regs[r] = p->base[r];
+    }
+    else if (r < p->nin || r == p->nregs-1) {
+      regs[r] = fuse_rows(&p->base[r], r0);
+    }
+    else {
+      regs[r] = part->scratch[r]->master;
+    }
+  }
+
+  for (int k = 0; k < p->ninstr; k++) {
+    const fuse_instr_t *in = &p->instr[k];
+    const ndt_apply_spec_t *spec = &in->spec[plan];
+
+    if (!p->tiled[p->nin+k]) {
+      continue;
+    }
+
+    for (int j = 0; j < in->nargs; j++) {
+      stack[j] = regs[in->args[j]];
+      stack[j].type = spec->types[j];
+    }
+    stack[in->nargs] = regs[p->nin+k];
+    stack[in->nargs].type = spec->types[in->nargs];
+
+    if (gm_apply(&in->kernel[plan], stack, spec->outer_dims, &part->ctx) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void
+fuse_part_run(void *arg)
+{
+  fuse_part_t *part = (fuse_part_t *)arg;
+
+  for (int64_t tile = part->first; tile < part->last; tile++) {
+    part->ret = fuse_tile(part->prog, part, tile);
+    if (part->ret < 0) {
+      return;
+    }
+  }
+}
+
+static void *
+fuse_without_gvl(void *ptr)
+{
+  fuse_prog_t *p = (fuse_prog_t *)ptr;
+  const int rounding = fegetround();
+
+  fesetround(FE_TONEAREST);
+  pool_each(fuse_part_run, p->parts, sizeof *p->parts, p->nparts);
+  fesetround(rounding);
+
+  return NULL;
+}
+
+/* Select the kernel of call k for the register types in regs. */
+static void
+fuse_select(fuse_prog_t *p, int k, const xnd_t regs[], int plan)
+{
+  NDT_STATIC_CONTEXT(ctx);
+  fuse_instr_t *in = &p->instr[k];
+  const ndt_t *types[NDT_MAX_ARGS];
+  int64_t li[NDT_MAX_ARGS];
+  xnd_t stack[NDT_MAX_ARGS];
+
+  for (int j = 0; j < in->nargs; j++) {
+    stack[j] = regs[in->args[j]];
+    types[j] = stack[j].type;
+    li[j] = stack[j].index;
+  }
+
+  in->kernel[plan] = gm_select(&in->spec[plan], in->func->table, in->func->name,
+                               types, li, in->nargs, 0, false, stack, &ctx);
+  if (in->kernel[plan].set == NULL) {
+    seterr(&ctx);
+    raise_error();
+  }
+
+  if (in->spec[plan].nout != 1) {
+    rb_raise(rb_eTypeError, "only functions with one output can be fused.");
+  }
+}
+
+/* Select the kernels of the tiled calls for tiles of h rows. */
+static void
+fuse_plan(fuse_prog_t *p, int64_t h, int plan)
+{
+  NDT_STATIC_CONTEXT(ctx);
+  xnd_t regs[FUSE_MAX_REGS];
+  xnd_index_t key;
+
+  key.tag = Slice;
+  key.Slice.start = 0;
+  key.Slice.stop = h;
+  key.Slice.step = 1;
+
+  for (int r = 0; r < p->nin; r++) {
+    regs[r] = p->base[r];
+    if (p->tiled[r]) {
+      regs[r] = xnd_subscript(&p->base[r], &key, 1, &ctx);
+      if (regs[r].ptr == NULL) {
+        for (int i = 0; i < r; i++) {
+          if (p->tiled[i]) {
+            ndt_decref(regs[i].type);
+          }
+        }
+        seterr(&ctx);
+        raise_error();
+      }
+    }
+  }
+
+  for (int k = 0; k < p->ninstr; k++) {
+    const int r = p->nin + k;
+
+    if (!p->tiled[r]) {
+      regs[r] = p->base[r];
+      continue;
+    }
+
+    fuse_select(p, k, regs, plan);
+    regs[r] = (xnd_t){ .bitmap = xnd_bitmap_empty, .index = 0,
+                       .type = p->instr[k].spec[plan].types[p->instr[k].nargs],
+                       .ptr = NULL };
+  }
+
+  for (int r = 0; r < p->nin; r++) {
+    if (p->tiled[r]) {
+      ndt_decref(regs[r].type);
+    }
+  }
+}
+
+/* Return true if every tiled call loops over the tiled dimension: it has
+   an outer dimension of length n that spans its result and its tiled
+   operands. */
+static bool
+fuse_tileable(const fuse_prog_t *p)
+{
+  for (int k = 0; k < p->ninstr; k++) {
+    const fuse_instr_t *in = &p->instr[k];
+    const ndt_apply_spec_t *spec = &in->spec[FUSE_LAST];
+    const ndt_t *u = spec->types[in->nargs];
+
+    if (!p->tiled[p->nin+k]) {
+      continue;
+    }
+
+    if (spec->outer_dims < 1 || u->tag != FixedDim || u->FixedDim.shape != p->n) {
+      return false;
+    }
+
+    for (int j = 0; j < in->nargs; j++) {
+      if (p->tiled[in->args[j]] &&
+          p->full[in->args[j]]->ndim != spec->types[j]->ndim) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+struct fuse_args {
+  fuse_prog_t *prog;
+  VALUE funcs;
+  VALUE operands;
+  VALUE inputs;
+  int64_t nthreads;
+};
+
+static VALUE
+fuse_body(VALUE arg)
+{
+  NDT_STATIC_CONTEXT(ctx);
+  struct fuse_args *a = (struct fuse_args *)arg;
+  fuse_prog_t *p = a->prog;
+  const ndt_t *t;
+  int64_t rowbytes = 1;
+  VALUE out;
+
+  p->nin = (int)RARRAY_LEN(a->inputs);
+  p->ninstr = (int)RARRAY_LEN(a->funcs);
+  p->nregs = p->nin + p->ninstr;
+
+  if (p->ninstr == 0 || RARRAY_LEN(a->operands) != p->ninstr) {
+    rb_raise(rb_eArgError, "expected one list of operands for each function.");
+  }
+  if (p->nregs > FUSE_MAX_REGS) {
+    rb_raise(rb_eArgError, "an expression can have at most %d inputs and calls.",
+             FUSE_MAX_REGS);
+  }
+
+  /* inputs are only read, and every call writes to a register allocated
+     here, so read-only inputs need no check. */
+  for (int r = 0; r < p->nin; r++) {
+    VALUE x = rb_ary_entry(a->inputs, r);
+    if (!rb_xnd_check_type(x)) {
+      rb_raise(rb_eArgError, "expected xnd arguments.");
+    }
+    p->base[r] = *rb_xnd_const_xnd(x);
+    p->full[r] = p->base[r].type;
+    ndt_incref(p->full[r]);
+  }
+
+  /* types of the complete results, using the kernel plan of the last tile
+     for now. */
+  for (int k = 0; k < p->ninstr; k++) {
+    fuse_instr_t *in = &p->instr[k];
+    VALUE ops = rb_ary_entry(a->operands, k);
+
+    GET_GUOBJ(rb_ary_entry(a->funcs, k), in->func);
+    Check_Type(ops, T_ARRAY);
+    in->nargs = (int)RARRAY_LEN(ops);
+    if (in->nargs < 1 || in->nargs >= NDT_MAX_ARGS) {
+      rb_raise(rb_eArgError, "invalid number of operands.");
+    }
+    for (int j = 0; j < in->nargs; j++) {
+      in->args[j] = NUM2INT(rb_ary_entry(ops, j));
+      if (in->args[j] < 0 || in->args[j] >= p->nin + k) {
+        rb_raise(rb_eArgError, "operand %d of call %d is not an earlier register.", j, k);
+      }
+    }
+
+    fuse_select(p, k, p->base, FUSE_LAST);
+    p->full[p->nin+k] = in->spec[FUSE_LAST].types[in->nargs];
+    ndt_incref(p->full[p->nin+k]);
+    p->base[p->nin+k] = (xnd_t){ .bitmap = xnd_bitmap_empty, .index = 0,
+                                 .type = p->full[p->nin+k], .ptr = NULL };
+  }
+
+  /* registers that span the outermost dimension of the output are tiled,
+     as are the results of calls on them. */
+  t = p->full[p->nregs-1];
+  p->n = t->ndim > 0 && t->tag == FixedDim ? t->FixedDim.shape : -1;
+  for (int r = 0; r < p->nregs; r++) {
+    if (r < p->nin) {
+      const ndt_t *u = p->full[r];
+      p->tiled[r] = p->n >= 0 && u->ndim == t->ndim && u->tag == FixedDim &&
+                    u->FixedDim.shape == p->n;
+    }
+    else {
+      const fuse_instr_t *in = &p->instr[r-p->nin];
+      p->tiled[r] = false;
+      for (int j = 0; j < in->nargs; j++) {
+        p->tiled[r] |= p->tiled[in->args[j]];
+      }
+    }
+  }
+
+  /* a call can only run on tiles if the tiled dimension is its outermost
+     loop dimension. When a core dimension of some call takes it instead,
+     the whole program runs untiled. */
+  if (!fuse_tileable(p)) {
+    memset(p->tiled, 0, sizeof p->tiled);
+  }
+
+  for (int r = 0; r < p->nregs; r++) {
+    if (p->tiled[r] && p->n > 0) {
+      const int64_t b = p->full[r]->datasize / p->n;
+      rowbytes = b > rowbytes ? b : rowbytes;
+    }
+  }
+
+  out = rb_xnd_empty_from_type(cXND, t, 0);
+  p->base[p->nregs-1] = *rb_xnd_const_xnd(out);
+
+  /* calls that are not tiled run once on their complete operands. */
+  for (int k = 0; k < p->ninstr; k++) {
+    fuse_instr_t *in = &p->instr[k];
+    const int r = p->nin + k;
+    xnd_t stack[NDT_MAX_ARGS];
+
+    if (p->tiled[r]) {
+      ndt_apply_spec_clear(&in->spec[FUSE_LAST]);
+      in->spec[FUSE_LAST] = ndt_apply_spec_empty;
+      continue;
+    }
+
+    if (r != p->nregs-1) {
+      p->whole[r] = xnd_empty_from_type(p->full[r], XND_OWN_EMBEDDED, &ctx);
+      if (p->whole[r] == NULL) {
+        seterr(&ctx);
+        raise_error();
+      }
+      p->base[r] = p->whole[r]->master;
+    }
+
+    for (int j = 0; j < in->nargs; j++) {
+      stack[j] = p->base[in->args[j]];
+      stack[j].type = in->spec[FUSE_LAST].types[j];
+    }
+    stack[in->nargs] = p->base[r];
+    stack[in->nargs].type = in->spec[FUSE_LAST].types[in->nargs];
+
+    if (gm_apply(&in->kernel[FUSE_LAST], stack, in->spec[FUSE_LAST].outer_dims, &ctx) < 0) {
+      seterr(&ctx);
+      raise_error();
+    }
+  }
+
+  if (!p->tiled[p->nregs-1] || p->n == 0) {
+    return out;
+  }
+
+  p->rows = FUSE_TILE_BYTES / rowbytes;
+  p->rows = p->rows < 1 ? 1 : p->rows > p->n ? p->n : p->rows;
+  p->ntiles = (p->n + p->rows - 1) / p->rows;
+
+  fuse_plan(p, p->rows, FUSE_FULL);
+  fuse_plan(p, p->n - (p->ntiles-1) * p->rows, FUSE_LAST);
+
+  p->nparts = 1;
+  if (a->nthreads > 1 && t->datasize >= POOL_MIN_BYTES) {
+    p->nparts = a->nthreads < p->ntiles ? a->nthreads : p->ntiles;
+  }
+  p->parts = ZALLOC_N(fuse_part_t, p->nparts);
+
+  for (int64_t i = 0; i < p->nparts; i++) {
+    fuse_part_t *part = &p->parts[i];
+
+    part->prog = p;
+    part->first = p->ntiles * i / p->nparts;
+    part->last = p->ntiles * (i+1) / p->nparts;
+    part->ctx = (ndt_context_t){ .flags=0, .err=NDT_Success, .msg=ConstMsg,
+                                 .ConstMsg="Success" };
+
+    for (int r = p->nin; r < p->nregs-1; r++) {
+      if (p->tiled[r]) {
+        const fuse_instr_t *in = &p->instr[r-p->nin];
+        part->scratch[r] = xnd_empty_from_type(in->spec[FUSE_FULL].types[in->nargs],
+                                               XND_OWN_EMBEDDED, &ctx);
+        if (part->scratch[r] == NULL) {
+          seterr(&ctx);
+          raise_error();
+        }
+      }
+    }
+  }
+
+  rb_thread_call_without_gvl(fuse_without_gvl, p, NULL, NULL);
+
+  for (int64_t i = 0; i < p->nparts; i++) {
+    if (p->parts[i].ret < 0) {
+      seterr(&p->parts[i].ctx);
+      raise_error();
+    }
+  }
+
+  RB_GC_GUARD(a->inputs);
+  return out;
+}
+
+static VALUE
+fuse_free(VALUE arg)
+{
+  fuse_prog_t *p = ((struct fuse_args *)arg)->prog;
+
+  for (int r = 0; r < FUSE_MAX_REGS; r++) {
+    if (p->full[r] != NULL) {
+      ndt_decref(p->full[r]);
+    }
+    if (p->whole[r] != NULL) {
+      xnd_del(p->whole[r]);
+    }
+  }
+
+  for (int k = 0; k < FUSE_MAX_REGS; k++) {
+    if (p->instr[k].spec[FUSE_FULL].nargs > 0) {
+      ndt_apply_spec_clear(&p->instr[k].spec[FUSE_FULL]);
+    }
+    if (p->instr[k].spec[FUSE_LAST].nargs > 0) {
+      ndt_apply_spec_clear(&p->instr[k].spec[FUSE_LAST]);
+    }
+  }
+
+  for (int64_t i = 0; i < p->nparts; i++) {
+    for (int r = 0; r < FUSE_MAX_REGS; r++) {
+      if (p->parts[i].scratch[r] != NULL) {
+        xnd_del(p->parts[i].scratch[r]);
+      }
+    }
+    if (ndt_err_occurred(&p->parts[i].ctx)) {
+      ndt_err_clear(&p->parts[i].ctx);
+    }
+  }
+
+  xfree(p->parts);
+  xfree(p);
+
+  return Qnil;
+}
+
+VALUE
+gumath_fuse(VALUE funcs, VALUE operands, VALUE inputs, int64_t nthreads)
+{
+  struct fuse_args args;
+
+  Check_Type(funcs, T_ARRAY);
+  Check_Type(operands, T_ARRAY);
+  Check_Type(inputs, T_ARRAY);
+
+  args.prog = ZALLOC(fuse_prog_t);
+  args.funcs = funcs;
+  args.operands = operands;
+  args.inputs = inputs;
+  args.nthreads = nthreads;
+
+  return rb_ensure(fuse_body, (VALUE)&args, fuse_free, (VALUE)&args);
+}
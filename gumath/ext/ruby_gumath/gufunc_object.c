@@ -29,7 +29,7 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include "gufunc_object.h"
+#include "ruby_gumath_internal.h"
 
 /****************************************************************************/
 /*                               Gufunc Object                              */
@@ -49,6 +49,9 @@ GufuncObject_dfree(void *self)
 {
   GufuncObject *guobj = (GufuncObject*)self;
   ndt_free(guobj->name);        /* ndt_free because we use ndt_strdup in _alloc. */
+  dispatch_clear(guobj);
+  xfree(guobj->cache);
+  xfree(guobj);
 }
 
 static size_t
@@ -85,6 +88,193 @@ GufuncObject_alloc(const gm_tbl_t *table, const char *name, const uint32_t flags
 
   guobj_p->flags = flags;
   guobj_p->identity = Qnil;
+  guobj_p->cache = NULL;
 
   return guobj;
 }
+
+/****************************************************************************/
+/*                              Dispatch cache                              */
+/****************************************************************************/
+
+/* gm_select type checks the arguments against every kernel signature of a
+ * function. Its result only depends on the argument types, their linear
+ * indices and the 'out' and 'dtype' arguments, so it is kept per function
+ * in a small direct mapped cache. Kernels with a constraint are never
+ * cached, since a constraint may look at the data of the arguments.
+ */
+
+static int
+dispatch_key_equal(const dispatch_entry_t *e, const ndt_t *types[],
+                   const int64_t li[], int nin, int nout, const ndt_t *dtype,
+                   bool same_types)
+{
+  const int nargs = nin + nout;
+
+  if (!e->used || e->nin != nin || e->nout != nout) {
+    return 0;
+  }
+
+  if (e->dtype != dtype &&
+      (e->dtype == NULL || dtype == NULL || !ndt_equal(e->dtype, dtype))) {
+    return 0;
+  }
+
+  for (int i = 0; i < nargs; i++) {
+    if (e->li[i] != li[i]) {
+      return 0;
+    }
+    if (e->types[i] != types[i] && (same_types || !ndt_equal(e->types[i], types[i]))) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+static ndt_ssize_t
+dispatch_hash(const ndt_t *types[], const int64_t li[], int nargs,
+              const ndt_t *dtype)
+{
+  NDT_STATIC_CONTEXT(ctx);
+  ndt_ssize_t h = nargs;
+
+  for (int i = 0; i < nargs; i++) {
+    const ndt_ssize_t u = ndt_hash(types[i], &ctx);
+    if (u == -1) {
+      ndt_err_clear(&ctx);
+      return -1;
+    }
+    h = (h * 1000003) ^ u ^ (ndt_ssize_t)li[i];
+  }
+
+  if (dtype != NULL) {
+    const ndt_ssize_t u = ndt_hash(dtype, &ctx);
+    if (u == -1) {
+      ndt_err_clear(&ctx);
+      return -1;
+    }
+    h = (h * 1000003) ^ u;
+  }
+
+  return h == -1 ? -2 : h;
+}
+
+static void
+dispatch_entry_clear(dispatch_entry_t *e)
+{
+  if (!e->used) {
+    return;
+  }
+
+  for (int i = 0; i < e->nin + e->nout; i++) {
+    ndt_decref(e->types[i]);
+  }
+  if (e->dtype != NULL) {
+    ndt_decref(e->dtype);
+  }
+  ndt_apply_spec_clear(&e->spec);
+  e->used = false;
+}
+
+/* Look up the kernel selected for the argument types. On a hit, kernel and
+   spec are set and spec holds new references to its types. On a miss,
+   hash is set to the key hash for dispatch_store, or -1 if the key cannot
+   be hashed. */
+bool
+dispatch_lookup(GufuncObject *guobj, const ndt_t *types[], const int64_t li[],
+                int nin, int nout, const ndt_t *dtype, ndt_ssize_t *hash,
+                gm_kernel_t *kernel, ndt_apply_spec_t *spec)
+{
+  dispatch_cache_t *cache = guobj->cache;
+  dispatch_entry_t *e = NULL;
+
+  *hash = -1;
+
+  if (cache == NULL) {
+    cache = guobj->cache = ZALLOC(dispatch_cache_t);
+  }
+
+  /* repeated calls on the same arrays pass the same type objects. */
+  if (cache->last != NULL &&
+      dispatch_key_equal(cache->last, types, li, nin, nout, dtype, true)) {
+    e = cache->last;
+  }
+  else {
+    *hash = dispatch_hash(types, li, nin + nout, dtype);
+    if (*hash != -1) {
+      dispatch_entry_t *slot = &cache->entries[(size_t)*hash % GM_DISPATCH_CACHE_SIZE];
+      if (slot->hash == *hash &&
+          dispatch_key_equal(slot, types, li, nin, nout, dtype, false)) {
+        e = slot;
+      }
+    }
+  }
+
+  if (e == NULL) {
+    cache->misses++;
+    return false;
+  }
+
+  *kernel = e->kernel;
+  *spec = e->spec;
+  for (int i = 0; i < spec->nargs; i++) {
+    ndt_incref(spec->types[i]);
+  }
+
+  cache->last = e;
+  cache->hits++;
+  return true;
+}
+
+/* Remember the kernel and spec selected for the argument types. */
+void
+dispatch_store(GufuncObject *guobj, ndt_ssize_t hash, const ndt_t *types[],
+               const int64_t li[], int nin, int nout, const ndt_t *dtype,
+               const gm_kernel_t *kernel, const ndt_apply_spec_t *spec)
+{
+  dispatch_cache_t *cache = guobj->cache;
+  dispatch_entry_t *e;
+
+  if (cache == NULL || hash == -1 || kernel->set->constraint != NULL) {
+    return;
+  }
+
+  e = &cache->entries[(size_t)hash % GM_DISPATCH_CACHE_SIZE];
+  dispatch_entry_clear(e);
+
+  e->hash = hash;
+  e->nin = nin;
+  e->nout = nout;
+  for (int i = 0; i < nin + nout; i++) {
+    ndt_incref(types[i]);
+    e->types[i] = types[i];
+    e->li[i] = li[i];
+  }
+  if (dtype != NULL) {
+    ndt_incref(dtype);
+  }
+  e->dtype = dtype;
+  e->kernel = *kernel;
+  e->spec = *spec;
+  for (int i = 0; i < spec->nargs; i++) {
+    ndt_incref(spec->types[i]);
+  }
+  e->used = true;
+
+  cache->last = e;
+}
+
+/* Drop all entries; the hit and miss counters are kept. */
+void
+dispatch_clear(GufuncObject *guobj)
+{
+  if (guobj->cache == NULL) {
+    return;
+  }
+
+  for (int i = 0; i < GM_DISPATCH_CACHE_SIZE; i++) {
+    dispatch_entry_clear(&guobj->cache->entries[i]);
+  }
+  guobj->cache->last = NULL;
+}
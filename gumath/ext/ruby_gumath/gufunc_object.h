@@ -31,16 +31,43 @@
 #ifndef GUFUNC_OBJECT_H
 #define GUFUNC_OBJECT_H
 
-#include "ruby_gumath_internal.h"
+#include <ruby.h>
+#include "ndtypes.h"
+#include "xnd.h"
+#include "gumath.h"
 
 #define GM_CPU_FUNC  0x0001U
 #define GM_CUDA_MANAGED_FUNC 0x0002U
 
+#define GM_DISPATCH_CACHE_SIZE 16
+
+/* Kernel and apply spec selected by gm_select for one set of argument
+   types. The entry holds references to all types in it. */
+typedef struct {
+  bool used;
+  ndt_ssize_t hash;
+  int nin;                        /* number of inputs */
+  int nout;                       /* number of explicit 'out' arguments */
+  const ndt_t *types[NDT_MAX_ARGS];
+  int64_t li[NDT_MAX_ARGS];
+  const ndt_t *dtype;             /* 'dtype' argument or NULL */
+  gm_kernel_t kernel;
+  ndt_apply_spec_t spec;
+} dispatch_entry_t;
+
+typedef struct {
+  dispatch_entry_t entries[GM_DISPATCH_CACHE_SIZE];
+  dispatch_entry_t *last;         /* entry of the previous hit or store */
+  int64_t hits;
+  int64_t misses;
+} dispatch_cache_t;
+
 typedef struct {
   const gm_tbl_t *table;          /* kernel table */
   char *name;                     /* function name */
   uint32_t flags;                 /* memory target */
   VALUE identity;                 /* identity element */
+  dispatch_cache_t *cache;        /* gm_select results, NULL until first call */
 } GufuncObject;
 
 extern const rb_data_type_t GufuncObject_type;
@@ -58,4 +85,21 @@ extern VALUE cGumath_GufuncObject;
 VALUE GufuncObject_alloc(const gm_tbl_t *table, const char *name,
                            const uint32_t flags);
 
+bool dispatch_lookup(GufuncObject *guobj, const ndt_t *types[], const int64_t li[],
+                     int nin, int nout, const ndt_t *dtype, ndt_ssize_t *hash,
+                     gm_kernel_t *kernel, ndt_apply_spec_t *spec);
+void dispatch_store(GufuncObject *guobj, ndt_ssize_t hash, const ndt_t *types[],
+                    const int64_t li[], int nin, int nout, const ndt_t *dtype,
+                    const gm_kernel_t *kernel, const ndt_apply_spec_t *spec);
+void dispatch_clear(GufuncObject *guobj);
+
+/* Reduce the naxes leading dimensions of x into acc with func, starting
+   from its identity or else from the first subarray. Returns acc. */
+VALUE gumath_fold(GufuncObject *func, VALUE acc, VALUE x, int naxes, int64_t nthreads);
+
+/* Run a program recorded by Gumath.fuse: call funcs[k] on the registers
+   operands[k], where the inputs are the first registers and the result of
+   each call is the next one. Returns the result of the last call. */
+VALUE gumath_fuse(VALUE funcs, VALUE operands, VALUE inputs, int64_t nthreads);
+
 #endif
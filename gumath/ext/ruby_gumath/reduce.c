@@ -0,0 +1,683 @@
+/* BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Quansight and Sameer Deshmukh
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Reductions of a binary function over the leading dimensions of an array.
+ *
+ * The accumulator is first filled with the identity of the function, or
+ * with the first subarray of the reduced dimensions if it has none. Then
+ * it is folded with each remaining subarray in turn. The kernel is selected
+ * once and applied with the accumulator as its first input and its output,
+ * so every step runs the kernel's own loop over the dimensions that are
+ * kept, on the pool if they are large enough.
+ *
+ * Reductions of an ndarray of fixed width numbers with add or multiply do
+ * not need the kernel. The kept elements and the outermost reduced
+ * dimension are split into parts that are folded in C on the pool. The
+ * partial results are then combined into the accumulator. Inside a part,
+ * a contiguous reduced dimension is folded along its lines. Otherwise,
+ * contiguous kept elements are folded row by row of the reduced
+ * dimensions. Other functions take one kernel call per reduced subarray.
+ */
+
+#include "ruby_gumath_internal.h"
+#include "thread_pool.h"
+
+/****************************************************************************/
+/*                        Add and multiply in C                             */
+/****************************************************************************/
+
+typedef enum { FOLD_ADD, FOLD_MULTIPLY } fold_op_t;
+
+/* A partial result: int64 and uint64 wrap like C, floats are doubles. */
+typedef union {
+  uint64_t bits;
+  double real;
+} fold_acc_t;
+
+/* Layout of a reduction of the naxes leading dimensions of x. */
+typedef struct {
+  xnd_t x;
+  const ndt_t *dtype;
+  int naxes;
+  fold_op_t op;
+  bool real;                    /* accumulate in real, else in bits */
+  bool rows;                    /* fold whole rows of kept elements */
+  int kdim;                     /* kept dimensions */
+  int64_t kshape[NDT_MAX_DIM];
+  int64_t kstep[NDT_MAX_DIM];
+  int64_t nkept;                /* number of kept elements */
+} fold_plan_t;
+
+/* Kept elements j0..j1-1 folded over the subarrays r0..r1-1 of the
+   outermost reduced dimension. */
+typedef struct {
+  const fold_plan_t *plan;
+  int64_t j0;
+  int64_t j1;
+  int64_t r0;
+  int64_t r1;
+  fold_acc_t *acc;              /* j1-j0 partial results */
+} fold_part_t;
+
+/* Fold n elements that are step elements apart into *a. Contiguous data is
+   folded into four independent accumulators, which the compiler can keep
+   in vector registers. */
+#define FOLD_LINE(T, ACC, field, OP, ID) do {              \
+    const T *p = (const T *)data;                          \
+    ACC a0 = a->field, a1 = ID, a2 = ID, a3 = ID;          \
+    int64_t i = 0;                                         \
+    if (step == 1) {                                       \
+      for (; i+4 <= n; i += 4) {                           \
+        a0 = a0 OP (ACC)p[i];                              \
+        a1 = a1 OP (ACC)p[i+1];                            \
+        a2 = a2 OP (ACC)p[i+2];                            \
+        a3 = a3 OP (ACC)p[i+3];                            \
+      }                                                    \
+    }                                                      \
+    for (; i < n; i++) {                                   \
+      a0 = a0 OP (ACC)p[i*step];                           \
+    }                                                      \
+    a->field = (a0 OP a1) OP (a2 OP a3);                   \
+  } while (0)
+
+/* Fold n contiguous elements into the n accumulators at a. */
+#define FOLD_ROW(T, ACC, field, OP, ID) do {               \
+    const T *p = (const T *)data;                          \
+    for (int64_t i = 0; i < n; i++) {                      \
+      a[i].field = a[i].field OP (ACC)p[i];                \
+    }                                                      \
+  } while (0)
+
+#define FOLD_TYPE(LOOP, T, ACC, field) do {                \
+    if (plan->op == FOLD_ADD) {                            \
+      LOOP(T, ACC, field, +, 0);                           \
+    }                                                      \
+    else {                                                 \
+      LOOP(T, ACC, field, *, 1);                           \
+    }                                                      \
+  } while (0)
+
+#define FOLD_SWITCH(LOOP) do {                                         \
+    switch (plan->dtype->tag) {                                        \
+    case Int8: FOLD_TYPE(LOOP, int8_t, uint64_t, bits); break;         \
+    case Int16: FOLD_TYPE(LOOP, int16_t, uint64_t, bits); break;       \
+    case Int32: FOLD_TYPE(LOOP, int32_t, uint64_t, bits); break;       \
+    case Int64: FOLD_TYPE(LOOP, int64_t, uint64_t, bits); break;       \
+    case Uint8: FOLD_TYPE(LOOP, uint8_t, uint64_t, bits); break;       \
+    case Uint16: FOLD_TYPE(LOOP, uint16_t, uint64_t, bits); break;     \
+    case Uint32: FOLD_TYPE(LOOP, uint32_t, uint64_t, bits); break;     \
+    case Uint64: FOLD_TYPE(LOOP, uint64_t, uint64_t, bits); break;     \
+    case Float32: FOLD_TYPE(LOOP, float, double, real); break;         \
+    case Float64: FOLD_TYPE(LOOP, double, double, real); break;        \
+    default: break;                                                    \
+    }                                                                  \
+  } while (0)
+
+static void
+fold_line(const fold_plan_t *plan, fold_acc_t *a, const char *data, int64_t n,
+          int64_t step)
+{
+  FOLD_SWITCH(FOLD_LINE);
+}
+
+static void
+fold_row(const fold_plan_t *plan, fold_acc_t *a, const char *data, int64_t n)
+{
+  FOLD_SWITCH(FOLD_ROW);
+}
+
+/* Return the address of the first element of the ndarray x. */
+static char *
+fold_data(const xnd_t *x)
+{
+  return x->type->ndim == 0 ? x->ptr : x->ptr + x->index * ndt_dtype(x->type)->datasize;
+}
+
+static const char *
+fold_ptr(const fold_plan_t *plan, int64_t index)
+{
+  return plan->x.ptr + index * plan->dtype->datasize;
+}
+
+/* Fold the subarrays start..stop-1 of the fixed dimension t at index and
+   the levels-1 reduced dimensions below it into *a. */
+static void
+fold_walk(const fold_plan_t *plan, fold_acc_t *a, const ndt_t *t, int64_t index,
+          int64_t start, int64_t stop, int levels)
+{
+  const ndt_t *u = t->FixedDim.type;
+  const int64_t step = t->Concrete.FixedDim.step;
+
+  if (levels == 1) {
+    fold_line(plan, a, fold_ptr(plan, index + start*step), stop-start, step);
+    return;
+  }
+
+  for (int64_t i = start; i < stop; i++) {
+    fold_walk(plan, a, u, index + i*step, 0, u->FixedDim.shape, levels-1);
+  }
+}
+
+/* Like fold_walk, but fold the contiguous kept elements j0..j1-1 of each
+   reduced subarray into a[0..j1-j0-1]. */
+static void
+fold_walk_rows(const fold_plan_t *plan, const fold_part_t *part, const ndt_t *t,
+               int64_t index, int64_t start, int64_t stop, int levels)
+{
+  const ndt_t *u = t->FixedDim.type;
+  const int64_t step = t->Concrete.FixedDim.step;
+
+  for (int64_t i = start; i < stop; i++) {
+    if (levels == 1) {
+      fold_row(plan, part->acc, fold_ptr(plan, index + i*step + part->j0),
+               part->j1 - part->j0);
+    }
+    else {
+      fold_walk_rows(plan, part, u, index + i*step, 0, u->FixedDim.shape, levels-1);
+    }
+  }
+}
+
+/* Return the offset of kept element j in C order from its subarray. */
+static int64_t
+fold_kept_offset(const fold_plan_t *plan, int64_t j)
+{
+  int64_t offset = 0;
+
+  for (int k = plan->kdim-1; k >= 0; k--) {
+    offset += (j % plan->kshape[k]) * plan->kstep[k];
+    j /= plan->kshape[k];
+  }
+
+  return offset;
+}
+
+static void
+fold_part(void *arg)
+{
+  const fold_part_t *part = (const fold_part_t *)arg;
+  const fold_plan_t *plan = part->plan;
+  const ndt_t *t = plan->x.type;
+
+  if (plan->rows) {
+    fold_walk_rows(plan, part, t, plan->x.index, part->r0, part->r1, plan->naxes);
+    return;
+  }
+
+  for (int64_t j = part->j0; j < part->j1; j++) {
+    fold_walk(plan, &part->acc[j-part->j0], t,
+              plan->x.index + fold_kept_offset(plan, j), part->r0, part->r1,
+              plan->naxes);
+  }
+}
+
+static void
+fold_combine(const fold_plan_t *plan, fold_acc_t *a, const fold_acc_t *b)
+{
+  if (plan->real) {
+    a->real = plan->op == FOLD_ADD ? a->real + b->real : a->real * b->real;
+  }
+  else {
+    a->bits = plan->op == FOLD_ADD ? a->bits + b->bits : a->bits * b->bits;
+  }
+}
+
+/* Return true if the reduction of the naxes leading dimensions of x into
+   acc with function name can be done in C, and fill in plan. acc must be
+   C-contiguous, have the shape of the kept dimensions and the type that
+   Gumath::MAXCAST gives for the dtype of x. */
+static bool
+fold_fast_plan(fold_plan_t *plan, const char *name, const xnd_t *acc,
+               const xnd_t *x, int naxes)
+{
+  const ndt_t *t = x->type;
+  const ndt_t *u = acc->type;
+  const ndt_t *adtype;
+  enum ndt acc_tag;
+  int64_t contiguous = 1;
+
+  if (strcmp(name, "add") == 0) {
+    plan->op = FOLD_ADD;
+  }
+  else if (strcmp(name, "multiply") == 0) {
+    plan->op = FOLD_MULTIPLY;
+  }
+  else {
+    return false;
+  }
+
+  if (naxes == 0 || !ndt_is_ndarray(t) || !ndt_is_ndarray(u) ||
+      !ndt_is_c_contiguous(u) || u->ndim != t->ndim - naxes) {
+    return false;
+  }
+
+  plan->x = *x;
+  plan->dtype = ndt_dtype(t);
+  plan->naxes = naxes;
+  adtype = ndt_dtype(u);
+  if (ndt_is_optional(plan->dtype) || ndt_is_optional(adtype) ||
+      (plan->dtype->flags & (NDT_LITTLE_ENDIAN|NDT_BIG_ENDIAN)) ||
+      (adtype->flags & (NDT_LITTLE_ENDIAN|NDT_BIG_ENDIAN))) {
+    return false;
+  }
+
+  switch (plan->dtype->tag) {
+  case Int8: case Int16: case Int32: case Int64:
+    acc_tag = Int64;
+    break;
+  case Uint8: case Uint16: case Uint32: case Uint64:
+    acc_tag = Uint64;
+    break;
+  case Float32: case Float64:
+    acc_tag = Float64;
+    break;
+  default:
+    return false;
+  }
+  if (adtype->tag != acc_tag) {
+    return false;
+  }
+  plan->real = acc_tag == Float64;
+
+  /* the dimensions below the reduced ones must match acc. */
+  for (int k = 0; k < naxes; k++) {
+    if (k == naxes-1) {
+      plan->rows = t->Concrete.FixedDim.step != 1;
+    }
+    t = t->FixedDim.type;
+  }
+  plan->kdim = u->ndim;
+  plan->nkept = 1;
+  for (int k = 0; k < plan->kdim; k++) {
+    if (t->FixedDim.shape != u->FixedDim.shape) {
+      return false;
+    }
+    plan->kshape[k] = t->FixedDim.shape;
+    plan->kstep[k] = t->Concrete.FixedDim.step;
+    plan->nkept *= plan->kshape[k];
+    t = t->FixedDim.type;
+    u = u->FixedDim.type;
+  }
+
+  /* rows of kept elements only help if they are contiguous. */
+  for (int k = plan->kdim-1; k >= 0; k--) {
+    if (plan->kshape[k] != 1 && plan->kstep[k] != contiguous) {
+      plan->rows = false;
+    }
+    contiguous *= plan->kshape[k];
+  }
+  if (plan->kdim == 0) {
+    plan->rows = false;
+  }
+
+  return true;
+}
+
+struct fold_fast_args {
+  const fold_plan_t *plan;
+  fold_part_t *parts;
+  int64_t nparts;
+  int64_t nr;                   /* splits of the outermost reduced dimension */
+  fold_acc_t *partial;          /* nr rows of nkept partial results */
+  fold_acc_t *acc;              /* data of the accumulator */
+};
+
+static void *
+fold_fast_without_gvl(void *ptr)
+{
+  struct fold_fast_args *args = (struct fold_fast_args *)ptr;
+  const fold_plan_t *plan = args->plan;
+
+  pool_each(fold_part, args->parts, sizeof *args->parts, args->nparts);
+
+  for (int64_t r = 0; r < args->nr; r++) {
+    for (int64_t j = 0; j < plan->nkept; j++) {
+      fold_combine(plan, &args->acc[j], &args->partial[r*plan->nkept + j]);
+    }
+  }
+
+  return NULL;
+}
+
+/* Reduce the naxes leading dimensions of x into acc in C. Return false if
+   the function or the types are not supported. */
+static bool
+fold_fast(const char *name, const xnd_t *acc, const xnd_t *x, int naxes,
+          int64_t nthreads)
+{
+  fold_plan_t plan;
+  struct fold_fast_args args;
+  fold_part_t part_small[1];
+  const ndt_t *t = x->type;
+  int64_t nparts = 1, nk, nr;
+
+  if (!fold_fast_plan(&plan, name, acc, x, naxes)) {
+    return false;
+  }
+
+  for (int k = 0; k < naxes; k++) {
+    if (t->FixedDim.shape == 0) {
+      return true;
+    }
+    t = t->FixedDim.type;
+  }
+  if (plan.nkept == 0) {
+    return true;
+  }
+
+  /* split the kept elements first, then the outermost reduced dimension. */
+  if (nthreads > 1 && x->type->datasize >= POOL_MIN_BYTES) {
+    nparts = nthreads;
+  }
+  nk = nparts < plan.nkept ? nparts : plan.nkept;
+  nr = nparts / nk;
+  nr = nr < x->type->FixedDim.shape ? nr : x->type->FixedDim.shape;
+
+  args.plan = &plan;
+  args.nparts = nk * nr;
+  args.nr = nr;
+  args.parts = args.nparts > 1 ? ALLOC_N(fold_part_t, args.nparts) : part_small;
+  args.partial = ALLOC_N(fold_acc_t, nr * plan.nkept);
+  args.acc = (fold_acc_t *)fold_data(acc);
+
+  for (int64_t i = 0; i < nr * plan.nkept; i++) {
+    if (plan.real) {
+      args.partial[i].real = plan.op == FOLD_ADD ? 0 : 1;
+    }
+    else {
+      args.partial[i].bits = plan.op == FOLD_ADD ? 0 : 1;
+    }
+  }
+
+  for (int64_t k = 0; k < nk; k++) {
+    for (int64_t r = 0; r < nr; r++) {
+      fold_part_t *part = &args.parts[k*nr + r];
+      const int64_t shape = x->type->FixedDim.shape;
+
+      part->plan = &plan;
+      part->j0 = plan.nkept * k / nk;
+      part->j1 = plan.nkept * (k+1) / nk;
+      part->r0 = shape * r / nr;
+      part->r1 = shape * (r+1) / nr;
+      part->acc = args.partial + r*plan.nkept + part->j0;
+    }
+  }
+
+  rb_thread_call_without_gvl(fold_fast_without_gvl, &args, NULL, NULL);
+
+  if (args.parts != part_small) {
+    xfree(args.parts);
+  }
+  xfree(args.partial);
+
+  return true;
+}
+
+/****************************************************************************/
+/*                               Accumulator                                */
+/****************************************************************************/
+
+/* Copy the scalar s into every element of the fixed dimensions of acc. */
+static int
+fold_fill_walk(const xnd_t *acc, const xnd_t *s, ndt_context_t *ctx)
+{
+  const ndt_t *t = acc->type;
+
+  if (t->ndim == 0) {
+    return xnd_copy((xnd_t *)acc, s, 0, ctx);
+  }
+
+  if (t->tag != FixedDim) {
+    ndt_err_format(ctx, NDT_NotImplementedError,
+                   "only fixed dimensions can be kept in a reduction");
+    return -1;
+  }
+
+  for (int64_t i = 0; i < t->FixedDim.shape; i++) {
+    const xnd_t next = xnd_fixed_dim_next(acc, i);
+    if (fold_fill_walk(&next, s, ctx) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Fill acc with the identity of a function. */
+static void
+fold_fill(VALUE acc, VALUE identity)
+{
+  NDT_STATIC_CONTEXT(ctx);
+  const xnd_t *a = rb_xnd_const_xnd(acc);
+  const ndt_t *dtype = ndt_dtype(a->type);
+  VALUE argv[2], s;
+  int ret;
+
+  argv[0] = identity;
+  argv[1] = rb_hash_new();
+  rb_hash_aset(argv[1], ID2SYM(rb_intern("type")), rb_ndtypes_from_type(dtype));
+  s = rb_funcallv_kw(cXND, rb_intern("new"), 2, argv, RB_PASS_KEYWORDS);
+
+  if (ndt_is_c_contiguous(a->type) && ndt_is_pointer_free(dtype) &&
+      !ndt_is_optional(dtype) && a->type->datasize > 0) {
+    /* copy the first element, then double the copied prefix. */
+    char *data = fold_data(a);
+    const xnd_t first = { .bitmap = a->bitmap, .index = 0, .type = dtype,
+                          .ptr = data };
+    int64_t done = dtype->datasize;
+
+    ret = xnd_copy((xnd_t *)&first, rb_xnd_const_xnd(s), 0, &ctx);
+    while (ret == 0 && done < a->type->datasize) {
+      const int64_t n = done < a->type->datasize - done ? done : a->type->datasize - done;
+      memcpy(data + done, data, n);
+      done += n;
+    }
+  }
+  else {
+    ret = fold_fill_walk(a, rb_xnd_const_xnd(s), &ctx);
+  }
+  RB_GC_GUARD(s);
+
+  if (ret < 0) {
+    seterr(&ctx);
+    raise_error();
+  }
+}
+
+/****************************************************************************/
+/*                               Kernel folds                               */
+/****************************************************************************/
+
+/* Return subarray i in C order of the naxes leading dimensions of x. */
+static xnd_t
+fold_item(const xnd_t *x, const int64_t shape[], int naxes, int64_t i)
+{
+  int64_t index[NDT_MAX_DIM];
+  xnd_t item = *x;
+
+  for (int k = naxes-1; k >= 0; k--) {
+    index[k] = i % shape[k];
+    i /= shape[k];
+  }
+  for (int k = 0; k < naxes; k++) {
+    item = xnd_fixed_dim_next(&item, index[k]);
+  }
+
+  return item;
+}
+
+/* Arguments of fold_without_gvl. */
+struct fold_args {
+  const gm_kernel_t *kernel;
+  xnd_t *stack;                 /* acc, subarray, acc */
+  const xnd_t *x;
+  const int64_t *shape;
+  int naxes;
+  int64_t start;
+  int64_t n;
+  int outer_dims;
+  int64_t nthreads;
+  ndt_context_t *ctx;
+  int ret;
+};
+
+/* Apply the kernel to the accumulator and each subarray from args->start
+   on. Called without the GVL. */
+static void *
+fold_without_gvl(void *ptr)
+{
+  struct fold_args *args = (struct fold_args *)ptr;
+  const ndt_t *t = args->stack[1].type;
+  const int rounding = fegetround();
+
+  fesetround(FE_TONEAREST);
+  for (int64_t i = args->start; i < args->n; i++) {
+    args->stack[1] = fold_item(args->x, args->shape, args->naxes, i);
+    args->stack[1].type = t;
+
+    args->ret = pool_apply(args->kernel, args->stack, 3, args->outer_dims,
+                           args->nthreads, POOL_MIN_BYTES, args->ctx);
+    if (args->ret < 0) {
+      break;
+    }
+  }
+  fesetround(rounding);
+
+  return NULL;
+}
+
+VALUE
+gumath_fold(GufuncObject *func, VALUE acc, VALUE x, int naxes, int64_t nthreads)
+{
+  NDT_STATIC_CONTEXT(ctx);
+  const xnd_t *xp = rb_xnd_const_xnd(x);
+  const ndt_t *t = xp->type;
+  int64_t shape[NDT_MAX_DIM];
+  int64_t n = 1, start;
+  xnd_t stack[3];
+  const ndt_t *types[3];
+  const ndt_t *key_types[3];
+  int64_t li[3];
+  gm_kernel_t kernel;
+  ndt_apply_spec_t spec = ndt_apply_spec_empty;
+  ndt_ssize_t hash;
+
+  if (func->flags & GM_CUDA_MANAGED_FUNC) {
+    rb_raise(rb_eNotImpError, "reductions of cuda functions are not supported.");
+  }
+
+  if (rb_xnd_is_readonly(acc)) {
+    rb_raise(rb_eFrozenError, "cannot reduce into a read-only XND buffer.");
+  }
+
+  if (naxes < 0 || naxes > t->ndim) {
+    rb_raise(rb_eArgError, "cannot reduce %d dimensions of a %d-dimensional array.",
+             naxes, t->ndim);
+  }
+
+  for (int k = 0; k < naxes; k++) {
+    if (t->tag != FixedDim) {
+      rb_raise(rb_eNotImpError, "only fixed dimensions can be reduced.");
+    }
+    shape[k] = t->FixedDim.shape;
+    n *= shape[k];
+    t = t->FixedDim.type;
+  }
+
+  stack[0] = *rb_xnd_const_xnd(acc);
+  if (!NIL_P(func->identity)) {
+    fold_fill(acc, func->identity);
+    start = 0;
+  }
+  else {
+    if (n == 0) {
+      rb_raise(rb_const_get(rb_cObject, rb_intern("ValueError")),
+               "reduction of an empty array with a function that has no identity.");
+    }
+    stack[1] = fold_item(xp, shape, naxes, 0);
+    if (xnd_copy(&stack[0], &stack[1], 0, &ctx) < 0) {
+      seterr(&ctx);
+      raise_error();
+    }
+    start = 1;
+  }
+
+  if (start >= n) {
+    return acc;
+  }
+
+  if (start == 0 && fold_fast(func->name, &stack[0], xp, naxes, nthreads)) {
+    RB_GC_GUARD(x);
+    return acc;
+  }
+
+  /* all subarrays have the same type. */
+  stack[1] = fold_item(xp, shape, naxes, start);
+  stack[2] = stack[0];
+  for (int k = 0; k < 3; k++) {
+    types[k] = key_types[k] = stack[k].type;
+    li[k] = stack[k].index;
+  }
+
+  if (!dispatch_lookup(func, types, li, 2, 1, NULL, &hash, &kernel, &spec)) {
+    kernel = gm_select(&spec, func->table, func->name, types, li, 2, 1, true,
+                       stack, &ctx);
+    if (kernel.set == NULL) {
+      seterr(&ctx);
+      raise_error();
+    }
+    dispatch_store(func, hash, key_types, li, 2, 1, NULL, &kernel, &spec);
+  }
+
+  if (spec.nout != 1) {
+    ndt_apply_spec_clear(&spec);
+    rb_raise(rb_eTypeError, "only functions with one output can be reduced.");
+  }
+
+  for (int k = 0; k < spec.nargs; k++) {
+    stack[k].type = spec.types[k];
+  }
+
+  struct fold_args args = { &kernel, stack, xp, shape, naxes, start, n,
+                            spec.outer_dims, nthreads, &ctx, 0 };
+
+  rb_thread_call_without_gvl(fold_without_gvl, &args, NULL, NULL);
+  RB_GC_GUARD(x);
+  RB_GC_GUARD(acc);
+
+  ndt_apply_spec_clear(&spec);
+  if (args.ret < 0) {
+    seterr(&ctx);
+    raise_error();
+  }
+
+  return acc;
+}
@@ -29,6 +29,11 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "ruby_gumath_internal.h"
+#include "thread_pool.h"
+
+#ifdef HAVE_DLFCN_H
+#include <dlfcn.h>
+#endif
 
 /* libxnd.so is not linked without at least one xnd symbol. */
 const void *dummy = NULL;
@@ -45,6 +50,9 @@ static int64_t max_threads = 1;
 static int initialized = 0;
 VALUE cGumath;
 
+/* Module of the kernels added with Gumath.unsafe_add_kernel. */
+static VALUE mGumath_Kernels;
+
 /****************************************************************************/
 /*                               Error handling                             */
 /****************************************************************************/
@@ -57,6 +65,91 @@ seterr(ndt_context_t *ctx)
   return rb_ndtypes_set_error(ctx);
 }
 
+/****************************************************************************/
+/*                             Parallel thresholds                          */
+/****************************************************************************/
+
+/* Calls on fewer bytes than this are too short to be timed reliably. */
+#define TUNE_MIN_BYTES (1 << 14)
+
+/* Learned parallel threshold of a kernel set. */
+typedef struct {
+  char *key;                    /* "name: signature" */
+  int64_t threshold;            /* bytes needed to use the pool, -1 if unknown */
+} tune_entry_t;
+
+static st_table *tune_sets = NULL;   /* gm_kernel_set_t * -> tune_entry_t * */
+static st_table *tune_keys = NULL;   /* key -> tune_entry_t * */
+static double tune_overhead = -1;    /* ns per pool batch, -1 if not measured */
+
+static tune_entry_t *
+tune_entry(const char *key)
+{
+  st_data_t data;
+  tune_entry_t *e;
+
+  if (st_lookup(tune_keys, (st_data_t)key, &data)) {
+    return (tune_entry_t *)data;
+  }
+
+  e = ALLOC(tune_entry_t);
+  e->key = ruby_strdup(key);
+  e->threshold = -1;
+  st_insert(tune_keys, (st_data_t)e->key, (st_data_t)e);
+
+  return e;
+}
+
+/* Return the entry of the kernel set selected for function name. The key
+   is built once per kernel set. */
+static tune_entry_t *
+tune_lookup(const char *name, const gm_kernel_set_t *set)
+{
+  NDT_STATIC_CONTEXT(ctx);
+  st_data_t data;
+  tune_entry_t *e;
+  VALUE key;
+  char *sig;
+
+  if (st_lookup(tune_sets, (st_data_t)set, &data)) {
+    return (tune_entry_t *)data;
+  }
+
+  sig = ndt_as_string(set->sig, &ctx);
+  if (sig == NULL) {
+    seterr(&ctx);
+    raise_error();
+  }
+  key = rb_sprintf("%s: %s", name, sig);
+  ndt_free(sig);
+
+  e = tune_entry(StringValueCStr(key));
+  st_insert(tune_sets, (st_data_t)set, (st_data_t)e);
+
+  return e;
+}
+
+/* Learn the threshold of e from a serial run over work bytes that took
+   elapsed nanoseconds. On p threads n bytes take about n*cost/p + overhead,
+   which beats n*cost once n > overhead / (cost * (1 - 1/p)); p = 2 gives
+   the largest bound. */
+static void
+tune_learn(tune_entry_t *e, int64_t work, double elapsed, int64_t nthreads)
+{
+  double cost, threshold;
+
+  if (tune_overhead < 0) {
+    tune_overhead = pool_overhead(nthreads);
+    if (tune_overhead < 0) {
+      return;
+    }
+  }
+
+  cost = (elapsed > 1 ? elapsed : 1) / (double)work;
+  threshold = 2 * tune_overhead / cost;
+  e->threshold = threshold < (double)INT64_MAX ? (int64_t)threshold : INT64_MAX;
+}
+
 /****************************************************************************/
 /*                               Instance methods                           */
 /****************************************************************************/
@@ -114,6 +207,12 @@ parse_args(VALUE *rbstack, int *rb_nin, int *rb_nout, int *rb_nargs, int noptarg
     else {
       rb_raise(rb_eTypeError, "'out' argument must of type XND or Array of XND objects.");
     }
+
+    for (size_t i = 0; i < nout; ++i) {
+      if (rb_xnd_is_readonly(rbstack[nin+i])) {
+        rb_raise(rb_eFrozenError, "cannot write the result to a read-only XND buffer.");
+      }
+    }
   }
 
   *rb_nin = (int)nin;
@@ -121,13 +220,56 @@ parse_args(VALUE *rbstack, int *rb_nin, int *rb_nout, int *rb_nargs, int noptarg
   *rb_nargs = (int)nin + (int)nout;
 }
 
-/* Implement call method on the GufuncObject call. */
+/* Arguments of apply_without_gvl. */
+struct apply_args {
+  const gm_kernel_t *kernel;
+  xnd_t *stack;
+  int nargs;
+  int outer_dims;
+  int64_t nthreads;
+  int64_t min_bytes;
+  ndt_context_t *ctx;
+  int ret;
+  double elapsed;               /* nanoseconds */
+};
+
+static double
+apply_clock(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/* Run a selected kernel. Called without the GVL: touches no Ruby objects,
+   errors are reported through args->ctx. */
+static void *
+apply_without_gvl(void *ptr)
+{
+  struct apply_args *args = (struct apply_args *)ptr;
+  const int rounding = fegetround();
+  const double start = apply_clock();
+
+  fesetround(FE_TONEAREST);
+  args->ret = pool_apply(args->kernel, args->stack, args->nargs,
+                         args->outer_dims, args->nthreads, args->min_bytes,
+                         args->ctx);
+  fesetround(rounding);
+
+  args->elapsed = apply_clock() - start;
+
+  return NULL;
+}
+
+/* Apply the function of self_p to the arguments of a Ruby call. */
 static VALUE
-Gumath_GufuncObject_call(int argc, VALUE *argv, VALUE self)
+gufunc_call(GufuncObject *self_p, int argc, VALUE *argv)
 {
   VALUE out = Qnil;
   VALUE dt = Qnil;
   VALUE cls = Qnil;
+  VALUE threads = Qnil;
   
   NDT_STATIC_CONTEXT(ctx);
   VALUE rbstack[NDT_MAX_ARGS], opts = Qnil;
@@ -135,14 +277,15 @@ Gumath_GufuncObject_call(int argc, VALUE *argv, VALUE self)
   const ndt_t *types[NDT_MAX_ARGS];
   gm_kernel_t kernel;
   ndt_apply_spec_t spec = ndt_apply_spec_empty;
+  ndt_ssize_t hash;
   int64_t li[NDT_MAX_ARGS];
   NdtObject *dt_p;
   int k;
   ndt_t *dtype = NULL;
   int nin = argc, nout, nargs;
   bool have_cpu_device = false;
-  GufuncObject * self_p;
-  bool check_broadcast = true, enable_threads = true;
+  bool check_broadcast = true;
+  int64_t nthreads = max_threads;
 
   if (argc > NDT_MAX_ARGS) {
     rb_raise(rb_eArgError, "too many arguments.");
@@ -163,6 +306,14 @@ Gumath_GufuncObject_call(int argc, VALUE *argv, VALUE self)
   out = rb_hash_aref(opts, ID2SYM(rb_intern("out")));
   dt = rb_hash_aref(opts, ID2SYM(rb_intern("dtype")));
   cls = rb_hash_aref(opts, ID2SYM(rb_intern("cls")));
+  threads = rb_hash_aref(opts, ID2SYM(rb_intern("threads")));
+
+  if (!NIL_P(threads)) {
+    nthreads = NUM2LL(threads);
+    if (nthreads < 1) {
+      rb_raise(rb_eArgError, "the 'threads' argument must be positive.");
+    }
+  }
 
   if (NIL_P(cls)) { cls = cXND; }
   if (!NIL_P(dt)) {
@@ -193,8 +344,6 @@ Gumath_GufuncObject_call(int argc, VALUE *argv, VALUE self)
     types[k] = stack[k].type;
     li[k] = stack[k].index;
   }
-  GET_GUOBJ(self, self_p);
-  
   if (have_cpu_device) {
     if (self_p->flags & GM_CUDA_MANAGED_FUNC) {
       rb_raise(rb_eValueError,
@@ -202,43 +351,59 @@ Gumath_GufuncObject_call(int argc, VALUE *argv, VALUE self)
     }
   }
 
-  kernel = gm_select(&spec, self_p->table, self_p->name, types, li, nin, nout,
-                     nout && check_broadcast, stack, &ctx);
-
-  if (kernel.set == NULL) {
-    seterr(&ctx);
-    raise_error();
-  }
-
-  if (dtype) {
-    if (spec.nout != 1) {
-      ndt_err_format(&ctx, NDT_TypeError,
-                     "the 'dtype' argument is only supported for a single "
-                     "return value.");
-      ndt_apply_spec_clear(&spec);
+  if (dispatch_lookup(self_p, types, li, nin, nout, dtype, &hash, &kernel, &spec)) {
+    if (dtype) {
       ndt_decref(dtype);
-      seterr(&ctx);
-      raise_error();
     }
+  }
+  else {
+    /* dtype stays alive with dt, the input types with rbstack. */
+    const ndt_t *key_types[NDT_MAX_ARGS];
+    const ndt_t *key_dtype = dtype;
 
-    const ndt_t *u = spec.types[spec.nin];
-    const ndt_t *v = ndt_copy_contiguous_dtype(u, dtype, 0, &ctx);
+    memcpy(key_types, types, nargs * sizeof *types);
 
-    ndt_apply_spec_clear(&spec);
-    ndt_decref(dtype);
+    kernel = gm_select(&spec, self_p->table, self_p->name, types, li, nin, nout,
+                       nout && check_broadcast, stack, &ctx);
 
-    if (v == NULL) {
+    if (kernel.set == NULL) {
       seterr(&ctx);
       raise_error();
     }
 
-    types[nin] = v;
-    kernel = gm_select(&spec, self_p->table, self_p->name, types, li, nin, 1,
-                       1 && check_broadcast, stack, &ctx);
-    if (kernel.set == NULL) {
-      seterr(&ctx);
-      raise_error();
+    if (dtype) {
+      if (spec.nout != 1) {
+        ndt_err_format(&ctx, NDT_TypeError,
+                       "the 'dtype' argument is only supported for a single "
+                       "return value.");
+        ndt_apply_spec_clear(&spec);
+        ndt_decref(dtype);
+        seterr(&ctx);
+        raise_error();
+      }
+
+      const ndt_t *u = spec.types[spec.nin];
+      const ndt_t *v = ndt_copy_contiguous_dtype(u, dtype, 0, &ctx);
+
+      ndt_apply_spec_clear(&spec);
+      ndt_decref(dtype);
+
+      if (v == NULL) {
+        seterr(&ctx);
+        raise_error();
+      }
+
+      types[nin] = v;
+      kernel = gm_select(&spec, self_p->table, self_p->name, types, li, nin, 1,
+                         1 && check_broadcast, stack, &ctx);
+      if (kernel.set == NULL) {
+        seterr(&ctx);
+        raise_error();
+      }
     }
+
+    dispatch_store(self_p, hash, key_types, li, nin, nout, key_dtype, &kernel, &spec);
+    RB_GC_GUARD(dt);
   }
 
   /*
@@ -278,32 +443,32 @@ Gumath_GufuncObject_call(int argc, VALUE *argv, VALUE self)
 #endif // HAVE_CUDA
   }
   else {
-#ifdef HAVE_PTHREAD_H
-    const int rounding = fegetround();
-    fesetround(FE_TONEAREST);
-
-    const int64_t N = enable_threads ? max_threads : 1;
-    const int ret = gm_apply_thread(&kernel, stack, spec.outer_dims, N, &ctx);
-    fesetround(rounding);
-
-    if (ret < 0) {
+    /* The first large enough call of a kernel set runs serially to measure
+       its cost per byte. */
+    tune_entry_t *tune = tune_lookup(self_p->name, kernel.set);
+    const int64_t work = pool_work(stack, spec.nargs);
+    const bool measure = tune->threshold < 0 && nthreads > 1 &&
+                         work >= TUNE_MIN_BYTES;
+
+    /* All Ruby objects are in place: the arguments and outputs are held in
+       rbstack, so other Ruby threads can run during the apply phase. */
+    struct apply_args args = { &kernel, stack, spec.nargs, spec.outer_dims,
+                               measure ? 1 : nthreads,
+                               tune->threshold < 0 ? POOL_MIN_BYTES : tune->threshold,
+                               &ctx, 0, 0 };
+
+    rb_thread_call_without_gvl(apply_without_gvl, &args, NULL, NULL);
+    RB_GC_GUARD(rbstack[0]);
+
+    if (args.ret < 0) {
       ndt_apply_spec_clear(&spec);
       seterr(&ctx);
       raise_error();
     }
-#else
-    const int rounding = fegetround();
-    fesetround(FE_TONEAREST);
-
-    const int ret = gm_apply(&kernel, stack, spec.outer_dims, &ctx);
-    fesetround(rounding);
 
-    if (ret < 0) {
-      ndt_apply_spec_clear(&spec);
-      seterr(&ctx);
-      raise_error();
-    }    
-#endif // HAVE_PTHREAD_H
+    if (measure) {
+      tune_learn(tune, work, args.elapsed, nthreads);
+    }
   }
 
   nin = spec.nin;
@@ -328,29 +493,191 @@ Gumath_GufuncObject_call(int argc, VALUE *argv, VALUE self)
   }
 }
 
+/* Implement call method on the GufuncObject call. */
+static VALUE
+Gumath_GufuncObject_call(int argc, VALUE *argv, VALUE self)
+{
+  GufuncObject *self_p;
+
+  GET_GUOBJ(self, self_p);
+
+  return gufunc_call(self_p, argc, argv);
+}
 
-/****************************************************************************/
-/*                               Singleton methods                          */
-/****************************************************************************/
 
+/* Return a Hash with the hits and misses of the gm_select cache and the
+   number of cached entries. */
 static VALUE
-Gumath_s_unsafe_add_kernel(int argc, VALUE *argv, VALUE klass)
+Gumath_GufuncObject_cache_stats(VALUE self)
 {
-  /* TODO: implement this. */
+  GufuncObject *self_p;
+  VALUE hash = rb_hash_new();
+  int64_t hits = 0, misses = 0, entries = 0;
+
+  GET_GUOBJ(self, self_p);
+
+  if (self_p->cache != NULL) {
+    hits = self_p->cache->hits;
+    misses = self_p->cache->misses;
+    for (int i = 0; i < GM_DISPATCH_CACHE_SIZE; i++) {
+      entries += self_p->cache->entries[i].used;
+    }
+  }
+
+  rb_hash_aset(hash, ID2SYM(rb_intern("hits")), LL2NUM(hits));
+  rb_hash_aset(hash, ID2SYM(rb_intern("misses")), LL2NUM(misses));
+  rb_hash_aset(hash, ID2SYM(rb_intern("entries")), LL2NUM(entries));
+
+  return hash;
 }
 
+/* Return the identity element that reductions with this function start
+   from, or nil if it has none. */
+static VALUE
+Gumath_GufuncObject_identity(VALUE self)
+{
+  GufuncObject *self_p;
+
+  GET_GUOBJ(self, self_p);
+
+  return self_p->identity;
+}
+
+static VALUE
+Gumath_GufuncObject_set_identity(VALUE self, VALUE identity)
+{
+  GufuncObject *self_p;
+
+  GET_GUOBJ(self, self_p);
+  self_p->identity = identity;
+
+  return identity;
+}
+
+/* Drop the cached kernel selections of this function. */
+static VALUE
+Gumath_GufuncObject_clear_cache(VALUE self)
+{
+  GufuncObject *self_p;
+
+  GET_GUOBJ(self, self_p);
+  dispatch_clear(self_p);
+
+  return self;
+}
+
+/****************************************************************************/
+/*                               Singleton methods                          */
+/****************************************************************************/
+
 static VALUE
 Gumath_s_get_max_threads(VALUE klass)
 {
   return INT2NUM(max_threads);
 }
 
+/* Set the default number of threads a kernel is applied with. The worker
+   pool grows to this size when it is next used. */
 static VALUE
 Gumath_s_set_max_threads(VALUE klass, VALUE threads)
 {
   Check_Type(threads, T_FIXNUM);
-  
+
+  if (NUM2INT(threads) < 1) {
+    rb_raise(rb_eArgError, "number of threads must be positive.");
+  }
   max_threads = NUM2INT(threads);
+
+  return threads;
+}
+
+/* Reduce the naxes leading dimensions of x into acc with func. Used by
+   Gumath.reduce, which allocates acc with the type of the result. */
+static VALUE
+Gumath_s_fold(VALUE klass, VALUE func, VALUE acc, VALUE x, VALUE naxes)
+{
+  GufuncObject *func_p;
+
+  GET_GUOBJ(func, func_p);
+  if (!rb_xnd_check_type(acc) || !rb_xnd_check_type(x)) {
+    rb_raise(rb_eTypeError, "expected xnd arguments.");
+  }
+
+  return gumath_fold(func_p, acc, x, NUM2INT(naxes), max_threads);
+}
+
+/* Run a program recorded by Gumath.fuse on inputs. */
+static VALUE
+Gumath_s_fuse(VALUE klass, VALUE funcs, VALUE operands, VALUE inputs)
+{
+  return gumath_fuse(funcs, operands, inputs, max_threads);
+}
+
+static int
+tune_export(st_data_t key, st_data_t value, st_data_t arg)
+{
+  const tune_entry_t *e = (const tune_entry_t *)value;
+
+  if (e->threshold >= 0) {
+    rb_hash_aset((VALUE)arg, rb_str_new_cstr(e->key), LL2NUM(e->threshold));
+  }
+
+  return ST_CONTINUE;
+}
+
+/* Return a Hash of the parallel thresholds in bytes that are known, keyed
+   by "function: signature" of the kernel set. */
+static VALUE
+Gumath_s_thresholds(VALUE klass)
+{
+  VALUE hash = rb_hash_new();
+
+  st_foreach(tune_keys, tune_export, (st_data_t)hash);
+
+  return hash;
+}
+
+static int
+tune_import(VALUE key, VALUE value, VALUE arg)
+{
+  const int64_t threshold = NUM2LL(value);
+
+  if (threshold < 0) {
+    rb_raise(rb_eArgError, "threshold must not be negative.");
+  }
+  tune_entry(StringValueCStr(key))->threshold = threshold;
+
+  return ST_CONTINUE;
+}
+
+/* Set the thresholds of the kernel sets in hash, in the format returned
+   by Gumath.thresholds. Other kernel sets keep their thresholds. */
+static VALUE
+Gumath_s_set_thresholds(VALUE klass, VALUE hash)
+{
+  Check_Type(hash, T_HASH);
+  rb_hash_foreach(hash, tune_import, Qnil);
+
+  return hash;
+}
+
+static int
+tune_forget(st_data_t key, st_data_t value, st_data_t arg)
+{
+  ((tune_entry_t *)value)->threshold = -1;
+
+  return ST_CONTINUE;
+}
+
+/* Forget all thresholds and the measured pool overhead, so that every
+   kernel set is measured again on its next large enough call. */
+static VALUE
+Gumath_s_reset_thresholds(VALUE klass)
+{
+  st_foreach(tune_keys, tune_forget, 0);
+  tune_overhead = -1;
+
+  return Qnil;
 }
 
 /****************************************************************************/
@@ -369,11 +696,72 @@ init_max_threads(void)
 /*                                   C-API                                  */
 /****************************************************************************/
 
+/* Functions added to each module: module -> st_table of method ID ->
+   GufuncObject *. The modules are pinned, and the GufuncObjects are kept
+   alive by the @gumath_functions Hash of their module. */
+static st_table *module_functions = NULL;
+
+/* Singleton method defined for every function of a module. The function
+   is found by the name that the method was defined with. */
+static VALUE
+Gumath_s_call_function(int argc, VALUE *argv, VALUE module)
+{
+  st_data_t functions, func;
+
+  if (!st_lookup(module_functions, (st_data_t)module, &functions) ||
+      !st_lookup((st_table *)functions, (st_data_t)rb_frame_this_func(), &func)) {
+    rb_raise(rb_eNoMethodError, "method %"PRIsVALUE" not present in this gumath module.",
+             rb_id2str(rb_frame_this_func()));
+  }
+
+  return gufunc_call((GufuncObject *)func, argc, argv);
+}
+
 struct map_args {
   VALUE module;
   const gm_tbl_t *table;
+  st_table *functions;
 };
 
+/* Return the table of functions added to module, pinning the module the
+   first time. */
+static st_table *
+module_function_table(VALUE module)
+{
+  st_data_t functions;
+
+  if (module_functions == NULL) {
+    module_functions = st_init_numtable();
+  }
+
+  if (!st_lookup(module_functions, (st_data_t)module, &functions)) {
+    rb_gc_register_mark_object(module);
+    functions = (st_data_t)st_init_numtable();
+    st_insert(module_functions, (st_data_t)module, functions);
+  }
+
+  return (st_table *)functions;
+}
+
+/* Define the function name of a->table in a->module. */
+static VALUE
+define_function(struct map_args *a, const char *name)
+{
+  VALUE func, func_hash;
+  GufuncObject *func_p;
+
+  func = GufuncObject_alloc(a->table, name, GM_CPU_FUNC);
+
+  func_hash = rb_ivar_get(a->module, GUMATH_FUNCTION_HASH);
+  rb_hash_aset(func_hash, ID2SYM(rb_intern(name)), func);
+
+  GET_GUOBJ(func, func_p);
+  st_insert(a->functions, (st_data_t)rb_intern(name), (st_data_t)func_p);
+  rb_define_singleton_method(a->module, name, Gumath_s_call_function, -1);
+
+  return func;
+}
+
 /* Function called by libgumath that will load function kernels from function
    table of type gm_tbl_t into a Ruby module. Don't call this directly use
    rb_gumath_add_functions.
@@ -381,16 +769,7 @@ struct map_args {
 int
 add_function(const gm_func_t *f, void *args)
 {
-  struct map_args *a = (struct map_args *)args;
-  VALUE func, func_hash;
-
-  func = GufuncObject_alloc(a->table, f->name, GM_CPU_FUNC);
-  if (func == NULL) {
-    return -1;
-  }
-
-  func_hash = rb_ivar_get(a->module, GUMATH_FUNCTION_HASH);
-  rb_hash_aset(func_hash, ID2SYM(rb_intern(f->name)), func);
+  define_function((struct map_args *)args, f->name);
 
   return 0;
 }
@@ -398,11 +777,138 @@ add_function(const gm_func_t *f, void *args)
 int
 rb_gumath_add_functions(VALUE module, const gm_tbl_t *tbl)
 {
-  struct map_args args = {module, tbl};
+  struct map_args args = {module, tbl, module_function_table(module)};
 
   if (gm_tbl_map(tbl, add_function, &args) < 0) {
     return -1;
   }
+
+  return 0;
+}
+
+/****************************************************************************/
+/*                              Custom kernels                              */
+/****************************************************************************/
+
+/* Add the kernel at address ptr with signature sig to function name of
+   Gumath::Kernels. tag is the gm_kernel_init_t field that the kernel is
+   stored in. Nothing about the kernel can be checked. */
+static VALUE
+Gumath_s_unsafe_add_kernel(VALUE klass, VALUE name, VALUE sig, VALUE tag, VALUE ptr)
+{
+  NDT_STATIC_CONTEXT(ctx);
+  gm_kernel_init_t k = { NULL };
+  const char *tag_s = StringValueCStr(tag);
+  void *p = (void *)(uintptr_t)NUM2ULL(ptr);
+  struct map_args args;
+  VALUE func;
+
+  if (p == NULL) {
+    rb_raise(rb_eArgError, "kernel address must not be NULL.");
+  }
+
+  k.name = StringValueCStr(name);
+  k.sig = StringValueCStr(sig);
+
+  if (strcmp(tag_s, "OptC") == 0) {
+    k.OptC = (gm_xnd_kernel_t)p;
+  }
+  else if (strcmp(tag_s, "OptZ") == 0) {
+    k.OptZ = (gm_xnd_kernel_t)p;
+  }
+  else if (strcmp(tag_s, "OptS") == 0) {
+    k.OptS = (gm_xnd_kernel_t)p;
+  }
+  else if (strcmp(tag_s, "C") == 0) {
+    k.C = (gm_xnd_kernel_t)p;
+  }
+  else if (strcmp(tag_s, "Fortran") == 0) {
+    k.Fortran = (gm_xnd_kernel_t)p;
+  }
+  else if (strcmp(tag_s, "Xnd") == 0) {
+    k.Xnd = (gm_xnd_kernel_t)p;
+  }
+  else if (strcmp(tag_s, "Strided") == 0) {
+    k.Strided = (gm_strided_kernel_t)p;
+  }
+  else {
+    rb_raise(rb_eArgError, "invalid kernel tag %s.", tag_s);
+  }
+
+  if (gm_add_kernel(table, &k, &ctx) < 0) {
+    seterr(&ctx);
+    raise_error();
+  }
+
+  func = rb_hash_aref(rb_ivar_get(mGumath_Kernels, GUMATH_FUNCTION_HASH),
+                      ID2SYM(rb_intern(k.name)));
+  if (NIL_P(func)) {
+    args.module = mGumath_Kernels;
+    args.table = table;
+    args.functions = module_function_table(mGumath_Kernels);
+    func = define_function(&args, k.name);
+  }
+  else {
+    /* the new kernel may be a better match for cached argument types. */
+    GufuncObject *func_p;
+    GET_GUOBJ(func, func_p);
+    dispatch_clear(func_p);
+  }
+
+  return func;
+}
+
+/* Open the shared library at path and add the kernels of its
+   gm_kernel_init_t array named symbol, which ends with an entry whose name
+   is NULL, to a new module. The library stays loaded. */
+static VALUE
+Gumath_s_load_kernels(VALUE klass, VALUE path, VALUE symbol)
+{
+#ifdef HAVE_DLFCN_H
+  NDT_STATIC_CONTEXT(ctx);
+  const gm_kernel_init_t *kernels;
+  gm_tbl_t *tbl;
+  void *handle;
+  VALUE module;
+
+  handle = dlopen(StringValueCStr(path), RTLD_NOW|RTLD_LOCAL);
+  if (handle == NULL) {
+    rb_raise(rb_eLoadError, "%s", dlerror());
+  }
+
+  kernels = (const gm_kernel_init_t *)dlsym(handle, StringValueCStr(symbol));
+  if (kernels == NULL) {
+    VALUE msg = rb_str_new_cstr(dlerror());
+    dlclose(handle);
+    rb_raise(rb_eLoadError, "%"PRIsVALUE, msg);
+  }
+
+  tbl = gm_tbl_new(&ctx);
+  if (tbl == NULL) {
+    dlclose(handle);
+    seterr(&ctx);
+    raise_error();
+  }
+
+  for (const gm_kernel_init_t *k = kernels; k->name != NULL; k++) {
+    if (gm_add_kernel(tbl, k, &ctx) < 0) {
+      gm_tbl_del(tbl);
+      dlclose(handle);
+      seterr(&ctx);
+      raise_error();
+    }
+  }
+
+  module = rb_module_new();
+  rb_ivar_set(module, GUMATH_FUNCTION_HASH, rb_hash_new());
+  if (rb_gumath_add_functions(module, tbl) < 0) {
+    rb_raise(rb_eLoadError, "failed to load the kernels of %"PRIsVALUE".", path);
+  }
+
+  return module;
+#else
+  rb_raise(rb_eNotImpError, "loading kernels is not supported on this platform.");
+#endif
 }
 
 void Init_ruby_gumath(void)
@@ -429,6 +935,9 @@ void Init_ruby_gumath(void)
     }
 
     init_max_threads();
+    pool_init();
+    tune_sets = st_init_numtable();
+    tune_keys = st_init_strtable();
 
     initialized = 1;
   }
@@ -439,17 +948,30 @@ void Init_ruby_gumath(void)
   /* Class: Gumath */
   
   /* Singleton methods */
-  rb_define_singleton_method(cGumath, "unsafe_add_kernel", Gumath_s_unsafe_add_kernel, -1);
+  rb_define_singleton_method(cGumath, "_unsafe_add_kernel", Gumath_s_unsafe_add_kernel, 4);
+  rb_define_singleton_method(cGumath, "_load_kernels", Gumath_s_load_kernels, 2);
   rb_define_singleton_method(cGumath, "get_max_threads", Gumath_s_get_max_threads, 0);
   rb_define_singleton_method(cGumath, "set_max_threads", Gumath_s_set_max_threads, 1);
+  rb_define_singleton_method(cGumath, "thresholds", Gumath_s_thresholds, 0);
+  rb_define_singleton_method(cGumath, "thresholds=", Gumath_s_set_thresholds, 1);
+  rb_define_singleton_method(cGumath, "_reset_thresholds", Gumath_s_reset_thresholds, 0);
+  rb_define_singleton_method(cGumath, "_fold", Gumath_s_fold, 4);
+  rb_define_singleton_method(cGumath, "_fuse", Gumath_s_fuse, 3);
 
   /* Class: Gumath::GufuncObject */
 
   /* Instance methods */
   rb_define_method(cGumath_GufuncObject, "call", Gumath_GufuncObject_call,-1);
+  rb_define_method(cGumath_GufuncObject, "cache_stats", Gumath_GufuncObject_cache_stats, 0);
+  rb_define_method(cGumath_GufuncObject, "clear_cache", Gumath_GufuncObject_clear_cache, 0);
+  rb_define_method(cGumath_GufuncObject, "identity", Gumath_GufuncObject_identity, 0);
+  rb_define_method(cGumath_GufuncObject, "identity=", Gumath_GufuncObject_set_identity, 1);
 
   /* errors */
   rb_eValueError = rb_define_class("ValueError", rb_eRuntimeError);
+
+  mGumath_Kernels = rb_define_module_under(cGumath, "Kernels");
+  rb_ivar_set(mGumath_Kernels, GUMATH_FUNCTION_HASH, rb_hash_new());
   
   Init_gumath_functions();
   Init_gumath_examples();
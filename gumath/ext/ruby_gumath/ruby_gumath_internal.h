@@ -33,6 +33,9 @@
 #define RUBY_GUMATH_INTERNAL_H
 
 #include <ruby.h>
+#include <ruby/thread.h>
+#include <ruby/util.h>
+#include <time.h>
 #include "ndtypes.h"
 #include "ruby_ndtypes.h"
 #include "xnd.h"
@@ -0,0 +1,443 @@
+/* BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Quansight and Sameer Deshmukh
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Persistent worker threads for applying kernels in parallel.
+ *
+ * gm_apply_thread creates and joins one pthread per part on every call,
+ * which costs more than it saves for mid-sized arrays. Here the outermost
+ * dimension of the arguments is split with xnd_subscript and the parts are
+ * run with gm_apply by workers that are started once and then wait for
+ * the next batch. The calling thread runs parts as well.
+ *
+ * The pool is process-wide and serves one call at a time; a concurrent
+ * call applies its kernel in its own thread. It is created lazily, grows
+ * to the largest number of threads requested and is reset in the child
+ * after fork, where the workers no longer exist.
+ */
+
+#include "ruby_gumath_internal.h"
+#include "thread_pool.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+typedef struct {
+  void (*func)(void *);        /* task of pool_each, or NULL */
+  void *arg;
+  const gm_kernel_t *kernel;
+  xnd_t *stack;
+  int outer_dims;
+  ndt_context_t ctx;
+} pool_task_t;
+
+static struct {
+  pthread_mutex_t submit;      /* held while a batch is running */
+  pthread_mutex_t lock;        /* protects the fields below */
+  pthread_cond_t work;         /* a batch was submitted */
+  pthread_cond_t done;         /* the last task of a batch finished */
+  pthread_t *threads;
+  int64_t nthreads;
+  pool_task_t *tasks;
+  int64_t ntasks;
+  int64_t next;                /* next task to run */
+  int64_t pending;             /* tasks not finished yet */
+} pool = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+  NULL, 0, NULL, 0, 0, 0
+};
+
+static void
+pool_run(pool_task_t *task)
+{
+  if (task->func != NULL) {
+    task->func(task->arg);
+    return;
+  }
+  if (task->kernel == NULL) {
+    return;
+  }
+  (void)gm_apply(task->kernel, task->stack, task->outer_dims, &task->ctx);
+}
+
+/* Run tasks of the current batch until there are none left. Called and
+   returns with pool.lock held. */
+static void
+pool_drain(void)
+{
+  while (pool.next < pool.ntasks) {
+    pool_task_t *task = &pool.tasks[pool.next++];
+
+    pthread_mutex_unlock(&pool.lock);
+    pool_run(task);
+    pthread_mutex_lock(&pool.lock);
+
+    if (--pool.pending == 0) {
+      pthread_cond_signal(&pool.done);
+    }
+  }
+}
+
+static void *
+pool_worker(void *arg)
+{
+  pthread_mutex_lock(&pool.lock);
+  for (;;) {
+    while (pool.next >= pool.ntasks) {
+      pthread_cond_wait(&pool.work, &pool.lock);
+    }
+    pool_drain();
+  }
+
+  return NULL;
+}
+
+/* Start workers until there are n of them. Called with pool.submit held.
+   Workers block all signals, which are handled by Ruby's threads. */
+static void
+pool_grow(int64_t n)
+{
+  sigset_t all, old;
+  pthread_t *threads;
+
+  if (n <= pool.nthreads) {
+    return;
+  }
+
+  threads = realloc(pool.threads, n * sizeof *threads);
+  if (threads == NULL) {
+    return;
+  }
+  pool.threads = threads;
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  while (pool.nthreads < n) {
+    if (pthread_create(&pool.threads[pool.nthreads], NULL, pool_worker, NULL) != 0) {
+      break;
+    }
+    pthread_detach(pool.threads[pool.nthreads]);
+    pool.nthreads++;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* The workers are not copied into a child process, and a lock may have
+   been held by another thread at the time of the fork. */
+static void
+pool_atfork_child(void)
+{
+  pthread_mutex_init(&pool.submit, NULL);
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.work, NULL);
+  pthread_cond_init(&pool.done, NULL);
+
+  free(pool.threads);
+  pool.threads = NULL;
+  pool.nthreads = 0;
+  pool.tasks = NULL;
+  pool.ntasks = pool.next = pool.pending = 0;
+}
+
+int64_t
+pool_work(const xnd_t stack[], int nargs)
+{
+  int64_t size = 0;
+
+  for (int k = 0; k < nargs; k++) {
+    if (stack[k].type->datasize > size) {
+      size = stack[k].type->datasize;
+    }
+  }
+
+  return size;
+}
+
+/* Split the outermost dimension of all arguments into nparts slices of
+   equal length and store them in parts, nargs per task. Return the number
+   of parts, 0 if the arguments cannot be split or -1 on error. */
+static int64_t
+pool_split(xnd_t *parts, const xnd_t stack[], int nargs, int64_t nparts,
+           ndt_context_t *ctx)
+{
+  int64_t shape = -1;
+  xnd_index_t key;
+
+  for (int k = 0; k < nargs; k++) {
+    const ndt_t *t = stack[k].type;
+
+    if (t->tag != FixedDim || (shape >= 0 && t->FixedDim.shape != shape)) {
+      return 0;
+    }
+    shape = t->FixedDim.shape;
+  }
+
+  if (nparts > shape) {
+    nparts = shape;
+  }
+  if (nparts <= 1) {
+    return 0;
+  }
+
+  key.tag = Slice;
+  key.Slice.step = 1;
+
+  for (int64_t i = 0; i < nparts; i++) {
+    key.Slice.start = shape * i / nparts;
+    key.Slice.stop = shape * (i+1) / nparts;
+
+    for (int k = 0; k < nargs; k++) {
+      parts[i*nargs+k] = xnd_subscript(&stack[k], &key, 1, ctx);
+      if (parts[i*nargs+k].ptr == NULL) {
+        for (int64_t j = 0; j < i*nargs+k; j++) {
+          ndt_decref(parts[j].type);
+        }
+        return -1;
+      }
+    }
+  }
+
+  return nparts;
+}
+
+/* Run the tasks on the pool and the calling thread and wait until all of
+   them are finished. Called with pool.submit held. */
+static void
+pool_run_batch(pool_task_t *tasks, int64_t ntasks)
+{
+  pool_grow(ntasks-1);
+
+  pthread_mutex_lock(&pool.lock);
+  pool.tasks = tasks;
+  pool.ntasks = ntasks;
+  pool.next = 0;
+  pool.pending = ntasks;
+  pthread_cond_broadcast(&pool.work);
+
+  pool_drain();
+  while (pool.pending > 0) {
+    pthread_cond_wait(&pool.done, &pool.lock);
+  }
+
+  pool.tasks = NULL;
+  pool.ntasks = pool.next = 0;
+  pthread_mutex_unlock(&pool.lock);
+}
+
+static double
+pool_clock(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+double
+pool_overhead(int64_t nthreads)
+{
+  pool_task_t *tasks;
+  double best = -1;
+
+  if (nthreads <= 1 || pthread_mutex_trylock(&pool.submit) != 0) {
+    return -1;
+  }
+
+  tasks = calloc(nthreads, sizeof *tasks);
+  if (tasks != NULL) {
+    /* the first batch starts the workers. */
+    pool_run_batch(tasks, nthreads);
+    for (int i = 0; i < 8; i++) {
+      const double start = pool_clock();
+      pool_run_batch(tasks, nthreads);
+      const double t = pool_clock() - start;
+      if (best < 0 || t < best) {
+        best = t;
+      }
+    }
+    free(tasks);
+  }
+
+  pthread_mutex_unlock(&pool.submit);
+  return best;
+}
+
+int
+pool_apply(const gm_kernel_t *kernel, xnd_t stack[], int nargs,
+           int outer_dims, int64_t nthreads, int64_t min_bytes,
+           ndt_context_t *ctx)
+{
+  pool_task_t *tasks;
+  xnd_t *parts;
+  int64_t nparts, i;
+  int ret = 0;
+
+  if (nthreads <= 1 || outer_dims == 0 || nargs == 0 ||
+      pool_work(stack, nargs) < min_bytes) {
+    return gm_apply(kernel, stack, outer_dims, ctx);
+  }
+
+  if (pthread_mutex_trylock(&pool.submit) != 0) {
+    return gm_apply(kernel, stack, outer_dims, ctx);
+  }
+
+  parts = malloc(nthreads * nargs * sizeof *parts);
+  tasks = malloc(nthreads * sizeof *tasks);
+  if (parts == NULL || tasks == NULL) {
+    free(parts);
+    free(tasks);
+    pthread_mutex_unlock(&pool.submit);
+    return gm_apply(kernel, stack, outer_dims, ctx);
+  }
+
+  nparts = pool_split(parts, stack, nargs, nthreads, ctx);
+  if (nparts <= 0) {
+    free(parts);
+    free(tasks);
+    pthread_mutex_unlock(&pool.submit);
+    return nparts < 0 ? -1 : gm_apply(kernel, stack, outer_dims, ctx);
+  }
+
+  for (i = 0; i < nparts; i++) {
+    tasks[i].func = NULL;
+    tasks[i].kernel = kernel;
+    tasks[i].stack = parts + i*nargs;
+    tasks[i].outer_dims = outer_dims;
+    tasks[i].ctx = (ndt_context_t){ .flags=0, .err=NDT_Success, .msg=ConstMsg,
+                                    .ConstMsg="Success" };
+  }
+
+  pool_run_batch(tasks, nparts);
+  pthread_mutex_unlock(&pool.submit);
+
+  for (i = 0; i < nparts; i++) {
+    if (ndt_err_occurred(&tasks[i].ctx)) {
+      if (ret == 0) {
+        ndt_err_format(ctx, tasks[i].ctx.err, "%s", ndt_context_msg(&tasks[i].ctx));
+        ret = -1;
+      }
+      ndt_err_clear(&tasks[i].ctx);
+    }
+  }
+
+  for (i = 0; i < nparts*nargs; i++) {
+    ndt_decref(parts[i].type);
+  }
+  free(parts);
+  free(tasks);
+
+  return ret;
+}
+
+void
+pool_each(void (*func)(void *), void *args, size_t size, int64_t n)
+{
+  char *p = (char *)args;
+  pool_task_t *tasks;
+
+  if (n > 1 && pthread_mutex_trylock(&pool.submit) == 0) {
+    tasks = calloc(n, sizeof *tasks);
+    if (tasks != NULL) {
+      for (int64_t i = 0; i < n; i++) {
+        tasks[i].func = func;
+        tasks[i].arg = p + i*size;
+      }
+      pool_run_batch(tasks, n);
+      pthread_mutex_unlock(&pool.submit);
+      free(tasks);
+      return;
+    }
+    pthread_mutex_unlock(&pool.submit);
+  }
+
+  for (int64_t i = 0; i < n; i++) {
+    func(p + i*size);
+  }
+}
+
+int64_t
+pool_size(void)
+{
+  return pool.nthreads;
+}
+
+void
+pool_init(void)
+{
+  pthread_atfork(NULL, NULL, pool_atfork_child);
+}
+
+#else
+
+int
+pool_apply(const gm_kernel_t *kernel, xnd_t stack[], int nargs,
+           int outer_dims, int64_t nthreads, int64_t min_bytes,
+           ndt_context_t *ctx)
+{
+  return gm_apply(kernel, stack, outer_dims, ctx);
+}
+
+int64_t
+pool_work(const xnd_t stack[], int nargs)
+{
+  return 0;
+}
+
+double
+pool_overhead(int64_t nthreads)
+{
+  return -1;
+}
+
+void
+pool_each(void (*func)(void *), void *args, size_t size, int64_t n)
+{
+  char *p = (char *)args;
+
+  for (int64_t i = 0; i < n; i++) {
+    func(p + i*size);
+  }
+}
+
+int64_t
+pool_size(void)
+{
+  return 0;
+}
+
+void
+pool_init(void)
+{
+}
+
+#endif /* HAVE_PTHREAD_H */
@@ -0,0 +1,70 @@
+/* BSD 3-Clause License
+ *
+ * Copyright (c) 2018, Quansight and Sameer Deshmukh
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Persistent worker threads for applying kernels in parallel. */
+
+#ifndef GUMATH_THREAD_POOL_H
+#define GUMATH_THREAD_POOL_H
+
+#include "ruby_gumath_internal.h"
+
+/* Default for min_bytes of kernels whose cost has not been measured. */
+#define POOL_MIN_BYTES (1 << 18)
+
+/* Apply kernel to stack, splitting the outermost dimension into up to
+   nthreads parts that run on the pool. Falls back to gm_apply in the
+   calling thread if the largest argument has fewer than min_bytes bytes,
+   the arguments cannot be split or the pool is in use by another call.
+   Must be called without the GVL. */
+int pool_apply(const gm_kernel_t *kernel, xnd_t stack[], int nargs,
+               int outer_dims, int64_t nthreads, int64_t min_bytes,
+               ndt_context_t *ctx);
+
+/* Call func on each of the n elements of size bytes at args, on the pool
+   and in the calling thread, and wait until all calls have returned. The
+   calls run in the calling thread if the pool is in use by another call.
+   Must be called without the GVL. */
+void pool_each(void (*func)(void *), void *args, size_t size, int64_t n);
+
+/* Number of bytes of the largest argument in stack. */
+int64_t pool_work(const xnd_t stack[], int nargs);
+
+/* Measure the time in nanoseconds to run a batch of nthreads empty tasks
+   on the pool, or return -1 if the pool is busy or not available. */
+double pool_overhead(int64_t nthreads);
+
+/* Number of worker threads currently in the pool. */
+int64_t pool_size(void);
+
+/* Register the fork handler that resets the pool in a child process. */
+void pool_init(void);
+
+#endif  /* GUMATH_THREAD_POOL_H */
@@ -2,6 +2,8 @@ require 'ndtypes'
 require 'xnd'
 
 require 'etc'
+require 'json'
+require 'fileutils'
 
 begin
   require 'ruby_gumath.so'
@@ -9,6 +11,8 @@ rescue LoadError
   require 'ruby_gumath/ruby_gumath.so'
 end
 require 'gumath/version'
+require 'gumath/fuse'
+require 'gumath/codegen'
 
 class Gumath
   MAXCAST = {
@@ -45,17 +49,116 @@ class Gumath
     NDT.new("?complex128")=> NDT.new("?complex128"),
   }
   
+  # File that parallel thresholds are loaded from at require and saved to
+  # by Gumath.tune!. Set GUMATH_THRESHOLDS to use another file.
+  THRESHOLDS_PATH = ENV.fetch("GUMATH_THRESHOLDS") {
+    File.join(Dir.home, ".gumath", "thresholds.json") rescue nil
+  }
+
+  # Number of elements of the arrays that Gumath.tune! calls kernels with.
+  TUNE_SIZE = 1 << 16
+
   class << self
+    # Load thresholds saved by save_thresholds, if the file exists. Raises
+    # ArgumentError if the file does not hold thresholds.
+    def load_thresholds path=THRESHOLDS_PATH
+      return unless path && File.exist?(path)
+      thresholds = JSON.parse(File.read(path))
+      unless thresholds.is_a?(Hash) &&
+             thresholds.all? { |k, v| k.is_a?(String) && v.is_a?(Integer) && v >= 0 }
+        raise ArgumentError, "#{path} does not hold a Hash of non-negative Integer thresholds."
+      end
+      self.thresholds = thresholds
+    end
+
+    # Save the known thresholds as JSON.
+    def save_thresholds path=THRESHOLDS_PATH
+      FileUtils.mkdir_p File.dirname(path)
+      File.write path, JSON.pretty_generate(thresholds)
+    end
+
+    # Measure every kernel of Gumath::Functions that accepts one or two
+    # float64 or int64 arrays and learn its parallel threshold. Saves the
+    # thresholds to +path+ unless it is nil and returns them.
+    def tune! path: THRESHOLDS_PATH, size: TUNE_SIZE
+      _reset_thresholds
+      inputs = [
+        XND.new((1..size).map(&:to_f), type: "#{size} * float64"),
+        XND.new((1..size).to_a, type: "#{size} * int64")
+      ]
+
+      Functions.instance_variable_get(:@gumath_functions).each_value do |f|
+        inputs.each do |x|
+          [[x], [x, x]].each do |args|
+            begin
+              f.call(*args)
+            rescue StandardError
+              # signature does not match
+            end
+          end
+        end
+      end
+
+      save_thresholds path if path
+      thresholds
+    end
+
+    # Add a native kernel with signature sig to the function name of
+    # Gumath::Kernels and return the function. ptr is the address of the
+    # kernel, for example a Fiddle::Pointer, and tag is its kind: "OptC",
+    # "OptZ", "OptS", "C", "Fortran", "Xnd" or "Strided". The kernel is
+    # called as it is, so a wrong signature will crash the process.
+    def unsafe_add_kernel name:, sig:, tag:, ptr:
+      _unsafe_add_kernel(name.to_s, sig, tag.to_s, ptr.to_i)
+    end
+
+    # Load the kernels of a shared library into a new module and return
+    # it. The library must export a gm_kernel_init_t array named symbol
+    # that ends with an entry whose name is NULL.
+    def load_kernels path, symbol: "gm_kernels"
+      _load_kernels(path.to_s, symbol.to_s)
+    end
+
+    # Reduce x over axes with the binary function meth of mod. axes is an
+    # Integer, an Array of Integers or nil for all axes. The result has
+    # the type dtype, which defaults to the widest type of the same kind
+    # as the dtype of x.
     def reduce mod, meth, x, axes=0, dtype=nil
       if dtype.nil?
-        dtype = MAXCAST[x.dtype]
+        dtype = MAXCAST.fetch(x.dtype, x.dtype)
       end
 
       reduce_cpu(mod, meth, x, axes, dtype)
     end
 
     def reduce_cpu mod, meth, x, axes, dtype
-      
+      f = mod.instance_variable_get(:@gumath_functions)[meth.to_sym]
+      raise ArgumentError, "#{mod} has no function #{meth}." if f.nil?
+
+      ndim = x.type.ndim
+      axes = axes.nil? ? (0...ndim).to_a : Array(axes).map { |a| a < 0 ? a + ndim : a }
+      if axes.uniq.size != axes.size || axes.any? { |a| a < 0 || a >= ndim }
+        raise ArgumentError, "invalid axes #{axes} for a #{ndim}-dimensional array."
+      end
+
+      # move the reduced axes to the front.
+      permute = axes + (0...ndim).reject { |a| axes.include?(a) }
+      x = x.transpose(permute: permute) if permute != (0...ndim).to_a
+
+      type = (x.type.shape.drop(axes.size) + [dtype]).join(" * ")
+      _fold(f, XND.empty(type), x, axes.size)
     end
   end
 end
+
+# Identity elements of the functions that reductions start from.
+{ add: 0, multiply: 1 }.each do |name, identity|
+  f = Gumath::Functions.instance_variable_get(:@gumath_functions)[name]
+  f.identity = identity if f
+end
+
+begin
+  Gumath.load_thresholds
+rescue JSON::ParserError, SystemCallError, ArgumentError => e
+  warn "gumath: could not load thresholds: #{e.message}"
+end
@@ -0,0 +1,193 @@
+require 'digest'
+require 'fiddle'
+require 'fileutils'
+require 'rbconfig'
+require 'securerandom'
+
+class Gumath
+  # Generates C kernels for fused expressions, compiles them with the
+  # system compiler and keeps the shared objects in a cache directory, so
+  # that later runs load them without compiling. Expressions and types
+  # that cannot be generated, or a missing compiler, make kernel return
+  # nil and the expression is interpreted.
+  module Codegen
+    # Changes whenever the generated code changes, to invalidate the cache.
+    VERSION = 1
+
+    # No contraction of a * b + c into fused multiply-adds, so that compiled
+    # kernels round like the interpreted expression.
+    CFLAGS = %w[-O3 -ffp-contract=off -fPIC -shared]
+
+    # C type and unsigned type for arithmetic of each dtype.
+    TYPES = {
+      "int8" => ["int8_t", "uint8_t"],
+      "int16" => ["int16_t", "uint16_t"],
+      "int32" => ["int32_t", "uint32_t"],
+      "int64" => ["int64_t", "uint64_t"],
+      "uint8" => ["uint8_t", "uint8_t"],
+      "uint16" => ["uint16_t", "uint16_t"],
+      "uint32" => ["uint32_t", "uint32_t"],
+      "uint64" => ["uint64_t", "uint64_t"],
+      "float32" => ["float", nil],
+      "float64" => ["double", nil]
+    }
+
+    BINARY = { add: "+", subtract: "-", multiply: "*", divide: "/" }
+
+    # Functions of math.h for float64, with an 'f' suffix for float32.
+    MATH = %i[sin cos tan exp log sqrt]
+
+    @cache_dir = ENV.fetch("GUMATH_CACHE") {
+      File.join(Dir.home, ".gumath", "kernels") rescue nil
+    }
+    @handles = {}
+
+    class << self
+      attr_accessor :cache_dir
+      attr_writer :compiler
+
+      # Command of the C compiler, or nil if none can be run.
+      def compiler
+        return @compiler unless @compiler.nil?
+
+        cc = (ENV["CC"] || RbConfig::CONFIG["CC"] || "cc").split
+        @compiler = begin
+                      system(*cc, "--version", out: File::NULL, err: File::NULL) ? cc : false
+                    rescue SystemCallError
+                      false
+                    end
+      end
+
+      # Return the function of Gumath::Kernels that computes fused for
+      # arguments of dtype, compiling it if it is not cached, or nil.
+      def kernel fused, dtype
+        return nil unless compiler && cache_dir
+
+        key = Digest::SHA256.hexdigest(
+          [VERSION, fused.names, fused.operands, fused.constants.map(&:value),
+           dtype, compiler, CFLAGS, RUBY_PLATFORM].inspect)
+        name = "fused_#{key[0, 32]}"
+
+        functions = Kernels.instance_variable_get(:@gumath_functions)
+        return functions[name.to_sym] if functions.key?(name.to_sym)
+
+        source = generate(fused, dtype, name)
+        return nil if source.nil?
+
+        path = library(name, source)
+        return nil if path.nil?
+
+        handle = (@handles[path] ||= Fiddle.dlopen(path))
+        Gumath.unsafe_add_kernel name: name, sig: signature(fused.arity, dtype),
+                                 tag: "Strided", ptr: handle[name]
+      rescue Fiddle::DLError, SystemCallError
+        nil
+      end
+
+      # Return the C source of a strided kernel for fused on arguments of
+      # dtype, or nil if the expression cannot be generated. All arguments
+      # and constants must have dtype, and every call must keep it.
+      def generate fused, dtype, name
+        ctype, utype = TYPES[dtype]
+        return nil if ctype.nil? || fused.arity == 0
+        return nil unless fused.constants.all? { |c| c.dtype.to_s == dtype }
+
+        float = utype.nil?
+        nin = fused.arity
+        out = "r#{nin + fused.constants.size + fused.names.size - 1}"
+
+        regs = fused.constants.each_with_index.map do |c, i|
+          lit = literal(c.value, float)
+          return nil if lit.nil?
+          "const #{ctype} r#{nin + i} = (#{ctype})#{lit};"
+        end
+
+        fused.names.zip(fused.operands).each_with_index do |(fn, ops), k|
+          a, b = ops.map { |o| "r#{o}" }
+          expr =
+            if BINARY.key?(fn) && ops.size == 2 && (float || fn != :divide)
+              float ? "#{a} #{BINARY[fn]} #{b}" :
+                "(#{ctype})((#{utype})#{a} #{BINARY[fn]} (#{utype})#{b})"
+            elsif fn == :negative && ops.size == 1 && (float || !dtype.start_with?("u"))
+              float ? "-#{a}" : "(#{ctype})(0 - (#{utype})#{a})"
+            elsif MATH.include?(fn) && ops.size == 1 && float
+              "#{fn}#{dtype == 'float32' ? 'f' : ''}(#{a})"
+            end
+          return nil if expr.nil?
+
+          regs << "const #{ctype} r#{nin + fused.constants.size + k} = #{expr};"
+        end
+
+        contiguous = (0..nin).map { |i| "steps[#{i}] == sizeof(#{ctype})" }.join(" && ")
+        <<~EOS
+          /* Generated by Gumath::Codegen. */
+          #include <stdint.h>
+          #include <math.h>
+
+          int
+          #{name}(char **args, intptr_t *dimensions, intptr_t *steps, void *data)
+          {
+            const intptr_t n = dimensions[0];
+            (void)data;
+
+            if (#{contiguous}) {
+          #{(0...nin).map { |i| "    const #{ctype} *restrict p#{i} = (const #{ctype} *)args[#{i}];" }.join("\n")}
+              #{ctype} *restrict out = (#{ctype} *)args[#{nin}];
+
+              for (intptr_t i = 0; i < n; i++) {
+          #{(0...nin).map { |i| "      const #{ctype} r#{i} = p#{i}[i];" }.join("\n")}
+          #{regs.map { |r| "      #{r}" }.join("\n")}
+                out[i] = #{out};
+              }
+            }
+            else {
+              for (intptr_t i = 0; i < n; i++) {
+          #{(0...nin).map { |i| "      const #{ctype} r#{i} = *(const #{ctype} *)(args[#{i}] + i*steps[#{i}]);" }.join("\n")}
+          #{regs.map { |r| "      #{r}" }.join("\n")}
+                *(#{ctype} *)(args[#{nin}] + i*steps[#{nin}]) = #{out};
+              }
+            }
+
+            return 0;
+          }
+        EOS
+      end
+
+      private
+
+      def signature nin, dtype
+        "#{(["... * #{dtype}"] * nin).join(', ')} -> ... * #{dtype}"
+      end
+
+      def literal value, float
+        if float
+          value.is_a?(Numeric) && value.to_f.finite? ? format("%.17g", value.to_f) : nil
+        else
+          value.is_a?(Integer) ? "#{value}ULL" : nil
+        end
+      end
+
+      # Compile source into the cache directory unless it is there and
+      # return the path of the shared object, or nil if compiling failed.
+      # The object is renamed into place so that other processes never
+      # load a partial file. The temporary names are unique per call, so
+      # threads compiling the same kernel do not clobber each other.
+      def library name, source
+        path = File.join(cache_dir, "#{name}.#{RbConfig::CONFIG['DLEXT']}")
+        return path if File.exist?(path)
+
+        FileUtils.mkdir_p cache_dir
+        tmp = "#{path}.#{Process.pid}.#{SecureRandom.hex(8)}.tmp"
+        src = "#{tmp}.c"
+        File.write src, source
+
+        return nil unless system(*compiler, *CFLAGS, "-o", tmp, src, "-lm",
+                                 out: File::NULL, err: File::NULL)
+        File.rename tmp, path
+        path
+      ensure
+        [src, tmp].each { |f| File.delete(f) if f && File.exist?(f) }
+      end
+    end
+  end
+end
@@ -0,0 +1,166 @@
+class Gumath
+  # Node of an elementwise expression recorded by Gumath.fuse. Inputs and
+  # constants have no function; every other node calls a function of the
+  # module on its operands.
+  class Expr
+    OPERATORS = {
+      :+ => :add,
+      :- => :subtract,
+      :* => :multiply,
+      :/ => :divide,
+      :% => :remainder,
+      :** => :power,
+      :< => :less,
+      :<= => :less_equal,
+      :> => :greater,
+      :>= => :greater_equal,
+      :& => :bitwise_and,
+      :| => :bitwise_or,
+      :^ => :bitwise_xor
+    }
+
+    attr_reader :func, :operands, :value
+
+    def self.wrap mod, x
+      case x
+      when Expr
+        x
+      when XND
+        new(mod, nil, [], x)
+      when Numeric, true, false
+        new(mod, nil, [], XND.new(x))
+      else
+        raise TypeError, "cannot use #{x.class} in a fused expression."
+      end
+    end
+
+    def initialize mod, func, operands, value=nil
+      @mod = mod
+      @func = func
+      @operands = operands
+      @value = value
+    end
+
+    OPERATORS.each do |op, name|
+      define_method(op) { |other| call(name, other) }
+    end
+
+    def -@
+      call :negative
+    end
+
+    # Allows numbers on the left of an operator.
+    def coerce number
+      [Expr.wrap(@mod, number), self]
+    end
+
+    # Call function name of the module on self and others.
+    def call name, *others
+      unless functions.key?(name.to_sym)
+        raise NoMethodError, "#{@mod} has no function #{name}."
+      end
+
+      Expr.new(@mod, name.to_sym, [self, *others.map { |x| Expr.wrap(@mod, x) }])
+    end
+
+    def method_missing name, *others
+      functions.key?(name) ? call(name, *others) : super
+    end
+
+    def respond_to_missing? name, include_private=false
+      functions.key?(name) || super
+    end
+
+    private
+
+    def functions
+      @mod.instance_variable_get(:@gumath_functions)
+    end
+  end
+
+  # Elementwise expression recorded by Gumath.fuse. Its registers are the
+  # arguments, then the constants and then the result of each call.
+  class Fused
+    attr_reader :arity, :names, :operands, :constants
+
+    def initialize mod, arity, compile: false, &block
+      raise ArgumentError, "the block must take a fixed number of arguments." if arity < 0
+
+      inputs = Array.new(arity) { Expr.new(mod, nil, []) }
+      root = Expr.wrap(mod, block.call(*inputs))
+      raise ArgumentError, "a fused expression must call at least one function." if root.func.nil?
+
+      nodes = []
+      post_order root, {}.compare_by_identity, nodes
+
+      regs = {}.compare_by_identity
+      inputs.each_with_index { |x, i| regs[x] = i }
+      @constants = nodes.select { |x| x.func.nil? && !regs.key?(x) }.map(&:value)
+      nodes.select { |x| x.func.nil? && !regs.key?(x) }.each { |x| regs[x] = regs.size }
+
+      functions = mod.instance_variable_get(:@gumath_functions)
+      @arity = arity
+      @names = []
+      @funcs = []
+      @operands = []
+      nodes.reject { |x| x.func.nil? }.each do |x|
+        @names << x.func
+        @funcs << functions[x.func]
+        @operands << x.operands.map { |y| regs.fetch(y) }
+        regs[x] = regs.size
+      end
+
+      # compiled kernels by dtype of the arguments, nil if not available.
+      @kernels = compile && mod.equal?(Functions) ? {} : nil
+    end
+
+    # Evaluate the expression in one pass over the arguments, with a
+    # compiled kernel if it was requested and one can be built for the
+    # arguments.
+    def call *args
+      if args.size != @arity
+        raise ArgumentError, "expected #{@arity} arguments, got #{args.size}."
+      end
+
+      kernel = compiled_kernel(args)
+      return kernel.call(*args) if kernel
+
+      Gumath._fuse(@funcs, @operands, args + @constants)
+    end
+
+    private
+
+    def compiled_kernel args
+      return nil if @kernels.nil? || !args.all? { |x| x.is_a?(XND) }
+
+      dtypes = args.map { |x| x.dtype.to_s }.uniq
+      return nil if dtypes.size != 1
+
+      @kernels.fetch(dtypes[0]) do
+        @kernels[dtypes[0]] = Codegen.kernel(self, dtypes[0])
+      end
+    end
+
+    def post_order x, seen, nodes
+      return if seen.key?(x)
+      seen[x] = true
+      x.operands.each { |y| post_order y, seen, nodes }
+      nodes << x
+    end
+  end
+
+  class << self
+    # Record the elementwise expression computed by the block, which is
+    # called once with placeholders for its arguments, and return a Fused
+    # that evaluates it without full size temporaries:
+    #
+    #   f = Gumath.fuse { |a, b, c, d| a * b + c * d }
+    #   f.call(a, b, c, d)
+    #
+    # With compile: true, expressions of Gumath::Functions are compiled to
+    # a C kernel per argument dtype when possible; see Gumath::Codegen.
+    def fuse mod=Functions, compile: false, &block
+      Fused.new(mod, block.arity, compile: compile, &block)
+    end
+  end
+end
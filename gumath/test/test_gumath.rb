@@ -6,6 +6,19 @@ class TestFunctionHash < Minitest::Test
 
     assert_instance_of Gumath::GufuncObject, hash[:sin]
   end
+
+  def test_singleton_methods
+    hash = Fn.instance_variable_get(:@gumath_functions)
+    assert_equal hash.keys.sort, (Fn.singleton_methods & hash.keys).sort
+    assert Ex.respond_to?(:multiply)
+
+    x = XND.new [1, 2, 3]
+    y = Fn.multiply x, x
+    assert_equal [1, 4, 9], y
+    assert_equal hash[:multiply].call(x, x), y
+
+    assert_raises(NoMethodError) { Fn.no_such_kernel x }
+  end
 end
 
 class TestCall < Minitest::Test
@@ -186,6 +199,54 @@ class TestMissingValues < Minitest::Test
     assert_equal y, 0
   end
 
+  def test_reduce_axes
+    x = XND.new [[1, 2, 3], [4, 5, 6]], type: "2 * 3 * int32"
+
+    y = Gm.reduce Fn, :add, x
+    assert_equal [5, 7, 9], y.value
+    assert_equal NDT.new("3 * int64"), y.type
+
+    assert_equal [6, 15], (Gm.reduce Fn, :add, x, 1).value
+    assert_equal [6, 15], (Gm.reduce Fn, :add, x, -1).value
+    assert_equal 21, (Gm.reduce Fn, :add, x, nil).value
+    assert_equal 720, (Gm.reduce Fn, :multiply, x, [0, 1]).value
+    assert_equal [-3, -3, -3], (Gm.reduce Fn, :subtract, x).value
+
+    y = Gm.reduce Fn, :add, x, nil, NDT.new("float64")
+    assert_equal 21.0, y.value
+
+    assert_raises(ArgumentError) { Gm.reduce Fn, :add, x, [0, 0] }
+    assert_raises(ArgumentError) { Gm.reduce Fn, :add, x, 2 }
+    assert_raises(ValueError) { Gm.reduce Fn, :subtract, XND.new([], dtype: "int64") }
+  end
+
+  def test_reduce_large
+    n = 1 << 16
+    x = XND.new (1..n).to_a, type: "#{n} * int64"
+    assert_equal n * (n + 1) / 2, (Gm.reduce Fn, :add, x).value
+
+    x = XND.new (1..n).map(&:to_f), type: "#{n} * float64"
+    assert_in_delta n * (n + 1) / 2.0, (Gm.reduce Fn, :add, x, 0).value, 1e-6
+
+    y = XND.new (1..n).map { |i| i.odd? ? nil : i }, type: "#{n} * ?int64"
+    assert_nil (Gm.reduce Fn, :add, y).value
+  end
+
+  def test_reduce_partial_large
+    m = 256
+    x = XND.new (0...m*m).to_a, type: "#{m} * #{m} * int32"
+    rows = (0...m).map { |i| (0...m).sum { |j| i*m + j } }
+    cols = (0...m).map { |j| (0...m).sum { |i| i*m + j } }
+
+    assert_equal rows, (Gm.reduce Fn, :add, x, 1).value
+    assert_equal cols, (Gm.reduce Fn, :add, x, 0).value
+    assert_equal cols, (Gm.reduce Fn, :add, x.transpose, 1).value
+    assert_equal rows, (Gm.reduce Fn, :add, x[INF, (0..).step(1)], -1).value
+
+    y = XND.new [1.5] * (m*m), type: "#{m} * #{m} * float32"
+    assert_equal [1.5 ** 2] * m, (Gm.reduce Fn, :multiply, y[0..1], 0).value
+  end
+
   def test_reduce_cuda
     skip
     a = [1,nil,2]
@@ -584,6 +645,31 @@ class TestOut < Minitest::Test
     assert_equal r, XND.new([1,2,0])
   end
 
+  def test_readonly_mmap
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "x.xnd")
+      XND.new([1, 2, 3], type: "3 * int64").save path
+      y = XND.mmap path
+
+      assert_raises(FrozenError) { Fn.negative XND.new([1, 2, 3]), out: y }
+      assert_raises(FrozenError) { Fn.divmod XND.new([4]), XND.new([3]), out: [XND.empty("1 * int64"), y[0..0]] }
+      assert_equal [1, 2, 3], y.value
+    end
+  end
+
+  def test_readonly_buffer
+    s = [1, 2, 3].pack("q*").freeze
+    x = XND.from_buffer(s, "3 * int64")
+    assert_raises(FrozenError) { Fn.negative XND.new([1, 2, 3]), out: x }
+
+    t = XND.new([1, 2, 3], type: "3 * int64").serialize.freeze
+    y = XND.deserialize(t, copy: false)
+    assert_raises(FrozenError) { Fn.negative XND.new([1, 2, 3]), out: y }
+
+    assert_equal [1, 2, 3], s.unpack("q*")
+    assert_equal [1, 2, 3], y.value
+  end
+
   def test_broadcast_cuda
     skip
     x = XND.new [1,2,3], device: "cuda:managed"
@@ -989,3 +1075,386 @@ class LongIndexSliceTest < Minitest::Test
     skip
   end
 end # class LongIndexSliceTest
+
+class TestThreads < Minitest::Test
+  N = 4_000_000
+
+  def setup
+    # one kernel thread per call, so that kernels run on the calling thread.
+    @max_threads = Gm.get_max_threads
+    Gm.set_max_threads 1
+  end
+
+  def teardown
+    Gm.set_max_threads @max_threads
+  end
+
+  def test_kernels_run_without_gvl
+    x = XND.empty "#{N} * float64"
+    out = XND.empty "#{N} * float64"
+    count = 0
+    stop = false
+
+    # the counter thread can only advance while the kernel runs if the
+    # kernel has released the GVL.
+    counter = Thread.new { count += 1 until stop }
+    Thread.pass until count > 0
+    before = count
+    Fn.sin x, out: out
+    after = count
+    stop = true
+    counter.join
+
+    assert_operator after, :>, before
+    assert_equal [0.0] * 10, out[0...10].value
+  end
+
+  def test_threads_option
+    x = XND.new (0...100_000).map { |i| i * 0.5 }, type: "100000 * float64"
+    expected = Fn.sin(x, threads: 1)
+
+    [2, 3, 8].each do |n|
+      assert_equal expected, Fn.sin(x, threads: n)
+    end
+    assert_raises(ArgumentError) { Fn.sin x, threads: 0 }
+  end
+
+  def test_pool_after_fork
+    skip "fork is not available" unless Process.respond_to?(:fork)
+
+    x = XND.new (0...100_000).map { |i| i * 0.5 }, type: "100000 * float64"
+    expected = Fn.sin(x, threads: 4)
+
+    pid = fork { exit!(Fn.sin(x, threads: 4) == expected ? 0 : 1) }
+    Process.wait pid
+    assert $?.success?
+  end
+end # class TestThreads
+
+class TestThresholds < Minitest::Test
+  def teardown
+    Gm._reset_thresholds
+  end
+
+  def test_tune
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "thresholds.json")
+      thresholds = Gm.tune! path: path, size: 1 << 12
+
+      if Gm.get_max_threads > 1
+        assert thresholds.keys.any? { |k| k.start_with?("sin: ") }
+        assert thresholds.values.all? { |v| v.is_a?(Integer) && v >= 0 }
+      end
+      assert_equal thresholds, JSON.parse(File.read(path))
+
+      Gm._reset_thresholds
+      assert_empty Gm.thresholds
+      Gm.load_thresholds path
+      assert_equal thresholds, Gm.thresholds
+    end
+  end
+
+  def test_set_thresholds
+    Gm.thresholds = { "nosuch: int8 -> int8" => 10 }
+    assert_equal 10, Gm.thresholds["nosuch: int8 -> int8"]
+
+    assert_raises(ArgumentError) { Gm.thresholds = { "nosuch: int8 -> int8" => -1 } }
+  end
+
+  def test_load_invalid_thresholds
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "thresholds.json")
+      ['[1, 2]', '{"nosuch: int8 -> int8": "10"}', '{"nosuch: int8 -> int8": -1}'].each do |json|
+        File.write path, json
+        assert_raises(ArgumentError) { Gm.load_thresholds path }
+      end
+    end
+  end
+end # class TestThresholds
+
+class TestDispatchCache < Minitest::Test
+  def setup
+    @f = Fn.instance_variable_get(:@gumath_functions)[:multiply]
+    @f.clear_cache
+  end
+
+  def delta before
+    after = @f.cache_stats
+    [after[:hits] - before[:hits], after[:misses] - before[:misses]]
+  end
+
+  def test_hits_and_misses
+    x = XND.new [1, 2, 3]
+    y = XND.new [4, 5, 6]
+
+    before = @f.cache_stats
+    10.times { assert_equal [4, 10, 18], @f.call(x, y) }
+    assert_equal [9, 1], delta(before)
+
+    # new arrays with equal types
+    before = @f.cache_stats
+    assert_equal [2, 6, 12], @f.call(XND.new([1, 2, 3]), XND.new([2, 3, 4]))
+    assert_equal [1, 0], delta(before)
+
+    # 'out' is part of the key
+    z = XND.empty "3 * int64"
+    before = @f.cache_stats
+    2.times { @f.call(x, y, out: z) }
+    assert_equal [1, 1], delta(before)
+    assert_equal [4, 10, 18], z
+
+    before = @f.cache_stats
+    assert_equal [1.5, 4.0], @f.call(XND.new([1.5, 2.0]), XND.new([1.0, 2.0]))
+    assert_equal [0, 1], delta(before)
+    assert_operator @f.cache_stats[:entries], :>=, 2
+  end
+
+  def test_clear_cache
+    x = XND.new [1, 2, 3]
+    @f.call(x, x)
+    @f.clear_cache
+    assert_equal 0, @f.cache_stats[:entries]
+
+    before = @f.cache_stats
+    assert_equal [1, 4, 9], @f.call(x, x)
+    assert_equal [0, 1], delta(before)
+  end
+end # class TestDispatchCache
+
+# Compile the kernel source into a shared library lib<name> in dir, or
+# return nil.
+module KernelLibrary
+  def build_library dir, name, source
+    includes = [File.expand_path("../ext/ruby_gumath/include", __dir__)]
+    %w[ndtypes xnd].each do |gem|
+      spec = Gem::Specification.find_by_name(gem)
+      includes << File.join(spec.gem_dir, "ext", "ruby_#{gem}", "include")
+    end
+
+    src = File.join(dir, "#{name}.c")
+    lib = File.join(dir, "lib#{name}.#{RbConfig::CONFIG['DLEXT']}")
+    File.write src, source
+    cc = RbConfig::CONFIG["CC"].split
+    ok = system(*cc, "-shared", "-fPIC", *includes.map { |i| "-I#{i}" }, "-o", lib, src,
+                out: File::NULL, err: File::NULL)
+    ok ? lib : nil
+  rescue Gem::MissingSpecError
+    nil
+  end
+end
+
+class TestKernels < Minitest::Test
+  include KernelLibrary
+
+  KERNEL = <<~EOS
+    #include "gumath.h"
+
+    int
+    twice(char **args, intptr_t *dimensions, intptr_t *steps, void *data)
+    {
+      for (intptr_t i = 0; i < dimensions[0]; i++) {
+        *(double *)(args[1] + i*steps[1]) = 2 * *(double *)(args[0] + i*steps[0]);
+      }
+      return 0;
+    }
+
+    const gm_kernel_init_t gm_kernels[] = {
+      { .name = "twice", .sig = "... * float64 -> ... * float64", .Strided = twice },
+      { .name = NULL }
+    };
+  EOS
+
+  def test_load_kernels
+    Dir.mktmpdir do |dir|
+      lib = build_library(dir, "twice", KERNEL)
+      skip "cannot compile a kernel library" if lib.nil?
+
+      mod = Gm.load_kernels lib
+      x = XND.new [1.0, 2.5], type: "2 * float64"
+      assert_equal [2.0, 5.0], mod.twice(x).value
+
+      addr = Fiddle.dlopen(lib)["twice"]
+      f = Gm.unsafe_add_kernel name: "twice", sig: "... * float64 -> ... * float64",
+                               tag: "Strided", ptr: addr
+      assert_kind_of Gm::GufuncObject, f
+      assert_equal [2.0, 5.0], Gm::Kernels.twice(x).value
+      assert_equal [2.0, 5.0], f.call(x).value
+    end
+  end
+
+  def test_load_kernels_errors
+    assert_raises(LoadError) { Gm.load_kernels "/nonexistent/libnone.so" }
+    assert_raises(ArgumentError) do
+      Gm.unsafe_add_kernel name: "none", sig: "float64 -> float64", tag: "Vector", ptr: 1
+    end
+    assert_raises(ArgumentError) do
+      Gm.unsafe_add_kernel name: "none", sig: "float64 -> float64", tag: "C", ptr: 0
+    end
+  end
+end
+
+class TestFuse < Minitest::Test
+  include KernelLibrary
+
+  CUMSUM = <<~EOS
+    #include "gumath.h"
+
+    int
+    cumsum(xnd_t stack[], ndt_context_t *ctx)
+    {
+      const int64_t n = stack[0].type->FixedDim.shape;
+      const int64_t s0 = stack[0].type->Concrete.FixedDim.step;
+      const int64_t s1 = stack[1].type->Concrete.FixedDim.step;
+      const double *a = (const double *)stack[0].ptr + stack[0].index;
+      double *b = (double *)stack[1].ptr + stack[1].index;
+      double sum = 0;
+      (void)ctx;
+
+      for (int64_t i = 0; i < n; i++) {
+        sum += a[i*s0];
+        b[i*s1] = sum;
+      }
+      return 0;
+    }
+
+    const gm_kernel_init_t gm_kernels[] = {
+      { .name = "cumsum", .sig = "N * float64 -> N * float64", .Xnd = cumsum },
+      { .name = NULL }
+    };
+  EOS
+
+  def test_fuse
+    f = Gm.fuse { |a, b, c, d| a * b + c * d }
+    x = XND.new [1.0, 2.0, 3.0]
+    y = XND.new [4.0, 5.0, 6.0]
+
+    ans = f.call(x, y, y, x)
+    assert_equal [8.0, 20.0, 36.0], ans.value
+    assert_equal NDT.new("3 * float64"), ans.type
+    assert_equal 4, f.arity
+  end
+
+  def test_fuse_constants
+    f = Gm.fuse { |a| 2 * a + 1 }
+    assert_equal [3, 5, 7], f.call(XND.new([1, 2, 3])).value
+
+    f = Gm.fuse { |a| (-a).sin }
+    x = XND.new [0.5, 1.0]
+    assert_equal (Fn.sin (Fn.negative x)).value, f.call(x).value
+  end
+
+  def test_fuse_shared_operands
+    f = Gm.fuse { |a| t = a * a; t + t }
+    assert_equal [2, 8, 18], f.call(XND.new([1, 2, 3])).value
+  end
+
+  def test_fuse_broadcast
+    f = Gm.fuse { |a, b| a * b - b }
+    x = XND.new [[1, 2, 3], [4, 5, 6]]
+    y = XND.new [1, 10, 100]
+    assert_equal [[0, 10, 200], [3, 40, 500]], f.call(x, y).value
+
+    s = XND.new 3
+    assert_equal 6, f.call(s, s).value
+  end
+
+  def test_fuse_tiles
+    rows = 3000
+    x = XND.new (0...rows).map { |i| [i.to_f, i + 0.5, -i.to_f] },
+                type: "#{rows} * 3 * float64"
+    y = XND.new (0...rows).map { |i| [1.0, 2.0, i.to_f] },
+                type: "#{rows} * 3 * float64"
+
+    f = Gm.fuse { |a, b| a * b + a }
+    expected = Fn.add (Fn.multiply x, y), x
+    assert_equal expected.value, f.call(x, y).value
+
+    z = x[0..-1, 1]
+    expected = Fn.add (Fn.multiply z, z), z
+    assert_equal expected.value, f.call(z, z).value
+  end
+
+  def test_fuse_core_dimensions
+    Dir.mktmpdir do |dir|
+      lib = build_library(dir, "cumsum", CUMSUM)
+      skip "cannot compile a kernel library" if lib.nil?
+
+      # the core dimension of cumsum spans the output, so the program must
+      # not be cut into tiles.
+      mod = Gm.load_kernels lib
+      n = 5000
+      x = XND.new (1..n).map(&:to_f), type: "#{n} * float64"
+      expected = (1..n).map { |i| i * (i + 1) / 2.0 }
+      assert_equal expected, Gm.fuse(mod) { |a| a.cumsum }.call(x).value
+
+      y = XND.new [(1..n).map(&:to_f)] * 2, type: "2 * #{n} * float64"
+      assert_equal [expected] * 2, Gm.fuse(mod) { |a| a.cumsum }.call(y).value
+    end
+  end
+
+  def test_fuse_errors
+    f = Gm.fuse { |a, b| a + b }
+    assert_raises(ArgumentError) { f.call(XND.new([1])) }
+    assert_raises(ArgumentError) { Gm.fuse { |a| a } }
+    assert_raises(NoMethodError) { Gm.fuse { |a| a.no_such_kernel } }
+    assert_raises(ArgumentError) { Gm.fuse { |*a| a[0] + 1 } }
+  end
+end
+
+class TestCodegen < Minitest::Test
+  def setup
+    @cache_dir = Gm::Codegen.cache_dir
+  end
+
+  def teardown
+    Gm::Codegen.cache_dir = @cache_dir
+    Gm::Codegen.compiler = nil
+  end
+
+  def test_generate
+    f = Gm.fuse { |a, b, c, d| a * b + c * d }
+    src = Gm::Codegen.generate(f, "float64", "kernel")
+    assert_match(/const double r6 = r4 \+ r5;/, src)
+
+    assert_nil Gm::Codegen.generate(f, "?float64", "kernel")
+    assert_nil Gm::Codegen.generate(Gm.fuse { |a| a / a }, "int64", "kernel")
+    assert_nil Gm::Codegen.generate(Gm.fuse { |a| a + 1 }, "float64", "kernel")
+    refute_nil Gm::Codegen.generate(Gm.fuse { |a| a + 1.5 }, "float64", "kernel")
+  end
+
+  def test_compile
+    skip "no C compiler" unless Gm::Codegen.compiler
+
+    Dir.mktmpdir do |dir|
+      Gm::Codegen.cache_dir = dir
+      x = XND.new [1.0, 2.0, 3.0]
+      y = XND.new [4.0, 5.0, 6.0]
+
+      f = Gm.fuse(compile: true) { |a, b| a * b - a }
+      assert_equal [3.0, 8.0, 15.0], f.call(x, y).value
+      libs = Dir[File.join(dir, "*.#{RbConfig::CONFIG['DLEXT']}")]
+      assert_equal 1, libs.size
+
+      # the same expression reuses the kernel.
+      g = Gm.fuse(compile: true) { |a, b| a * b - a }
+      assert_equal [3.0, 8.0, 15.0], g.call(x, y).value
+      assert_equal libs, Dir[File.join(dir, "*.#{RbConfig::CONFIG['DLEXT']}")]
+
+      # types without a generated kernel are interpreted.
+      i = XND.new [1, nil, 3]
+      assert_equal [0, nil, 6], f.call(i, i).value
+    end
+  end
+
+  def test_no_compiler
+    Dir.mktmpdir do |dir|
+      Gm::Codegen.cache_dir = dir
+      Gm::Codegen.compiler = false
+
+      f = Gm.fuse(compile: true) { |a, b| a * b + b }
+      x = XND.new [1.0, 2.0]
+      assert_equal [2.0, 6.0], f.call(x, x).value
+      assert_empty Dir.children(dir)
+    end
+  end
+end
@@ -2,6 +2,8 @@ $LOAD_PATH.unshift File.expand_path('../../lib', __FILE__)
 require 'gumath'
 
 require 'minitest/autorun'
+require 'tmpdir'
+require 'fiddle'
 
 Gm = Gumath
 Fn = Gumath::Functions
@@ -0,0 +1,25 @@
+# Benchmark construction of XND objects from nested Ruby Arrays.
+#
+# Fixed dimension arrays of primitive dtypes are filled in bulk, other types
+# go through the generic per-element initializer. Run with `rake bench`.
+$LOAD_PATH.unshift File.expand_path('../../lib', __FILE__)
+require 'xnd'
+require 'benchmark'
+
+N = Integer(ENV.fetch('N', 1_000_000))
+ROWS = 1000
+
+flat = Array.new(N) { |i| i * 0.5 }
+nested = flat.each_slice(N / ROWS).to_a
+ints = Array.new(N) { |i| i % 127 }
+opt = flat.map.with_index { |v, i| i % 10 == 0 ? nil : v }
+
+Benchmark.bm(32) do |bm|
+  bm.report("#{N} * float64") { XND.new flat, type: "#{N} * float64" }
+  bm.report("#{ROWS} * #{N / ROWS} * float64") do
+    XND.new nested, type: "#{ROWS} * #{N / ROWS} * float64"
+  end
+  bm.report("#{N} * int8") { XND.new ints, type: "#{N} * int8" }
+  bm.report("#{N} * float32") { XND.new flat, type: "#{N} * float32" }
+  bm.report("#{N} * ?float64 (generic path)") { XND.new opt, type: "#{N} * ?float64" }
+end
@@ -0,0 +1,32 @@
+# Benchmark creation of views with XND#[].
+#
+# Every view is a new XND object sharing the memory block of its parent, so
+# this measures the fixed per-view cost of indexing. Run with `rake bench`
+# on two builds to compare them.
+$LOAD_PATH.unshift File.expand_path('../../lib', __FILE__)
+require 'xnd'
+require 'benchmark'
+
+N = Integer(ENV.fetch('N', 1_000_000))
+
+x = XND.new (0...1000).to_a, type: "10 * 100 * int64"
+r = XND.new [{"a" => 1, "b" => 2.0}] * 10, type: "10 * {a: int64, b: float64}"
+
+Benchmark.bm(24) do |bm|
+  bm.report("x[i] (row view)") { N.times { |i| x[i % 10] } }
+  bm.report("x[i, j] (scalar view)") { N.times { |i| x[i % 10, i % 100] } }
+  bm.report("x[i, j].value") { N.times { |i| x[i % 10, i % 100].value } }
+  bm.report("x.at(i, j)") { N.times { |i| x.at(i % 10, i % 100) } }
+  bm.report("x[INF, j] (column view)") { N.times { |i| x[INF, i % 100] } }
+  bm.report("r[i][\"a\"] (field view)") { N.times { |i| r[i % 10]["a"] } }
+
+  rows = XND.new [[1.0, 2.0]] * N, type: "#{N} * 2 * float64"
+  ary = [[1.0, 2.0]] * N
+  vec = XND.new [1.0] * N, type: "#{N} * float64"
+  bm.report("XND#each (rows)") { rows.each { |row| row } }
+  bm.report("XND#each (scalars)") { vec.each { |v| v } }
+  bm.report("Array#each") { ary.each { |row| row } }
+end
+
+GC.start
+puts "views/s (x[i]): #{(N / Benchmark.realtime { N.times { |i| x[i % 10] } }).round}"
@@ -60,6 +60,9 @@ find_header("overflow.h", headers)
 
 dir_config("xnd", [headers], [binaries])
 
+have_header("unistd.h")
+have_header("sys/mman.h")
+
 $INSTALLFILES = [
   ["ruby_xnd.h", "$(archdir)"],
   ["xnd.h", "$(archdir)"],
@@ -69,7 +72,7 @@ $INSTALLFILES = [
 # for macOS
 append_ldflags("-Wl,-rpath #{binaries}")
 
-basenames = %w{util float_pack_unpack gc_guard ruby_xnd}
+basenames = %w{util float_pack_unpack ruby_xnd}
 $objs = basenames.map { |b| "#{b}.o"   }
 $srcs = basenames.map { |b| "#{b}.c" }
 
@@ -45,13 +45,20 @@
 VALUE cRubyXND;
 VALUE cXND;
 static VALUE cRubyXND_MBlock;
+static VALUE cRubyXND_InitPlan;
+static VALUE cRubyXND_Mapping;
+static VALUE cRubyXND_Arena;
+static VALUE cXND_Index;
+static VALUE rb_cArithSeq = Qnil;
 static const rb_data_type_t MemoryBlockObject_type;
+static const rb_data_type_t InitPlanObject_type;
+static const rb_data_type_t MappingObject_type;
 static const rb_data_type_t XndObject_type;
+static const rb_data_type_t IndexObject_type;
+static const rb_data_type_t ArenaObject_type;
 
 static VALUE rb_eValueError;
 
-VALUE mRubyXND_GCGuard;
-
 static VALUE seterr(ndt_context_t *ctx);
 
 /****************************************************************************/
@@ -82,6 +89,214 @@ xnd_ellipsis(void)
                     rb_intern("new"), 0, NULL);
 }
 
+/****************************************************************************/
+/*                                Buffer pool                               */
+/****************************************************************************/
+
+/* Data buffers of empty mblocks come from free lists of size classes and
+ * go back to them when the mblock is freed. Arrays of the same size that
+ * are created and dropped over and over then skip malloc and free, which
+ * map and unmap large blocks every time. Only types that need nothing but
+ * their data are pooled: no pointers and no bitmaps.
+ *
+ * Size classes are spaced four per power of two, so a buffer is at most
+ * 25% larger than requested. The free lists hold at most pool.limit bytes
+ * and buffers beyond that are freed. All of this runs with the GVL.
+ */
+
+#define POOL_MIN_SIZE (INT64_C(1) << 12)
+#define POOL_MAX_SIZE (INT64_C(1) << 30)
+#define POOL_NCLASSES (4 * 18 + 1)
+#define POOL_ALIGN 64
+
+typedef struct pool_buffer {
+  struct pool_buffer *next;
+} pool_buffer_t;
+
+static struct {
+  pool_buffer_t *free[POOL_NCLASSES];
+  int64_t bytes;                /* bytes in the free lists */
+  int64_t buffers;              /* buffers in the free lists */
+  int64_t limit;
+  int64_t hits;
+  int64_t misses;
+} pool = { {NULL}, 0, 0, INT64_C(1) << 26, 0, 0 };
+
+/* Return the size class for size bytes, or -1 if they are not pooled. */
+static int
+pool_class(int64_t size)
+{
+  int64_t base = POOL_MIN_SIZE;
+  int cls = 0;
+
+  if (size < POOL_MIN_SIZE || size > POOL_MAX_SIZE) {
+    return -1;
+  }
+
+  while (base * 2 < size) {
+    base *= 2;
+    cls += 4;
+  }
+
+  return cls + (int)((size - base + base/4 - 1) / (base/4));
+}
+
+static int64_t
+pool_class_size(int cls)
+{
+  const int64_t base = POOL_MIN_SIZE << (cls / 4);
+
+  return base + (cls % 4) * (base / 4);
+}
+
+/* Return a zeroed buffer of at least size bytes from class cls. */
+static char *
+pool_get(int cls, int64_t size)
+{
+  pool_buffer_t *b = pool.free[cls];
+
+  if (b == NULL) {
+    pool.misses++;
+    return ndt_aligned_calloc(POOL_ALIGN, pool_class_size(cls));
+  }
+
+  pool.free[cls] = b->next;
+  pool.bytes -= pool_class_size(cls);
+  pool.buffers--;
+  pool.hits++;
+
+  memset(b, 0, size);
+  return (char *)b;
+}
+
+static void
+pool_put(int cls, char *ptr)
+{
+  const int64_t size = pool_class_size(cls);
+  pool_buffer_t *b = (pool_buffer_t *)ptr;
+
+  if (pool.bytes + size > pool.limit) {
+    ndt_aligned_free(ptr);
+    return;
+  }
+
+  b->next = pool.free[cls];
+  pool.free[cls] = b;
+  pool.bytes += size;
+  pool.buffers++;
+}
+
+/* Free buffers until the free lists hold at most limit bytes, largest
+   first. Return the number of bytes freed. */
+static int64_t
+pool_shrink(int64_t limit)
+{
+  int64_t freed = 0;
+
+  for (int cls = POOL_NCLASSES-1; cls >= 0 && pool.bytes > limit; cls--) {
+    while (pool.free[cls] != NULL && pool.bytes > limit) {
+      pool_buffer_t *b = pool.free[cls];
+      pool.free[cls] = b->next;
+      pool.bytes -= pool_class_size(cls);
+      pool.buffers--;
+      freed += pool_class_size(cls);
+      ndt_aligned_free(b);
+    }
+  }
+
+  return freed;
+}
+
+/****************************************************************************/
+/*                                  Arenas                                  */
+/****************************************************************************/
+
+/* Inside XND.arena(bytes) { ... } the data of empty mblocks is cut from a
+ * single buffer with a bump pointer, and the whole buffer is freed at once
+ * when the block exits. The types are the ones the pool takes; other types
+ * and allocations that no longer fit fall back to the pool or libxnd.
+ *
+ * An arena is a Ruby object that lists its live mblocks without marking
+ * them. At exit, the XND objects in the value of the block are copied out
+ * of the arena. All other mblocks that are still alive are marked as
+ * released, and using an XND object that is backed by one raises. The
+ * same happens when the arena is collected without exiting, for example
+ * with a fiber that was abandoned inside the block.
+ *
+ * Arenas nest, and an arena only serves the fiber that opened it: under a
+ * fiber scheduler several requests share a thread, and each must only see
+ * its own arena. The innermost open arena of a fiber is kept in a fiber
+ * local variable, and each arena refers to the one it is nested in.
+ */
+
+struct MemoryBlockObject;
+
+typedef struct arena {
+  VALUE next;                        /* enclosing open arena, or Qnil */
+  VALUE fiber;                       /* fiber that opened the arena */
+  bool open;                         /* true while serving allocations */
+  char *base;
+  int64_t size;
+  int64_t used;
+  struct MemoryBlockObject **blocks; /* mblocks of the arena, NULL once freed */
+  int64_t nblocks;
+  int64_t capacity;
+} arena_t;
+
+#define GET_ARENA(obj, arena_p) do {                                \
+    TypedData_Get_Struct((obj), arena_t, &ArenaObject_type, (arena_p)); \
+  } while (0)
+
+static ID id_arena;
+static int64_t narenas = 0;          /* arena objects that are alive */
+
+/* Return the innermost open arena of the current fiber, or NULL. */
+static arena_t *
+arena_current(void)
+{
+  VALUE arena;
+  arena_t *a;
+
+  if (narenas == 0) {
+    return NULL;
+  }
+
+  arena = rb_thread_local_aref(rb_thread_current(), id_arena);
+  if (NIL_P(arena)) {
+    return NULL;
+  }
+
+  GET_ARENA(arena, a);
+  return a;
+}
+
+/* Return size bytes of zeroed data from the arena, or NULL if they do not
+   fit. Room for one more mblock in the list is reserved as well. */
+static char *
+arena_get(arena_t *a, int64_t size)
+{
+  const int64_t start = (a->used + POOL_ALIGN - 1) & ~(int64_t)(POOL_ALIGN - 1);
+
+  if (start > a->size || size > a->size - start) {
+    return NULL;
+  }
+
+  if (a->nblocks == a->capacity) {
+    const int64_t capacity = a->capacity == 0 ? 64 : 2 * a->capacity;
+    struct MemoryBlockObject **blocks;
+
+    blocks = ndt_realloc(a->blocks, capacity, sizeof *blocks);
+    if (blocks == NULL) {
+      return NULL;
+    }
+    a->blocks = blocks;
+    a->capacity = capacity;
+  }
+
+  a->used = start + size;
+  return a->base + start;
+}
+
 /****************************************************************************/
 /*                           MemoryBlock Object                             */
 /****************************************************************************/
@@ -90,8 +305,15 @@ xnd_ellipsis(void)
 typedef struct MemoryBlockObject {
   VALUE type;        /* type owner (ndtype) */  
   xnd_master_t *xnd; /* memblock owner */
+  VALUE base;        /* owner of borrowed data (Qnil if the data is owned) */
+  bool readonly;     /* true if the data must not be written to */
+  int pool_class;    /* size class of pooled data, -1 if not pooled */
+  arena_t *arena;    /* open arena the data was cut from, or NULL */
+  int64_t arena_slot; /* index in the mblock list of the arena */
+  bool released;     /* true if the data went away with its arena */
 } MemoryBlockObject;
 
+#define MBLOCK_RELEASED(obj) (((MemoryBlockObject *)DATA_PTR(obj))->released)
 #define GET_MBLOCK(obj, mblock_p) do {                              \
     TypedData_Get_Struct((obj), MemoryBlockObject,                  \
                          &MemoryBlockObject_type, (mblock_p));      \
@@ -108,6 +330,8 @@ MemoryBlockObject_dmark(void *self)
   MemoryBlockObject *mblock = (MemoryBlockObject*)self;
 
   rb_gc_mark(mblock->type);
+  /* Pinned, since mblock->xnd points into the memory of base. */
+  rb_gc_mark(mblock->base);
 }
 
 static void
@@ -115,7 +339,12 @@ MemoryBlockObject_dfree(void *self)
 {
   MemoryBlockObject *mblock = (MemoryBlockObject*)self;
 
-  rb_xnd_gc_guard_unregister_mblock_type(mblock);
+  if (mblock->pool_class >= 0) {
+    pool_put(mblock->pool_class, mblock->xnd->master.ptr);
+  }
+  if (mblock->arena != NULL) {
+    mblock->arena->blocks[mblock->arena_slot] = NULL;
+  }
   xnd_del(mblock->xnd);
   mblock->xnd = NULL;
   xfree(mblock);
@@ -151,6 +380,12 @@ mblock_alloc(void)
   }
   self->type = NULL;
   self->xnd = NULL;
+  self->base = Qnil;
+  self->readonly = false;
+  self->pool_class = -1;
+  self->arena = NULL;
+  self->arena_slot = -1;
+  self->released = false;
   return self;
 }
 
@@ -163,6 +398,15 @@ mblock_allocate(void)
   return WRAP_MBLOCK(cRubyXND_MBlock, self);
 }
 
+/* Return true if an empty mblock of type t needs nothing but its data, so
+   that the data can come from an arena or the pool instead of libxnd. */
+static int
+mblock_is_plain(const ndt_t *t, uint32_t flags)
+{
+  return !(flags & XND_CUDA_MANAGED) && ndt_is_concrete(t) && t->align <= POOL_ALIGN &&
+    ndt_is_pointer_free(t) && !ndt_is_optional(t) && !ndt_subtree_is_optional(t);
+}
+
 /* Create empty mblock with no data. */
 static VALUE
 mblock_empty(VALUE type, uint32_t flags)
@@ -170,6 +414,9 @@ mblock_empty(VALUE type, uint32_t flags)
   NDT_STATIC_CONTEXT(ctx);
   MemoryBlockObject *mblock_p;
   const ndt_t * ndt_p;
+  arena_t *a = NULL;
+  char *ptr = NULL;
+  int cls = -1;
   
   if (!rb_ndtypes_check_type(type)) {
     rb_raise(rb_eArgError, "require NDT object to create mblock in mblock_empty.");
@@ -178,7 +425,51 @@ mblock_empty(VALUE type, uint32_t flags)
   mblock_p = mblock_alloc();
   ndt_p = rb_ndtypes_const_ndt(type);
   //  ndt_incref(ndt_p);
-  
+
+  if (mblock_is_plain(ndt_p, flags)) {
+    a = arena_current();
+    if (a != NULL) {
+      ptr = arena_get(a, ndt_p->datasize);
+    }
+    if (ptr == NULL) {
+      cls = pool_class(ndt_p->datasize);
+    }
+  }
+
+  if (ptr != NULL || cls >= 0) {
+    xnd_master_t *x = ndt_calloc(1, sizeof *x);
+    VALUE mblock;
+
+    if (x != NULL && ptr == NULL) {
+      ptr = pool_get(cls, ndt_p->datasize);
+    }
+    if (x == NULL || ptr == NULL) {
+      ndt_free(x);
+      xfree(mblock_p);
+      rb_raise(rb_eNoMemError, "cannot allocate data of the mblock.");
+    }
+
+    /* No ownership flags: the data goes back to the pool in dfree or is
+       freed with its arena. */
+    x->flags = 0;
+    x->master.index = 0;
+    x->master.type = ndt_p;
+    x->master.ptr = ptr;
+
+    mblock_p->xnd = x;
+    mblock_p->pool_class = cls;
+    mblock_p->type = type;
+
+    mblock = WRAP_MBLOCK(cRubyXND_MBlock, mblock_p);
+    if (cls < 0) {
+      mblock_p->arena = a;
+      mblock_p->arena_slot = a->nblocks;
+      a->blocks[a->nblocks++] = mblock_p;
+    }
+
+    return mblock;
+  }
+
   mblock_p->xnd = xnd_empty_from_type(ndt_p, XND_OWN_EMBEDDED|flags, &ctx);
   if (mblock_p->xnd == NULL) {
     rb_raise(rb_eValueError, "cannot create mblock object from given type.");
@@ -188,6 +479,87 @@ mblock_empty(VALUE type, uint32_t flags)
   return WRAP_MBLOCK(cRubyXND_MBlock, mblock_p);
 }
 
+/* Return true if the memory of type t at ptr can be used in place by an
+   mblock, i.e. it needs no separately allocated bitmaps or heaps. */
+static int
+mblock_can_borrow(const ndt_t *t, const char *ptr)
+{
+  return ndt_is_concrete(t) && ndt_is_pointer_free(t) &&
+    !ndt_is_optional(t) && !ndt_subtree_is_optional(t) &&
+    ((uintptr_t)ptr) % t->align == 0;
+}
+
+/* Create an mblock whose data is the memory at ptr instead of a fresh
+   allocation. The memory is owned by base, which the mblock keeps alive. */
+static VALUE
+mblock_borrow(VALUE type, VALUE base, char *ptr, bool readonly)
+{
+  MemoryBlockObject *mblock_p;
+  xnd_master_t *x;
+  VALUE mblock;
+
+  mblock = mblock_allocate();
+  GET_MBLOCK(mblock, mblock_p);
+
+  x = ndt_calloc(1, sizeof *x);
+  if (x == NULL) {
+    rb_raise(rb_eNoMemError, "cannot allocate master buffer.");
+  }
+
+  /* No ownership flags: xnd_del() releases only the xnd_master_t. */
+  x->flags = 0;
+  x->master.index = 0;
+  x->master.type = rb_ndtypes_const_ndt(type);
+  x->master.ptr = ptr;
+
+  mblock_p->type = type;
+  mblock_p->xnd = x;
+  mblock_p->base = base;
+  mblock_p->readonly = readonly;
+
+  return mblock;
+}
+
+/* Create a read-only mblock that borrows the data of the frozen String str. */
+static VALUE
+mblock_from_buffer(VALUE type, VALUE str)
+{
+  const ndt_t *t;
+  char *ptr;
+
+  if (!rb_ndtypes_check_type(type)) {
+    rb_raise(rb_eArgError, "require NDT object to create mblock in mblock_from_buffer.");
+  }
+  t = rb_ndtypes_const_ndt(type);
+
+  if (ndt_is_abstract(t)) {
+    rb_raise(rb_eTypeError, "cannot create a buffer view of an abstract type.");
+  }
+
+  if (!ndt_is_pointer_free(t)) {
+    rb_raise(rb_eNotImpError,
+             "buffer views of types with pointers are not implemented.");
+  }
+
+  if (ndt_is_optional(t) || ndt_subtree_is_optional(t)) {
+    rb_raise(rb_eNotImpError, "buffer views with bitmaps are not implemented.");
+  }
+
+  if (RSTRING_LEN(str) != t->datasize) {
+    rb_raise(rb_eValueError,
+             "buffer size (%ld) does not match the datasize of the type (%" PRIi64 ").",
+             RSTRING_LEN(str), t->datasize);
+  }
+
+  ptr = RSTRING_PTR(str);
+  if (((uintptr_t)ptr) % t->align != 0) {
+    rb_raise(rb_eValueError, "buffer is not aligned to %u bytes.",
+             (unsigned)t->align);
+  }
+
+  return mblock_borrow(type, str, ptr, true);
+}
+
 static VALUE
 mblock_from_xnd(xnd_t *src)
 {
@@ -343,20 +715,213 @@ union_tag_and_value_from_tuple(uint8_t *tag, VALUE *value, const ndt_t *t,
   return 0;
 }
 
-/* Initialize an mblock object with data. */
+static bool
+get_bool(VALUE data)
+{
+  if (data == Qnil) {
+    rb_raise(rb_eTypeError,
+             "assigning nil to memory block with non-optional type.");
+  }
+
+  if (FIXNUM_P(data) || RB_FLOAT_TYPE_P(data)) {
+    return NUM2INT(data) != 0;
+  }
+
+  return RTEST(data);
+}
+
+static float
+get_float32(double num)
+{
+  float y = (float)num;
+
+  if (isinf(y) && !isinf(num)) {
+    rb_raise(rb_eRangeError, "cannot fit value in 32-bit floating point number.");
+  }
+
+  return y;
+}
+
+/****************************************************************************/
+/*                      Bulk initialization of ndarrays                     */
+/****************************************************************************/
+
+static int _mblock_init(xnd_t * const x, VALUE data);
+
+/* Objects that can be converted to C numbers without calling Ruby methods. */
+#define BULK_INT_P(v) (FIXNUM_P(v) || RB_TYPE_P(v, T_BIGNUM))
+#define BULK_REAL_P(v) (FIXNUM_P(v) || RB_FLOAT_TYPE_P(v))
+#define BULK_COMPLEX_P(v) (BULK_REAL_P(v) || RB_TYPE_P(v, T_COMPLEX))
+
+/* Return true if a fixed dimension array with dtype t can be filled by
+   mblock_init_bulk. */
 static int
-mblock_init(xnd_t * const x, VALUE data)
+bulk_dtype_p(const ndt_t *t)
+{
+  if (ndt_is_optional(t) || !XND_NATIVE_ENDIAN_P(t->flags)) {
+    return 0;
+  }
+
+  switch (t->tag) {
+  case Bool:
+  case Int8: case Int16: case Int32: case Int64:
+  case Uint8: case Uint16: case Uint32: case Uint64:
+  case Float32: case Float64:
+  case Complex64: case Complex128:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/* Return true if t is a fixed dimension array with a bulk dtype. */
+static int
+bulk_type_p(const ndt_t *t)
+{
+  if (t->tag != FixedDim || ndt_is_optional(t) || !ndt_is_ndarray(t)) {
+    return 0;
+  }
+
+  return bulk_dtype_p(ndt_dtype(t));
+}
+
+static void
+bulk_complex_values(VALUE v, double *real, double *imag)
+{
+  if (RB_TYPE_P(v, T_COMPLEX)) {
+    *real = NUM2DBL(rb_complex_real(v));
+    *imag = NUM2DBL(rb_complex_imag(v));
+  }
+  else {
+    *real = NUM2DBL(v);
+    *imag = 0.0;
+  }
+}
+
+/* Store each element of the innermost dimension directly through a typed
+   pointer. Elements that would need a Ruby method call for conversion go
+   through _mblock_init instead, after which the Array pointer is reloaded
+   since that call might have modified the Array. */
+#define BULK_FILL(fast_p, store)                                        \
+  do {                                                                  \
+    for (i = 0; i < shape; i++) {                                       \
+      const VALUE v = items[i];                                         \
+      char * const ptr = x->ptr + (x->index + i * step) * itemsize;     \
+                                                                        \
+      if (fast_p) {                                                     \
+        store;                                                          \
+      }                                                                 \
+      else {                                                            \
+        xnd_t next = xnd_fixed_dim_next(x, i);                          \
+        _mblock_init(&next, v);                                         \
+        if (RARRAY_LEN(data) != shape) {                                \
+          rb_raise(rb_eRuntimeError,                                    \
+                   "Array was modified during XND initialization.");    \
+        }                                                               \
+        items = RARRAY_CONST_PTR(data);                                 \
+      }                                                                 \
+    }                                                                   \
+  } while (0)
+
+/* Fill a fixed dimension array with a primitive dtype from nested Ruby
+   Arrays without recursing into _mblock_init for every element.
+
+   @param x Fixed dimension view for which bulk_type_p() is true.
+   @param data Nested Ruby Array.
+ */
+static void
+mblock_init_bulk(xnd_t * const x, VALUE data)
 {
-  NDT_STATIC_CONTEXT(ctx);
   const ndt_t * const t = x->type;
+  const ndt_t * const u = t->FixedDim.type;
+  const int64_t shape = t->FixedDim.shape;
+  const int64_t step = t->Concrete.FixedDim.step;
+  const int64_t itemsize = u->datasize;
+  const VALUE *items;
+  int64_t i;
 
-  if (!check_invariants(t)) {
-    rb_raise(rb_eArgError, "invariants in type.");
+  Check_Type(data, T_ARRAY);
+
+  if (RARRAY_LEN(data) != shape) {
+    rb_raise(rb_eArgError,
+             "Input length (%ld) and type length (%ld) mismatch.",
+             RARRAY_LEN(data), shape);
   }
 
-  if (ndt_is_abstract(t)) {
-    rb_raise(rb_eTypeError, "specified NDT has abstract type.");
+  if (u->tag == FixedDim) {
+    for (i = 0; i < shape; i++) {
+      xnd_t next = xnd_fixed_dim_next(x, i);
+      mblock_init_bulk(&next, rb_ary_entry(data, i));
+    }
+    return;
+  }
+
+  items = RARRAY_CONST_PTR(data);
+
+  switch (u->tag) {
+  case Bool:
+    BULK_FILL(v != Qnil, *(bool *)ptr = get_bool(v));
+    return;
+  case Int8:
+    BULK_FILL(BULK_INT_P(v), *(int8_t *)ptr = (int8_t)get_int(v, INT8_MIN, INT8_MAX));
+    return;
+  case Int16:
+    BULK_FILL(BULK_INT_P(v), *(int16_t *)ptr = (int16_t)get_int(v, INT16_MIN, INT16_MAX));
+    return;
+  case Int32:
+    BULK_FILL(BULK_INT_P(v), *(int32_t *)ptr = (int32_t)get_int(v, INT32_MIN, INT32_MAX));
+    return;
+  case Int64:
+    BULK_FILL(BULK_INT_P(v), *(int64_t *)ptr = get_int(v, INT64_MIN, INT64_MAX));
+    return;
+  case Uint8:
+    BULK_FILL(BULK_INT_P(v), *(uint8_t *)ptr = (uint8_t)get_uint(v, UINT8_MAX));
+    return;
+  case Uint16:
+    BULK_FILL(BULK_INT_P(v), *(uint16_t *)ptr = (uint16_t)get_uint(v, UINT16_MAX));
+    return;
+  case Uint32:
+    BULK_FILL(BULK_INT_P(v), *(uint32_t *)ptr = (uint32_t)get_uint(v, UINT32_MAX));
+    return;
+  case Uint64:
+    BULK_FILL(BULK_INT_P(v), *(uint64_t *)ptr = get_uint(v, UINT64_MAX));
+    return;
+  case Float32:
+    BULK_FILL(BULK_REAL_P(v), *(float *)ptr = get_float32(NUM2DBL(v)));
+    return;
+  case Float64:
+    BULK_FILL(BULK_REAL_P(v), *(double *)ptr = NUM2DBL(v));
+    return;
+  case Complex64: {
+    double real, imag;
+    BULK_FILL(BULK_COMPLEX_P(v),
+              bulk_complex_values(v, &real, &imag);
+              ((float *)ptr)[0] = get_float32(real);
+              ((float *)ptr)[1] = get_float32(imag));
+    return;
+  }
+  case Complex128: {
+    double real, imag;
+    BULK_FILL(BULK_COMPLEX_P(v),
+              bulk_complex_values(v, &real, &imag);
+              ((double *)ptr)[0] = real;
+              ((double *)ptr)[1] = imag);
+    return;
   }
+  default:
+    rb_raise(rb_eRuntimeError, "unexpected dtype in bulk initialization.");
+  }
+}
+
+#undef BULK_FILL
+
+/* Initialize an mblock object with data. The type of x must have been
+   validated by the caller, see mblock_init. */
+static int
+_mblock_init(xnd_t * const x, VALUE data)
+{
+  NDT_STATIC_CONTEXT(ctx);
+  const ndt_t * const t = x->type;
 
   /* set missing value. */
   if (ndt_is_optional(t)) {
@@ -378,6 +943,11 @@ mblock_init(xnd_t * const x, VALUE data)
     const int64_t shape = t->FixedDim.shape;
     int64_t i;
 
+    if (bulk_type_p(t)) {
+      mblock_init_bulk(x, data);
+      return 0;
+    }
+
     Check_Type(data, T_ARRAY);
 
     if (RARRAY_LEN(data) != shape) {
@@ -390,7 +960,7 @@ mblock_init(xnd_t * const x, VALUE data)
       xnd_t next = xnd_fixed_dim_next(x, i);
       VALUE rb_index[1] = { LL2NUM(i) };
 
-      mblock_init(&next, rb_ary_aref(1, rb_index, data));
+      _mblock_init(&next, rb_ary_aref(1, rb_index, data));
     }
     return 0;
   }
@@ -416,7 +986,7 @@ mblock_init(xnd_t * const x, VALUE data)
       xnd_t next = xnd_var_dim_next(x, start, step, i);
       VALUE rb_index[1] = { LL2NUM(i) };
       
-      mblock_init(&next, rb_ary_aref(1, rb_index, data));
+      _mblock_init(&next, rb_ary_aref(1, rb_index, data));
     }
 
     return 0;
@@ -443,7 +1013,7 @@ mblock_init(xnd_t * const x, VALUE data)
       }
       VALUE rb_index[1] = { LL2NUM(i) };
       
-      mblock_init(&next, rb_ary_aref(1, rb_index, data));
+      _mblock_init(&next, rb_ary_aref(1, rb_index, data));
     }
 
     return 0;
@@ -468,7 +1038,7 @@ mblock_init(xnd_t * const x, VALUE data)
       }
 
       temp = rb_hash_aref(data, rb_str_new2(t->Record.names[i]));
-      mblock_init(&next, temp);
+      _mblock_init(&next, temp);
     }
 
     return 0;
@@ -491,7 +1061,7 @@ mblock_init(xnd_t * const x, VALUE data)
       raise_error();
     }
 
-    return mblock_init(&next, tmp);
+    return _mblock_init(&next, tmp);
   }
 
   case Ref: {
@@ -501,7 +1071,7 @@ mblock_init(xnd_t * const x, VALUE data)
       raise_error();
     }
 
-    return mblock_init(&next, data);
+    return _mblock_init(&next, data);
   }
 
   case Constr: {
@@ -511,7 +1081,7 @@ mblock_init(xnd_t * const x, VALUE data)
       raise_error();      
     }
 
-    return mblock_init(&next, data);
+    return _mblock_init(&next, data);
   }
 
   case Nominal: {
@@ -528,7 +1098,7 @@ mblock_init(xnd_t * const x, VALUE data)
       return 0;
     }
 
-    mblock_init(&next, data);
+    _mblock_init(&next, data);
 
     if (t->Nominal.meth->constraint != NULL &&
         !t->Nominal.meth->constraint(&next, &ctx)) {
@@ -540,27 +1110,8 @@ mblock_init(xnd_t * const x, VALUE data)
   }
 
   case Bool: {
-    bool b;
-
-    if (data == Qnil) {
-      rb_raise(rb_eTypeError,
-               "assigning nil to memory block with non-optional type.");
-    }
+    bool b = get_bool(data);
 
-    if (RTEST(data)) {
-      if (FIXNUM_P(data) || RB_FLOAT_TYPE_P(data)) {
-        if (NUM2INT(data) == 0) {
-          b = 0;
-        }
-      }
-      else {
-        b = 1;
-      }
-    }
-    else {
-      b = 0;
-    }
-    
     PACK_SINGLE(x->ptr, b, bool, t->flags);
     return 0;
   }
@@ -889,1447 +1440,3697 @@ mblock_init(xnd_t * const x, VALUE data)
   }
 }
 
-/* Create mblock from NDT type. 
- *
- * @param type - NDT Ruby object.
- * @param data - Data as a Ruby object.
- */
-static VALUE
-mblock_from_typed_value(VALUE type, VALUE data, int32_t flags)
+/* Validate the type of x once and initialize the mblock with data. */
+static int
+mblock_init(xnd_t * const x, VALUE data)
 {
-  VALUE mblock;
-  MemoryBlockObject *mblock_p;
+  const ndt_t * const t = x->type;
 
-  mblock = mblock_empty(type, flags);
-  GET_MBLOCK(mblock, mblock_p);
-  mblock_init(&mblock_p->xnd->master, data);
+  if (!check_invariants(t)) {
+    rb_raise(rb_eArgError, "invariants in type.");
+  }
 
-  return mblock;
+  if (ndt_is_abstract(t)) {
+    rb_raise(rb_eTypeError, "specified NDT has abstract type.");
+  }
+
+  return _mblock_init(x, data);
 }
 
 /****************************************************************************/
-/*                                 xnd object                               */
+/*                           Construction plans                             */
 /****************************************************************************/
 
-typedef struct XndObject {
-  VALUE mblock;              /* owner of the primary type and memory block */
-  VALUE type;                /* owner of the current type. lives and dies with this obj. */
-  xnd_t xnd;                 /* typed view, does not own anything */
-} XndObject;
-
-#define XND(xnd_p) (&(((XndObject *)xnd_p)->xnd))
-#define TYPE_OWNER(xnd_p) ((((XndObject *)xnd_p)->type))
-#define XND_TYPE(xnd_p) (((XndObject *)xnd_p)->xnd.type)
-#define XND_INDEX(xnd_p) (((XndObject *)xnd_p)->xnd.index)
-#define XND_PTR(xnd_p) (((XndObject *)xnd_p)->xnd.ptr)
+/* A construction plan is the type tree of an NDT flattened into an array of
+   fill steps. It is compiled once per NDT object, validating the type on the
+   way, and cached on the NDT so that repeated XND.new calls with the same
+   type skip validation and per-node dispatch on the type tag. */
+enum plan_op {
+  PLAN_BULK,                   /* fixed dims of a primitive dtype */
+  PLAN_FIXED_DIM,
+  PLAN_VAR_DIM,
+  PLAN_TUPLE,
+  PLAN_RECORD,
+  PLAN_UNION,
+  PLAN_REF,
+  PLAN_CONSTR,
+  PLAN_NOMINAL,
+  PLAN_SCALAR                  /* any other leaf, filled by _mblock_init */
+};
 
-#define XND_CHECK_TYPE(xnd) (CLASS_OF(xnd) == cXND)
-#define GET_XND(obj, xnd_p) do {                        \
-    TypedData_Get_Struct((obj), XndObject,              \
-                         &XndObject_type, (xnd_p));     \
+typedef struct {
+  enum plan_op op;
+  bool opt;                    /* type is optional */
+  int64_t shape;               /* number of children */
+  int64_t next;                /* index of the child step or into children */
+  int64_t keys;                /* index of the first record key in keys */
+} plan_step_t;
+
+typedef struct InitPlanObject {
+  const ndt_t *type;           /* root type, referenced by the plan */
+  int64_t nsteps;
+  plan_step_t *steps;
+  int64_t nchildren;
+  int64_t *children;           /* child steps of tuples, records and unions */
+  VALUE keys;                  /* Ruby Strings of record field names */
+} InitPlanObject;
+
+#define GET_INIT_PLAN(obj, plan_p) do {                         \
+    TypedData_Get_Struct((obj), InitPlanObject,                 \
+                         &InitPlanObject_type, (plan_p));       \
   } while (0)
-#define MAKE_XND(klass, xnd_p) TypedData_Make_Struct(klass, XndObject, \
-                                                    &XndObject_type, xnd_p)
-#define WRAP_XND(klass, xnd_p) TypedData_Wrap_Struct(klass, &XndObject_type, xnd_p)
-
-static VALUE XND_size(VALUE self);
-
-/* Allocate an XndObject and return wrapped in a Ruby object. */
-static VALUE
-XndObject_alloc(VALUE klass)
-{
-  XndObject *xnd;
-
-  xnd = ZALLOC(XndObject);
-
-  xnd->mblock = 0;
-  xnd->type = 0;
-  xnd->xnd.bitmap.data = NULL;
-  xnd->xnd.bitmap.size = 0;
-  xnd->xnd.bitmap.next = NULL;
-  xnd->xnd.index = 0;
-  xnd->xnd.type  = NULL;
-  xnd->xnd.ptr = NULL;
+#define MAKE_INIT_PLAN(klass, plan_p) TypedData_Make_Struct(klass, InitPlanObject, \
+                                                            &InitPlanObject_type, plan_p)
 
-  return WRAP_XND(klass, xnd);
-}
+static ID id_init_plan;
 
-/* Mark Ruby objects within XndObject. */
 static void
-XndObject_dmark(void *self)
+InitPlanObject_dmark(void *self)
 {
-  XndObject *xnd = (XndObject*)self;
+  InitPlanObject *plan = (InitPlanObject *)self;
 
-  rb_gc_mark(xnd->type);
-  rb_gc_mark(xnd->mblock);
+  rb_gc_mark(plan->keys);
 }
 
 static void
-XndObject_dfree(void *self)
+InitPlanObject_dfree(void *self)
 {
-  XndObject *xnd = (XndObject*)self;
+  InitPlanObject *plan = (InitPlanObject *)self;
 
-  rb_xnd_gc_guard_unregister_xnd_mblock(xnd);
-  rb_xnd_gc_guard_unregister_xnd_type(xnd);
-  xfree(xnd);
+  if (plan->type) {
+    ndt_decref(plan->type);
+  }
+  xfree(plan->steps);
+  xfree(plan->children);
+  xfree(plan);
 }
 
 static size_t
-XndObject_dsize(const void *self)
+InitPlanObject_dsize(const void *self)
 {
-  return sizeof(XndObject);
+  const InitPlanObject *plan = (const InitPlanObject *)self;
+
+  return sizeof(InitPlanObject) + plan->nsteps * sizeof(plan_step_t) +
+    plan->nchildren * sizeof(int64_t);
 }
 
-static const rb_data_type_t XndObject_type = {
-  .wrap_struct_name = "XndObject",
+static const rb_data_type_t InitPlanObject_type = {
+  .wrap_struct_name = "InitPlanObject",
   .function = {
-    .dmark = XndObject_dmark,
-    .dfree = XndObject_dfree,
-    .dsize = XndObject_dsize,
+    .dmark = InitPlanObject_dmark,
+    .dfree = InitPlanObject_dfree,
+    .dsize = InitPlanObject_dsize,
     .reserved = {0,0},
   },
   .parent = 0,
   .flags = RUBY_TYPED_FREE_IMMEDIATELY,
 };
 
+/* Count the steps and child slots needed for the plan of t. */
 static void
-XND_from_mblock(XndObject *xnd_p, VALUE mblock)
+plan_count(const ndt_t *t, int64_t *nsteps, int64_t *nchildren)
 {
-  MemoryBlockObject *mblock_p;
+  int64_t i;
 
-  GET_MBLOCK(mblock, mblock_p);
-  
-  xnd_p->mblock = mblock;
-  xnd_p->type = mblock_p->type;
-  xnd_p->xnd = mblock_p->xnd->master;
+  *nsteps += 1;
+
+  switch (t->tag) {
+  case FixedDim:
+    if (!bulk_type_p(t)) {
+      plan_count(t->FixedDim.type, nsteps, nchildren);
+    }
+    return;
+  case VarDim:
+    plan_count(t->VarDim.type, nsteps, nchildren);
+    return;
+  case Tuple:
+    *nchildren += t->Tuple.shape;
+    for (i = 0; i < t->Tuple.shape; i++) {
+      plan_count(t->Tuple.types[i], nsteps, nchildren);
+    }
+    return;
+  case Record:
+    *nchildren += t->Record.shape;
+    for (i = 0; i < t->Record.shape; i++) {
+      plan_count(t->Record.types[i], nsteps, nchildren);
+    }
+    return;
+  case Union:
+    *nchildren += t->Union.ntags;
+    for (i = 0; i < t->Union.ntags; i++) {
+      plan_count(t->Union.types[i], nsteps, nchildren);
+    }
+    return;
+  case Ref:
+    plan_count(t->Ref.type, nsteps, nchildren);
+    return;
+  case Constr:
+    plan_count(t->Constr.type, nsteps, nchildren);
+    return;
+  case Nominal:
+    plan_count(t->Nominal.type, nsteps, nchildren);
+    return;
+  default:
+    return;
+  }
 }
 
-/* Allocator for RubyXND object. Called by Ruby before initialize. */
-static VALUE
-RubyXND_allocate(VALUE klass)
+/* Compile the steps for t into plan and return the index of its step. */
+static int64_t
+plan_compile(InitPlanObject *plan, const ndt_t *t)
 {
-  XndObject *xnd;
-
-  xnd = ZALLOC(XndObject);
+  const int64_t k = plan->nsteps++;
+  int64_t i, base;
 
-  xnd->mblock = 0;
-  xnd->type = 0;
-  xnd->xnd.bitmap.data = NULL;
-  xnd->xnd.bitmap.size = 0;
-  xnd->xnd.bitmap.next = NULL;
-  xnd->xnd.index = 0;
-  xnd->xnd.type  = NULL;
-  xnd->xnd.ptr = NULL;
+  if (t->ndim > 0 && ndt_is_optional(t)) {
+    rb_raise(rb_eNotImpError, "optional dimensions are not implemented.");
+  }
 
-  return WRAP_XND(klass, xnd);
-}
+  plan->steps[k].opt = ndt_is_optional(t);
+  plan->steps[k].shape = 0;
+  plan->steps[k].next = -1;
+  plan->steps[k].keys = -1;
 
-static uint32_t
-device_flags(VALUE array)
-{
-  VALUE device, no;
+  switch (t->tag) {
+  case FixedDim: {
+    if (bulk_type_p(t)) {
+      plan->steps[k].op = PLAN_BULK;
+      return k;
+    }
 
-  Check_Type(array, T_ARRAY);
-  if (RARRAY_LEN(array) != 2) {
-    rb_raise(rb_eTypeError, "device argument must be of the form (device_name, device_no).");
+    plan->steps[k].op = PLAN_FIXED_DIM;
+    plan->steps[k].next = plan_compile(plan, t->FixedDim.type);
+    return k;
   }
 
-  device = rb_ary_entry(array, 0);
-  Check_Type(device, T_STRING);
-  if (RTEST(rb_funcall(device, rb_intern("=="), 1, rb_str_new_literal("cuda")))) {
-    rb_raise(rb_eValueError, "currently only 'cuda' is supported as a device name.");
-  }
-    
-  no = rb_ary_entry(array, 1);
-  Check_Type(no, T_FIXNUM);
-  if (FIX2NUM(no) != -1) {
-    rb_raise(rb_eValueError, "currently only 'cuda:managed' is supported as a device.");
+  case VarDim: {
+    plan->steps[k].op = PLAN_VAR_DIM;
+    plan->steps[k].next = plan_compile(plan, t->VarDim.type);
+    return k;
   }
 
-  return XND_CUDA_MANAGED;
-}
+  case Tuple: {
+    base = plan->nchildren;
+    plan->nchildren += t->Tuple.shape;
+
+    plan->steps[k].op = PLAN_TUPLE;
+    plan->steps[k].shape = t->Tuple.shape;
+    plan->steps[k].next = base;
+    for (i = 0; i < t->Tuple.shape; i++) {
+      plan->children[base+i] = plan_compile(plan, t->Tuple.types[i]);
+    }
+    return k;
+  }
 
-/* Initialize a RubyXND object. */
-static VALUE
-RubyXND_initialize(VALUE self, VALUE type, VALUE data, VALUE device)
-{
-  VALUE mblock;
-  MemoryBlockObject *mblock_p;
-  XndObject *xnd_p;
-  uint32_t flags = 0;
+  case Record: {
+    base = plan->nchildren;
+    plan->nchildren += t->Record.shape;
+
+    plan->steps[k].op = PLAN_RECORD;
+    plan->steps[k].shape = t->Record.shape;
+    plan->steps[k].next = base;
+    plan->steps[k].keys = RARRAY_LEN(plan->keys);
+    for (i = 0; i < t->Record.shape; i++) {
+      rb_ary_push(plan->keys, rb_obj_freeze(rb_str_new2(t->Record.names[i])));
+      plan->children[base+i] = plan_compile(plan, t->Record.types[i]);
+    }
+    return k;
+  }
 
-  if (device != Qnil) {
-    flags = device_flags(device);
-    if (flags == UINT32_MAX) {
-      rb_raise(rb_eValueError, "device ID cannot be handled.");
+  case Union: {
+    base = plan->nchildren;
+    plan->nchildren += t->Union.ntags;
+
+    plan->steps[k].op = PLAN_UNION;
+    plan->steps[k].shape = t->Union.ntags;
+    plan->steps[k].next = base;
+    for (i = 0; i < t->Union.ntags; i++) {
+      plan->children[base+i] = plan_compile(plan, t->Union.types[i]);
     }
+    return k;
   }
 
-  mblock = mblock_from_typed_value(type, data, flags);
-  GET_MBLOCK(mblock, mblock_p);
-  
-  rb_xnd_gc_guard_register_mblock_type(mblock_p, type);
-    
-  GET_XND(self, xnd_p);
-  XND_from_mblock(xnd_p, mblock);
-  
-  rb_xnd_gc_guard_register_xnd_mblock(xnd_p, mblock);
-  rb_xnd_gc_guard_register_xnd_type(xnd_p, type);
+  case Ref: {
+    plan->steps[k].op = PLAN_REF;
+    plan->steps[k].next = plan_compile(plan, t->Ref.type);
+    return k;
+  }
 
-#ifdef XND_DEBUG
-  assert(XND(xnd_p)->type);
-  assert(XND(xnd_p)->ptr);
-#endif
+  case Constr: {
+    plan->steps[k].op = PLAN_CONSTR;
+    plan->steps[k].next = plan_compile(plan, t->Constr.type);
+    return k;
+  }
 
-  return self;
+  case Nominal: {
+    plan->steps[k].op = PLAN_NOMINAL;
+    plan->steps[k].next = plan_compile(plan, t->Nominal.type);
+    return k;
+  }
+
+  default:
+    plan->steps[k].op = PLAN_SCALAR;
+    return k;
+  }
 }
 
-static size_t
-XND_get_size(VALUE xnd)
+/* Compile a construction plan for the NDT object type. */
+static VALUE
+init_plan_new(VALUE type)
 {
-  size_t size;
-  int state;
-  VALUE rb_size;
+  InitPlanObject *plan_p;
+  const ndt_t *t = rb_ndtypes_const_ndt(type);
+  int64_t nsteps = 0, nchildren = 0;
+  VALUE plan;
 
-  rb_size = rb_protect(XND_size, xnd, &state);
-  size = state ? 0 : NUM2LL(rb_size);
+  if (!check_invariants(t)) {
+    rb_raise(rb_eArgError, "invariants in type.");
+  }
 
-  return size;
-}
+  if (ndt_is_abstract(t)) {
+    rb_raise(rb_eTypeError, "specified NDT has abstract type.");
+  }
 
-/*************************** object properties ********************************/
+  plan = MAKE_INIT_PLAN(cRubyXND_InitPlan, plan_p);
+  plan_p->keys = rb_ary_new();
 
-static VALUE
-XND_dtype(VALUE self)
-{
-  XndObject *self_p;
-  GET_XND(self, self_p);
-  const ndt_t *dtype = ndt_dtype(XND_TYPE(self_p));
-  
-  return rb_ndtypes_from_type(dtype);
+  plan_count(t, &nsteps, &nchildren);
+  plan_p->steps = ALLOC_N(plan_step_t, nsteps);
+  plan_p->children = ALLOC_N(int64_t, nchildren > 0 ? nchildren : 1);
+
+  ndt_incref(t);
+  plan_p->type = t;
+
+  plan_compile(plan_p, t);
+
+  return plan;
 }
 
-/* Return the ndtypes object of this xnd object. */
+/* Return the cached construction plan of an NDT object, compiling it on
+   first use. Plans of frozen NDT objects are compiled on every use, since
+   they cannot hold the cache. */
 static VALUE
-XND_type(VALUE self)
+init_plan_from_type(VALUE type)
 {
-  XndObject *xnd_p;
+  VALUE plan = rb_ivar_get(type, id_init_plan);
 
-  GET_XND(self, xnd_p);
+  if (NIL_P(plan)) {
+    plan = init_plan_new(type);
+    if (!OBJ_FROZEN(type)) {
+      rb_ivar_set(type, id_init_plan, plan);
+    }
+  }
 
-  return xnd_p->type;
+  return plan;
 }
 
-static VALUE
-_XND_value(const xnd_t * const x, const int64_t maxshape)
+/* Fill x with data by executing step k of plan. */
+static void
+init_plan_exec(const InitPlanObject *plan, int64_t k, xnd_t * const x, VALUE data)
 {
   NDT_STATIC_CONTEXT(ctx);
+  const plan_step_t * const step = &plan->steps[k];
   const ndt_t * const t = x->type;
+  int64_t i;
 
-#ifdef XND_DEBUG
-  assert(t);
-  assert(x);
-#endif
+  if (step->opt) {
+    if (data == Qnil) {
+      xnd_set_na(x);
+      return;
+    }
 
-  if (!ndt_is_concrete(t)) {
-    rb_raise(rb_eTypeError, "type must be concrete for returning value.");
+    xnd_set_valid(x);
   }
 
-  /* bitmap access needs linear index. */
-  if (xnd_is_na(x)) {
-    return Qnil;
+  switch (step->op) {
+  case PLAN_BULK: {
+    mblock_init_bulk(x, data);
+    return;
   }
 
-  switch (t->tag) {
-  case FixedDim: {
-    VALUE array, v;
-    int64_t shape, i;
+  case PLAN_FIXED_DIM: {
+    const int64_t shape = t->FixedDim.shape;
 
-    shape = t->FixedDim.shape;
-    if (shape > maxshape) {
-      shape = maxshape;
-    }
+    Check_Type(data, T_ARRAY);
 
-    array = array_new(shape);
+    if (RARRAY_LEN(data) != shape) {
+      rb_raise(rb_eArgError,
+               "Input length (%ld) and type length (%ld) mismatch.",
+               RARRAY_LEN(data), shape);
+    }
 
     for (i = 0; i < shape; i++) {
-      if (i == maxshape-1) {
-        rb_ary_store(array, i, xnd_ellipsis());
-        break;
-      }
-
-      const xnd_t next = xnd_fixed_dim_next(x, i);
-      v = _XND_value(&next, maxshape);
-      rb_ary_store(array, i, v);
+      xnd_t next = xnd_fixed_dim_next(x, i);
+      init_plan_exec(plan, step->next, &next, rb_ary_entry(data, i));
     }
-
-    return array;
+    return;
   }
 
-  case VarDim: {
-    VALUE array, v;
-    int64_t start, step, shape;
-    int64_t i;
+  case PLAN_VAR_DIM: {
+    int64_t start, vstep, shape;
 
-    shape = ndt_var_indices(&start, &step, t, x->index, &ctx);
+    Check_Type(data, T_ARRAY);
+
+    shape = ndt_var_indices(&start, &vstep, t, x->index, &ctx);
     if (shape < 0) {
       seterr(&ctx);
       raise_error();
     }
-    if (shape > maxshape) {
-      shape = maxshape;
-    }
 
-    array = array_new(shape);
+    if (RARRAY_LEN(data) != shape) {
+      rb_raise(rb_eValueError, "expected Array with size %ld not %ld.",
+               RARRAY_LEN(data), shape);
+    }
 
     for (i = 0; i < shape; i++) {
-      if (i == maxshape-1) {
-        rb_ary_store(array, i, xnd_ellipsis());
-        break;
-      }
-
-      xnd_t next = xnd_var_dim_next(x, start, step, i);
-      v = _XND_value(&next, maxshape);
-      rb_ary_store(array, i, v);
+      xnd_t next = xnd_var_dim_next(x, start, vstep, i);
+      init_plan_exec(plan, step->next, &next, rb_ary_entry(data, i));
     }
-
-    return array;
+    return;
   }
 
-  case VarDimElem: {
-    int64_t start, step, shape;
-
-    shape = ndt_var_indices(&start, &step, t, x->index, &ctx);
-    if (shape < 0) {
-      seterr(&ctx);
-      raise_error();      
-    }
+  case PLAN_TUPLE: {
+    Check_Type(data, T_ARRAY);
 
-    const int64_t i = adjust_index(t->VarDimElem.index, shape, &ctx);
-    if (i < 0) {
-      seterr(&ctx);
-      raise_error();      
+    if (RARRAY_LEN(data) != step->shape) {
+      rb_raise(rb_eArgError,
+               "expected Array with size %ld, not %ld.",
+               step->shape, RARRAY_LEN(data));
     }
 
-    const xnd_t next = xnd_var_dim_next(x, start, step, i);
-    return _XND_value(&next, maxshape);
-  }
-    
-  case Tuple: {
-    VALUE tuple, v;
-    int64_t shape, i;
-
-    shape = t->Tuple.shape;
-    if (shape > maxshape) {
-      shape = maxshape;
-    }
-
-    tuple = array_new(shape);
-
-    for (i = 0; i < shape; i++) {
-      if (i == maxshape) {
-        rb_ary_store(tuple, i, xnd_ellipsis());
-        break;
-      }
-
-      const xnd_t next = xnd_tuple_next(x, i, &ctx);
+    for (i = 0; i < step->shape; i++) {
+      xnd_t next = xnd_tuple_next(x, i, &ctx);
       if (next.ptr == NULL) {
         seterr(&ctx);
         raise_error();
       }
 
-      v = _XND_value(&next, maxshape);
-      rb_ary_store(tuple, i, v);
+      init_plan_exec(plan, plan->children[step->next+i], &next,
+                     rb_ary_entry(data, i));
     }
-
-    return tuple;
+    return;
   }
-    
-  case Record: {
-    VALUE hash, v;
-    int64_t shape, i;
-
-    shape = t->Record.shape;
-    if (shape > maxshape) {
-      shape = maxshape;
-    }
 
-    hash = rb_hash_new();
+  case PLAN_RECORD: {
+    Check_Type(data, T_HASH);
 
-    for (i = 0; i < shape; ++i) {
-      if (i == maxshape - 1) {
-        rb_hash_aset(hash, xnd_ellipsis(), xnd_ellipsis());
-        break;
-      }
+    if (RHASH_SIZE(data) != step->shape) {
+      rb_raise(rb_eArgError, "expected Hash size does not match with shape size.");
+    }
 
+    for (i = 0; i < step->shape; i++) {
       xnd_t next = xnd_record_next(x, i, &ctx);
       if (next.ptr == NULL) {
         seterr(&ctx);
         raise_error();
       }
 
-      v = _XND_value(&next, maxshape);
-      rb_hash_aset(hash, rb_str_new2(t->Record.names[i]), v);
+      init_plan_exec(plan, plan->children[step->next+i], &next,
+                     rb_hash_aref(data, RARRAY_AREF(plan->keys, step->keys+i)));
     }
-
-    return hash;
+    return;
   }
 
-  case Union: {
-    VALUE array, tag, v;
+  case PLAN_UNION: {
+    VALUE tmp;
+    uint8_t tag;
 
-    array = rb_ary_new2(2);
-    const uint8_t i = XND_UNION_TAG(x->ptr);
-    tag = rb_str_new2(t->Union.tags[i]);
+    union_tag_and_value_from_tuple(&tag, &tmp, t, data);
 
-    rb_ary_store(array, 0, tag);
+    xnd_clear(x, XND_OWN_EMBEDDED);
+    XND_UNION_TAG(x->ptr) = tag;
 
-    const xnd_t next = xnd_union_next(x, &ctx);
+    xnd_t next = xnd_union_next(x, &ctx);
     if (next.ptr == NULL) {
       seterr(&ctx);
       raise_error();
     }
-    v = _XND_value(&next, maxshape);
 
-    rb_ary_store(array, 1, v);
-
-    return array;
+    init_plan_exec(plan, plan->children[step->next+tag], &next, tmp);
+    return;
   }
 
-  case Ref: {
+  case PLAN_REF: {
     xnd_t next = xnd_ref_next(x, &ctx);
     if (next.ptr == NULL) {
       seterr(&ctx);
       raise_error();
     }
 
-    return _XND_value(&next, maxshape);
+    init_plan_exec(plan, step->next, &next, data);
+    return;
   }
 
-  case Constr: {
+  case PLAN_CONSTR: {
     xnd_t next = xnd_constr_next(x, &ctx);
     if (next.ptr == NULL) {
       seterr(&ctx);
       raise_error();
     }
 
-    return _XND_value(&next, maxshape);
+    init_plan_exec(plan, step->next, &next, data);
+    return;
   }
 
-  case Nominal: {
+  case PLAN_NOMINAL: {
     xnd_t next = xnd_nominal_next(x, &ctx);
     if (next.ptr == NULL) {
       seterr(&ctx);
-      raise_error();      
+      raise_error();
     }
 
-    if (t->Nominal.meth->repr != NULL) {
-      return t->Nominal.meth->repr(&next, &ctx);
+    if (t->Nominal.meth->init != NULL) {
+      if (!t->Nominal.meth->init(&next, x, &ctx)) {
+        rb_raise(rb_eTypeError, "could not init Nominal type in mblock_init.");
+      }
+      return;
     }
 
-    return _XND_value(&next, maxshape);
-  }
-
-  case Bool: {
-    bool temp;
-    UNPACK_SINGLE(temp, x->ptr, bool, t->flags);
-    return INT2BOOL(temp);
-  }
+    init_plan_exec(plan, step->next, &next, data);
 
-  case Int8: {
-    int8_t temp;
-    UNPACK_SINGLE(temp, x->ptr, int8_t, t->flags);
-    return INT2NUM(temp);
+    if (t->Nominal.meth->constraint != NULL &&
+        !t->Nominal.meth->constraint(&next, &ctx)) {
+      seterr(&ctx);
+      raise_error();
+    }
+    return;
   }
 
-  case Int16: {
-    int16_t temp;
-    UNPACK_SINGLE(temp, x->ptr, int16_t, t->flags);
-    return INT2NUM(temp);
-  }
-    
-  case Int32: {
-    int32_t temp;
-    UNPACK_SINGLE(temp, x->ptr, int32_t, t->flags);
-    return INT2NUM(temp);
+  case PLAN_SCALAR: {
+    _mblock_init(x, data);
+    return;
   }
-    
-  case Int64: {
-    int64_t temp;
-    UNPACK_SINGLE(temp, x->ptr, int64_t, t->flags);
-    return LL2NUM(temp);
   }
+}
 
-  case Uint8: {
-    uint8_t temp;
-    UNPACK_SINGLE(temp, x->ptr, uint8_t, t->flags);
-    return UINT2NUM(temp);
-  }
+/* Create mblock from NDT type.
+ *
+ * @param type - NDT Ruby object.
+ * @param data - Data as a Ruby object.
+ */
+static VALUE
+mblock_from_typed_value(VALUE type, VALUE data, int32_t flags)
+{
+  VALUE mblock, plan;
+  MemoryBlockObject *mblock_p;
+  InitPlanObject *plan_p;
 
-  case Uint16: {
-    uint16_t temp;
-    UNPACK_SINGLE(temp, x->ptr, uint16_t, t->flags);
-    return UINT2NUM(temp);
-  }
+  mblock = mblock_empty(type, flags);
+  GET_MBLOCK(mblock, mblock_p);
 
-  case Uint32: {
-    uint32_t temp;
-    UNPACK_SINGLE(temp, x->ptr, uint32_t, t->flags);
-    return ULL2NUM(temp);
-  }
+  plan = init_plan_from_type(type);
+  GET_INIT_PLAN(plan, plan_p);
+  init_plan_exec(plan_p, 0, &mblock_p->xnd->master, data);
+  RB_GC_GUARD(plan);
 
-  case Uint64: {
-    uint64_t temp;
-    UNPACK_SINGLE(temp, x->ptr, uint64_t, t->flags);
-    return ULL2NUM(temp);
-  }
+  return mblock;
+}
 
-  case BFloat16: {
-    rb_raise(rb_eNotImpError, "bfloat16 is not implemented.");
-  }
+/****************************************************************************/
+/*                               Serialization                              */
+/****************************************************************************/
 
-  case Float16: {
-    rb_raise(rb_eNotImpError, "float16 is not implemented.");
-  }
+/* XND#serialize writes pointer-free arrays without bitmaps in the basic
+ * layout:
+ *
+ *   data | type | int64 datasize
+ *
+ * Arrays with optional values or strings/bytes use the extended layout:
+ *
+ *   data | bits | heap | type | int64 datasize | int64 nbits |
+ *   int64 heaplen | int64 SERIALIZE_EXT
+ *
+ * bits holds one validity bit per optional value and heap holds an int64
+ * length (-1 for NULL) and the contents of each string/bytes value, both
+ * in the order of a depth-first walk over the array. Values below a
+ * missing value are not recorded. Pointers in the data section are zeroed.
+ */
+#define SERIALIZE_EXT INT64_C(-1)
+
+/* Sections of a serialized buffer beyond the data and the type. */
+typedef struct {
+  const uint8_t *bits;  /* validity bits, NULL in the basic layout */
+  int64_t nbits;        /* number of validity bits */
+  const char *heap;     /* string and bytes heap, NULL in the basic layout */
+  int64_t heaplen;      /* length of the heap in bytes */
+} serial_ext_t;
+
+/* Parse the type and the extended sections from a buffer in the
+   XND#serialize layout. Return a new reference. */
+static const ndt_t *
+deserialize_type(const char *s, const int64_t size, serial_ext_t *ext)
+{
+  NDT_STATIC_CONTEXT(ctx);
+  bool overflow = false;
+  int64_t mblock_size, trailer, nbytes, start, tlen;
+  const ndt_t *t;
 
-  case Float32: {
-    float temp = 0.0;
+  ext->bits = NULL;
+  ext->nbits = 0;
+  ext->heap = NULL;
+  ext->heaplen = 0;
 
-    rb_xnd_unpack_float32(&temp, (unsigned char*)x->ptr, le(t->flags));
-    return DBL2NUM(temp);
+  if (size < 8) {
+    goto invalid_format;
   }
 
-  case Float64: {
-    double temp = 0.0;
-    
-    rb_xnd_unpack_float64(&temp, (unsigned char*)x->ptr, le(t->flags));
-    return DBL2NUM(temp);
-  }
+  memcpy(&trailer, s+size-8, 8);
 
-  case BComplex32: {
-    rb_raise(rb_eNotImpError, "bcomplex32 not implemented.");    
-  }
+  if (trailer == SERIALIZE_EXT) {
+    if (size < 32) {
+      goto invalid_format;
+    }
 
-  case Complex32: {
-    rb_raise(rb_eNotImpError, "complex32 not implemented.");
+    memcpy(&mblock_size, s+size-32, 8);
+    memcpy(&ext->nbits, s+size-24, 8);
+    memcpy(&ext->heaplen, s+size-16, 8);
+    if (mblock_size < 0 || ext->nbits < 0 || ext->heaplen < 0) {
+      goto invalid_format;
+    }
+
+    nbytes = ext->nbits / 8 + (ext->nbits % 8 != 0);
+    start = ADDi64(mblock_size, nbytes, &overflow);
+    start = ADDi64(start, ext->heaplen, &overflow);
+    tlen = size - 32 - start;
+    if (overflow || tlen < 0) {
+      goto invalid_format;
+    }
+
+    ext->bits = (const uint8_t *)s + mblock_size;
+    ext->heap = s + mblock_size + nbytes;
   }
+  else {
+    mblock_size = trailer;
+    if (mblock_size < 0) {
+      goto invalid_format;
+    }
 
-  case Complex64: {
-    float real = 0.0, imag = 0.0;
+    start = mblock_size;
+    tlen = size - 8 - start;
+    if (tlen < 0) {
+      goto invalid_format;
+    }
+  }
 
-    rb_xnd_unpack_float32(&real, (unsigned char*)x->ptr, le(t->flags));
-    rb_xnd_unpack_float32(&imag, (unsigned char*)x->ptr+4, le(t->flags));
+  t = ndt_deserialize(s+start, tlen, &ctx);
+  if (t == NULL) {
+    seterr(&ctx);
+    raise_error();
+  }
 
-    return rb_complex_new(DBL2NUM(real), DBL2NUM(imag));
+  if (t->datasize != mblock_size ||
+      (ext->bits == NULL && !ndt_is_pointer_free(t))) {
+    ndt_decref(t);
+    goto invalid_format;
   }
 
-  case Complex128: {
-    double real = 0.0, imag = 0.0;
+  return t;
 
-    rb_xnd_unpack_float64(&real, (unsigned char*)x->ptr, le(t->flags));
-    rb_xnd_unpack_float64(&imag, (unsigned char*)x->ptr+8, le(t->flags));
+ invalid_format:
+  rb_raise(rb_eValueError, "invalid format for xnd deserialization.");
+}
 
-    return rb_complex_new(DBL2NUM(real), DBL2NUM(imag));
-  }
+/* Return true if arrays of type t need the extended layout. */
+static int
+serial_needs_ext(const ndt_t *t)
+{
+  return !ndt_is_pointer_free(t) || ndt_is_optional(t) ||
+    ndt_subtree_is_optional(t);
+}
 
-  case FixedString: {
-    int64_t codepoints = t->FixedString.size;
-    
-    switch (t->FixedString.encoding) {
-    case Ascii: {
-      codepoints = u8_skip_trailing_zero((uint8_t *)x->ptr, codepoints);
-      return rb_usascii_str_new(x->ptr, codepoints);
+/* Return true if the walk below can handle all values of type t. */
+static int
+serial_type_supported(const ndt_t *t)
+{
+  int64_t i;
+
+  switch (t->tag) {
+  case FixedDim: return serial_type_supported(t->FixedDim.type);
+  case VarDim: return serial_type_supported(t->VarDim.type);
+  case VarDimElem: return serial_type_supported(t->VarDimElem.type);
+  case Constr: return serial_type_supported(t->Constr.type);
+  case Nominal: return serial_type_supported(t->Nominal.type);
+  case Tuple:
+    for (i = 0; i < t->Tuple.shape; i++) {
+      if (!serial_type_supported(t->Tuple.types[i])) return 0;
     }
-      
-    case Utf8: {
-      codepoints = u8_skip_trailing_zero((uint8_t *)x->ptr, codepoints);
-      return rb_utf8_str_new(x->ptr, codepoints);
+    return 1;
+  case Record:
+    for (i = 0; i < t->Record.shape; i++) {
+      if (!serial_type_supported(t->Record.types[i])) return 0;
     }
-
-    case Utf16: {
-      rb_encoding *utf16 = rb_enc_find("UTF-16");      
-      codepoints = u16_skip_trailing_zero((uint16_t *)x->ptr, codepoints);
-
-      return rb_enc_str_new(x->ptr, codepoints*2, utf16);
+    return 1;
+  case Union:
+    for (i = 0; i < t->Union.ntags; i++) {
+      if (!serial_type_supported(t->Union.types[i])) return 0;
     }
+    return 1;
+  case Ref: case Array:
+    return 0;
+  default:
+    return 1;
+  }
+}
 
-    case Utf32: {
-      rb_encoding *utf32 = rb_enc_find("UTF-32");
-      codepoints = u32_skip_trailing_zero((uint32_t *)x->ptr, codepoints);
-      
-      return rb_enc_str_new(x->ptr, codepoints*4, utf32);
-    }
+enum serial_mode {
+  SERIAL_DUMP,    /* collect bits and heap from an array */
+  SERIAL_CLEAR,   /* reset all pointers in an array to NULL */
+  SERIAL_LOAD     /* restore bits and heap into an array */
+};
 
-    case Ucs2: {
-      rb_raise(rb_eNotImpError, "UCS2 encoding not implemented.");
-    }
+/* State of a walk over the parts of an array that live outside its data
+   section. */
+typedef struct {
+  enum serial_mode mode;
+  const char *base;     /* DUMP: start of the data section in memory */
+  char *out;            /* DUMP: copy of the data section to zero pointers in */
+  VALUE bits;           /* DUMP: bits String */
+  VALUE heap;           /* DUMP: heap String */
+  uint8_t byte;         /* DUMP: bits not yet appended */
+  serial_ext_t in;      /* LOAD: input sections */
+  int64_t nbits;        /* number of bits written or read */
+  int64_t heappos;      /* LOAD: read position in the heap */
+} serial_walk_t;
 
-    default: {
-      rb_raise(rb_eRuntimeError, "invalid string encoding.");
-    } 
-    }
+static void
+serial_put_bit(serial_walk_t *st, int bit)
+{
+  if (bit) {
+    st->byte |= (uint8_t)(1 << (st->nbits % 8));
   }
 
-  case FixedBytes: {
-    return bytes_from_string_and_size(x->ptr, t->FixedBytes.size);
+  st->nbits++;
+  if (st->nbits % 8 == 0) {
+    rb_str_cat(st->bits, (const char *)&st->byte, 1);
+    st->byte = 0;
   }
+}
 
-  case String: {
-    const char *s = XND_STRING_DATA(x->ptr);
-    size_t size = strlen(s);
+static int
+serial_get_bit(serial_walk_t *st)
+{
+  int64_t k = st->nbits;
 
-    return rb_utf8_str_new(s, size);
+  if (k >= st->in.nbits) {
+    rb_raise(rb_eValueError, "invalid format for xnd deserialization.");
   }
 
-  case Bytes: {
-    char *s = (char *)XND_BYTES_DATA(x->ptr);
-    size_t size = s ? strlen(s) : 0;
+  st->nbits++;
+  return (st->in.bits[k/8] >> (k%8)) & 1;
+}
 
-    return bytes_from_string_and_size(s, size);
+/* Append len bytes at ptr to the heap. len is -1 for a NULL pointer. */
+static void
+serial_put_heap(serial_walk_t *st, const char *ptr, int64_t len)
+{
+  rb_str_cat(st->heap, (const char *)&len, 8);
+  if (len > 0) {
+    rb_str_cat(st->heap, ptr, len);
   }
+}
 
-  case Array: {
-    VALUE lst, v;
-    int64_t shape;
+/* Read the next heap entry and return a pointer to its contents. */
+static const char *
+serial_get_heap(serial_walk_t *st, int64_t *len)
+{
+  const char *ptr;
 
-    shape = XND_ARRAY_SHAPE(x->ptr);
-    if (shape > maxshape) {
-      shape = maxshape;
-    }
+  if (st->in.heaplen - st->heappos < 8) {
+    goto invalid_format;
+  }
 
-    lst = rb_ary_new2(shape);
+  memcpy(len, st->in.heap + st->heappos, 8);
+  st->heappos += 8;
+  if (*len < -1 || (*len > 0 && st->in.heaplen - st->heappos < *len)) {
+    goto invalid_format;
+  }
 
-    for (int i = 0; i < shape; ++i) {
-      if (i == maxshape-1) {
-        rb_ary_store(lst, i, xnd_ellipsis());
-        break;
-      }
+  ptr = st->in.heap + st->heappos;
+  if (*len > 0) {
+    st->heappos += *len;
+  }
 
-      const xnd_t next = xnd_array_next(x, i);
-      v = _XND_value(&next, maxshape);
-      if (v == NULL) {
-        return NULL;
+  return ptr;
+
+ invalid_format:
+  rb_raise(rb_eValueError, "invalid format for xnd deserialization.");
+}
+
+/* Zero size bytes of the output data section that correspond to ptr. */
+static void
+serial_zero(serial_walk_t *st, const void *ptr, size_t size)
+{
+  memset(st->out + ((const char *)ptr - st->base), 0, size);
+}
+
+/* Walk over all values of x in depth-first order. na is true below a
+   missing value, where nothing is recorded. */
+static void
+serial_walk(serial_walk_t *st, const xnd_t *x, bool na)
+{
+  NDT_STATIC_CONTEXT(ctx);
+  const ndt_t * const t = x->type;
+  int64_t i;
+
+  if (st->mode == SERIAL_CLEAR) {
+    na = true;
+  }
+
+  if (!na && ndt_is_optional(t)) {
+    int valid;
+
+    if (st->mode == SERIAL_DUMP) {
+      valid = xnd_is_valid(x);
+      serial_put_bit(st, valid);
+    }
+    else {
+      valid = serial_get_bit(st);
+      if (valid) {
+        xnd_set_valid((xnd_t *)x);
       }
-      rb_ary_stor(lst, i, v);
     }
 
-    return lst;
+    na = !valid;
   }
 
-  case Categorical: {
-    int64_t k;
-
-    UNPACK_SINGLE(k, x->ptr, int64_t, t->flags);
+  if (ndt_is_pointer_free(t) && (na || !ndt_subtree_is_optional(t))) {
+    return;
+  }
 
-    switch(t->Categorical.types[k].tag) {
-    case ValBool: {
-      bool temp = t->Categorical.types[k].ValBool;
-      return INT2BOOL(temp);
+  switch (t->tag) {
+  case FixedDim: {
+    for (i = 0; i < t->FixedDim.shape; i++) {
+      const xnd_t next = xnd_fixed_dim_next(x, i);
+      serial_walk(st, &next, na);
     }
+    return;
+  }
 
-    case ValInt64: {
-      int64_t temp = t->Categorical.types[k].ValInt64;
-      return LL2NUM(temp);
-    }
+  case VarDim: {
+    int64_t start, step, shape;
 
-    case ValFloat64: {
-      double temp = t->Categorical.types[k].ValFloat64;
-      return DBL2NUM(temp);
+    shape = ndt_var_indices(&start, &step, t, x->index, &ctx);
+    if (shape < 0) {
+      seterr(&ctx);
+      raise_error();
     }
 
-    case ValString: {
-      const char *temp = t->Categorical.types[k].ValString;
-      return rb_str_new2(temp);
+    for (i = 0; i < shape; i++) {
+      const xnd_t next = xnd_var_dim_next(x, start, step, i);
+      serial_walk(st, &next, na);
     }
+    return;
+  }
 
-    case ValNA: {
-      return Qnil;
+  case VarDimElem: {
+    int64_t start, step, shape;
+
+    shape = ndt_var_indices(&start, &step, t, x->index, &ctx);
+    if (shape < 0) {
+      seterr(&ctx);
+      raise_error();
     }
 
-    default: {
-      rb_raise(rb_eRuntimeError, "unexpected category tag.");
+    i = adjust_index(t->VarDimElem.index, shape, &ctx);
+    if (i < 0) {
+      seterr(&ctx);
+      raise_error();
     }
+
+    const xnd_t next = xnd_var_dim_next(x, start, step, i);
+    serial_walk(st, &next, na);
+    return;
+  }
+
+  case Tuple: {
+    for (i = 0; i < t->Tuple.shape; i++) {
+      const xnd_t next = xnd_tuple_next(x, i, &ctx);
+      if (next.ptr == NULL) {
+        seterr(&ctx);
+        raise_error();
+      }
+      serial_walk(st, &next, na);
     }
+    return;
   }
 
-  case Char: {
-    rb_raise(rb_eNotImpError, "char semantics need to be defined.");
+  case Record: {
+    for (i = 0; i < t->Record.shape; i++) {
+      const xnd_t next = xnd_record_next(x, i, &ctx);
+      if (next.ptr == NULL) {
+        seterr(&ctx);
+        raise_error();
+      }
+      serial_walk(st, &next, na);
+    }
+    return;
   }
 
-  case Module: {
-    rb_raise(rb_eNotImpError, "'Module' type not implemented yet.");
+  case Union: {
+    if (XND_UNION_TAG(x->ptr) >= t->Union.ntags) {
+      if (st->mode == SERIAL_CLEAR) {
+        memset(x->ptr, 0, t->datasize);
+        return;
+      }
+      rb_raise(rb_eValueError, "invalid format for xnd deserialization.");
+    }
+
+    const xnd_t next = xnd_union_next(x, &ctx);
+    if (next.ptr == NULL) {
+      seterr(&ctx);
+      raise_error();
+    }
+    serial_walk(st, &next, na);
+    return;
   }
 
-    /* NOT REACHED: intercepted by ndt_is_abstract(). */
-  case AnyKind: case SymbolicDim: case EllipsisDim: case Typevar:
-  case ScalarKind: case SignedKind: case UnsignedKind: case FloatKind:
-  case ComplexKind: case FixedStringKind: case FixedBytesKind:
-  case Function:
-    rb_raise(rb_eArgError, "unexpected abstract type.");
+  case Constr: {
+    const xnd_t next = xnd_constr_next(x, &ctx);
+    if (next.ptr == NULL) {
+      seterr(&ctx);
+      raise_error();
+    }
+    serial_walk(st, &next, na);
+    return;
   }
 
-  rb_raise(rb_eRuntimeError, "invalid type tag %d.", t->tag);
-}
+  case Nominal: {
+    const xnd_t next = xnd_nominal_next(x, &ctx);
+    if (next.ptr == NULL) {
+      seterr(&ctx);
+      raise_error();
+    }
+    serial_walk(st, &next, na);
+    return;
+  }
 
-/* Return the value of this xnd object. Aliased to to_a. */
-static VALUE
-XND_value(VALUE self)
-{
-  XndObject *xnd_p;
+  case String: {
+    const char *s = XND_POINTER_DATA(x->ptr);
 
-  GET_XND(self, xnd_p);
+    switch (st->mode) {
+    case SERIAL_DUMP:
+      if (!na) {
+        serial_put_heap(st, s, s == NULL ? -1 : (int64_t)strlen(s));
+      }
+      serial_zero(st, x->ptr, sizeof(char *));
+      return;
 
-  return _XND_value(XND(xnd_p), INT64_MAX);
-}
+    case SERIAL_CLEAR:
+      XND_POINTER_DATA(x->ptr) = NULL;
+      return;
 
-/*************************** slicing functions ********************************/
+    case SERIAL_LOAD: {
+      int64_t len;
+      char *cp;
 
-#define KEY_INDEX 1
-#define KEY_FIELD 2
-#define KEY_SLICE 4
-#define KEY_ERROR 128
+      if (na) {
+        return;
+      }
 
-/* 
-   @param src_p Pointer to the source XND object from which view is being created.
-   @param x Metadata for creating the view.
- */
-static VALUE
-RubyXND_view_move_type(XndObject *src_p, xnd_t *x)
-{
-  XndObject *view_p;
-  MemoryBlockObject* mblock_p;
-  VALUE type, view;
+      s = serial_get_heap(st, &len);
+      if (len < 0) {
+        return;
+      }
 
-  type = rb_ndtypes_from_type(x->type);
-  ndt_decref(x->type);
-  
-  view = XndObject_alloc(cXND);
-  GET_XND(view, view_p);
+      cp = ndt_alloc(1, len+1);
+      if (cp == NULL) {
+        rb_raise(rb_eNoMemError, "no memory for allocating string.");
+      }
+      memcpy(cp, s, len);
+      cp[len] = '\0';
 
-  view_p->mblock = src_p->mblock;
-  view_p->type = type;
-  view_p->xnd = *x;
+      XND_POINTER_DATA(x->ptr) = cp;
+      return;
+    }
+    }
+  }
 
-  GET_MBLOCK(view_p->mblock, mblock_p);
-  
-  rb_xnd_gc_guard_register_xnd_type(view_p, type);
-  rb_xnd_gc_guard_register_xnd_mblock(view_p, view_p->mblock);
-  rb_xnd_gc_guard_register_mblock_type(mblock_p, type);
+  case Bytes: {
+    switch (st->mode) {
+    case SERIAL_DUMP:
+      if (!na) {
+        const uint8_t *data = XND_BYTES_DATA(x->ptr);
+        serial_put_heap(st, (const char *)data,
+                        data == NULL ? -1 : XND_BYTES_SIZE(x->ptr));
+      }
+      serial_zero(st, &XND_BYTES_DATA(x->ptr), sizeof(uint8_t *));
+      return;
 
-  return view;
-}
+    case SERIAL_CLEAR:
+      XND_BYTES_SIZE(x->ptr) = 0;
+      XND_BYTES_DATA(x->ptr) = NULL;
+      return;
 
-/* Convert a single Ruby object index into a form that XND can understand. 
-   
-   @param *key
-   @param obj
-   @param size Size of object. 1 for all scalars and the actual size otherwise.
-*/
-static uint8_t
-convert_single(xnd_index_t *key, VALUE obj, size_t size)
-{
-  if (RB_TYPE_P(obj, T_FIXNUM)) {
-    int64_t i = NUM2LL(obj);
+    case SERIAL_LOAD: {
+      const char *data;
+      int64_t len;
+      char *cp;
 
-    key->tag = Index;
-    key->Index = i;
+      if (na) {
+        return;
+      }
 
-    return KEY_INDEX;
-  }
-  else if (RB_TYPE_P(obj, T_STRING)) {
-    const char *s = StringValuePtr(obj);
+      data = serial_get_heap(st, &len);
+      if (len < 0) {
+        return;
+      }
 
-    key->tag = FieldName;
-    key->FieldName = s;
+      cp = ndt_aligned_calloc(t->Bytes.target_align, len);
+      if (cp == NULL && len > 0) {
+        rb_raise(rb_eNoMemError, "no memory for allocating bytes.");
+      }
+      memcpy(cp, data, len);
 
-    return KEY_FIELD;
+      XND_BYTES_SIZE(x->ptr) = len;
+      XND_BYTES_DATA(x->ptr) = (uint8_t *)cp;
+      return;
+    }
+    }
   }
-  else if (CLASS_OF(obj) == rb_cRange) {
-    if (size == 0) {
-      rb_raise(rb_eIndexError, "Cannot use Range on this type.");
-    };
-    
-    long long begin, end, step;
-
-    rb_range_unpack(obj, &begin, &end, &step, size);
-    key->tag = Slice;
-    key->Slice.start = begin;
-    key->Slice.stop = end;
-    key->Slice.step = step;
 
-    return KEY_SLICE;
+  case Ref: {
+    rb_raise(rb_eNotImpError, "serializing references is not implemented.");
   }
-  // case of INF (infinite range syntax sugar)
-  else if (RB_TYPE_P(obj, T_FLOAT)) {
-    double value = RFLOAT_VALUE(obj);
 
-    if (isinf(value)) {
-      key->tag = Slice;
-      key->Slice.start = 0;
-      key->Slice.stop = INT64_MAX;
-      key->Slice.step = 1;
-
-      return KEY_SLICE;
-    }
-    else {
-      rb_raise(rb_eArgError, "wrong object specified in index.");
-    }
+  case Array: {
+    rb_raise(rb_eNotImpError, "serializing flexible arrays is not implemented.");
   }
-  else {
-    rb_raise(rb_eArgError, "wrong object specified in index.");
+
+  default:
+    return;
   }
 }
 
-static uint8_t
-convert_key(xnd_index_t *indices, int *len, int argc, VALUE *argv, size_t size)
+/* Serialize x, whose data section starts at ptr, in the extended layout. */
+static VALUE
+serialize_ext(const xnd_t *x, const char *ptr)
 {
-  uint8_t flags = 0;
-  VALUE x;
+  NDT_STATIC_CONTEXT(ctx);
+  const ndt_t * const t = x->type;
+  bool overflow = false;
+  serial_walk_t st;
+  VALUE data, result;
+  int64_t tlen, size, nbytes, heaplen;
+  const int64_t marker = SERIALIZE_EXT;
+  char *s;
 
-  if (argc > 1) {
+  if (!serial_type_supported(t)) {
+    rb_raise(rb_eNotImpError, "serializing references and flexible arrays "
+             "is not implemented.");
+  }
+
+  data = rb_str_new(ptr, t->datasize);
+
+  memset(&st, 0, sizeof st);
+  st.mode = SERIAL_DUMP;
+  st.base = ptr;
+  st.out = RSTRING_PTR(data);
+  st.bits = rb_str_buf_new(0);
+  st.heap = rb_str_buf_new(0);
+  serial_walk(&st, x, false);
+  if (st.nbits % 8 != 0) {
+    rb_str_cat(st.bits, (const char *)&st.byte, 1);
+  }
+
+  nbytes = RSTRING_LEN(st.bits);
+  heaplen = RSTRING_LEN(st.heap);
+
+  tlen = ndt_serialize(&s, t, &ctx);
+  if (tlen < 0) {
+    seterr(&ctx);
+    raise_error();
+  }
+
+  size = ADDi64(t->datasize, nbytes, &overflow);
+  size = ADDi64(size, heaplen, &overflow);
+  size = ADDi64(size, tlen, &overflow);
+  size = ADDi64(size, 32, &overflow);
+  if (overflow) {
+    ndt_free(s);
+    rb_raise(rb_eTypeError, "too large to serialize.");
+  }
+
+  result = rb_str_buf_new(size);
+  rb_str_buf_append(result, data);
+  rb_str_buf_append(result, st.bits);
+  rb_str_buf_append(result, st.heap);
+  rb_str_cat(result, s, tlen);
+  ndt_free(s);
+  rb_str_cat(result, (const char *)&t->datasize, 8);
+  rb_str_cat(result, (const char *)&st.nbits, 8);
+  rb_str_cat(result, (const char *)&heaplen, 8);
+  rb_str_cat(result, (const char *)&marker, 8);
+
+  RB_GC_GUARD(data);
+  return result;
+}
+
+/* Fill the data section, bitmaps and heap data of the new array x from a
+   buffer in the extended layout. */
+static void
+deserialize_ext(const xnd_t *x, const char *data, const serial_ext_t *ext)
+{
+  serial_walk_t st;
+
+  if (!serial_type_supported(x->type)) {
+    rb_raise(rb_eNotImpError, "deserializing references and flexible arrays "
+             "is not implemented.");
+  }
+
+  memcpy(x->ptr, data, x->type->datasize);
+
+  /* The data section may contain arbitrary pointers: reset them first so
+     that the array can be freed if loading fails. */
+  memset(&st, 0, sizeof st);
+  st.mode = SERIAL_CLEAR;
+  serial_walk(&st, x, true);
+
+  st.mode = SERIAL_LOAD;
+  st.in = *ext;
+  serial_walk(&st, x, false);
+
+  if (st.nbits != ext->nbits || st.heappos != ext->heaplen) {
+    rb_raise(rb_eValueError, "invalid format for xnd deserialization.");
+  }
+}
+
+/****************************************************************************/
+/*                           Memory mapped files                            */
+/****************************************************************************/
+
+/* Owner of a file mapping that is the base of an mblock. */
+typedef struct MappingObject {
+  void *addr;     /* start of the mapping */
+  size_t size;    /* length of the mapping */
+} MappingObject;
+
+#define GET_MAPPING(obj, mapping_p) do {                        \
+    TypedData_Get_Struct((obj), MappingObject,                  \
+                         &MappingObject_type, (mapping_p));     \
+  } while (0)
+#define MAKE_MAPPING(klass, mapping_p) TypedData_Make_Struct(klass, MappingObject, \
+                                                             &MappingObject_type, mapping_p)
+
+static void
+MappingObject_dfree(void *self)
+{
+  MappingObject *mapping = (MappingObject *)self;
+
+#ifdef HAVE_SYS_MMAN_H
+  if (mapping->addr != NULL) {
+    munmap(mapping->addr, mapping->size);
+  }
+#endif
+  xfree(mapping);
+}
+
+static size_t
+MappingObject_dsize(const void *self)
+{
+  return sizeof(MappingObject);
+}
+
+static const rb_data_type_t MappingObject_type = {
+  .wrap_struct_name = "MappingObject",
+  .function = {
+    .dmark = NULL,
+    .dfree = MappingObject_dfree,
+    .dsize = MappingObject_dsize,
+    .reserved = {0,0},
+  },
+  .parent = 0,
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+/* Map the file at path, which must be in the XND#serialize layout, and
+   create an mblock backed by the mapping. The data starts at offset 0 of
+   the file and is therefore page aligned. */
+static VALUE
+mblock_from_file(VALUE path, bool readonly)
+{
+#ifdef HAVE_SYS_MMAN_H
+  MappingObject *mapping_p;
+  VALUE mapping, type;
+  serial_ext_t ext;
+  struct stat st;
+  const ndt_t *t;
+  int fd;
+
+  FilePathValue(path);
+
+  fd = rb_cloexec_open(StringValueCStr(path), readonly ? O_RDONLY : O_RDWR, 0);
+  if (fd < 0) {
+    rb_sys_fail_str(path);
+  }
+
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    rb_sys_fail_str(path);
+  }
+
+  if (st.st_size < 8) {
+    close(fd);
+    rb_raise(rb_eValueError, "invalid format for xnd deserialization.");
+  }
+
+  mapping = MAKE_MAPPING(cRubyXND_Mapping, mapping_p);
+  mapping_p->size = (size_t)st.st_size;
+  mapping_p->addr = mmap(NULL, mapping_p->size,
+                         readonly ? PROT_READ : PROT_READ|PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (mapping_p->addr == MAP_FAILED) {
+    mapping_p->addr = NULL;
+    rb_sys_fail_str(path);
+  }
+
+  t = deserialize_type(mapping_p->addr, st.st_size, &ext);
+  type = rb_ndtypes_from_type(t);
+  ndt_decref(t);
+
+  if (ext.bits != NULL ||
+      !mblock_can_borrow(rb_ndtypes_const_ndt(type), mapping_p->addr)) {
+    rb_raise(rb_eNotImpError, "cannot map the data of type %"PRIsVALUE".", type);
+  }
+
+  return mblock_borrow(type, mapping, mapping_p->addr, readonly);
+#else
+  rb_raise(rb_eNotImpError, "memory mapped files are not supported on this platform.");
+#endif
+}
+
+/****************************************************************************/
+/*                                 xnd object                               */
+/****************************************************************************/
+
+typedef struct XndObject {
+  VALUE mblock;              /* owner of the primary type and memory block */
+  VALUE type;                /* owner of the current type. lives and dies with this obj. */
+  xnd_t xnd;                 /* typed view, does not own anything */
+} XndObject;
+
+#define XND(xnd_p) (&(((XndObject *)xnd_p)->xnd))
+#define TYPE_OWNER(xnd_p) ((((XndObject *)xnd_p)->type))
+#define XND_TYPE(xnd_p) (((XndObject *)xnd_p)->xnd.type)
+#define XND_INDEX(xnd_p) (((XndObject *)xnd_p)->xnd.index)
+#define XND_PTR(xnd_p) (((XndObject *)xnd_p)->xnd.ptr)
+
+#define XND_CHECK_TYPE(xnd) (CLASS_OF(xnd) == cXND)
+#define GET_XND(obj, xnd_p) do {                                        \
+    TypedData_Get_Struct((obj), XndObject,                              \
+                         &XndObject_type, (xnd_p));                     \
+    if ((xnd_p)->mblock && MBLOCK_RELEASED((xnd_p)->mblock)) {          \
+      rb_raise(rb_eRuntimeError,                                        \
+               "the data of this XND object was released with its arena."); \
+    }                                                                   \
+  } while (0)
+#define MAKE_XND(klass, xnd_p) TypedData_Make_Struct(klass, XndObject, \
+                                                    &XndObject_type, xnd_p)
+#define WRAP_XND(klass, xnd_p) TypedData_Wrap_Struct(klass, &XndObject_type, xnd_p)
+
+static VALUE XND_size(VALUE self);
+
+/* Allocate an XndObject and return wrapped in a Ruby object. */
+static VALUE
+XndObject_alloc(VALUE klass)
+{
+  XndObject *xnd;
+
+  xnd = ZALLOC(XndObject);
+
+  xnd->mblock = 0;
+  xnd->type = 0;
+  xnd->xnd.bitmap.data = NULL;
+  xnd->xnd.bitmap.size = 0;
+  xnd->xnd.bitmap.next = NULL;
+  xnd->xnd.index = 0;
+  xnd->xnd.type  = NULL;
+  xnd->xnd.ptr = NULL;
+
+  return WRAP_XND(klass, xnd);
+}
+
+/* Mark Ruby objects within XndObject. */
+static void
+XndObject_dmark(void *self)
+{
+  XndObject *xnd = (XndObject*)self;
+
+  rb_gc_mark(xnd->type);
+  rb_gc_mark(xnd->mblock);
+}
+
+static void
+XndObject_dfree(void *self)
+{
+  XndObject *xnd = (XndObject*)self;
+
+  xfree(xnd);
+}
+
+static size_t
+XndObject_dsize(const void *self)
+{
+  return sizeof(XndObject);
+}
+
+static const rb_data_type_t XndObject_type = {
+  .wrap_struct_name = "XndObject",
+  .function = {
+    .dmark = XndObject_dmark,
+    .dfree = XndObject_dfree,
+    .dsize = XndObject_dsize,
+    .reserved = {0,0},
+  },
+  .parent = 0,
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static void
+XND_from_mblock(XndObject *xnd_p, VALUE mblock)
+{
+  MemoryBlockObject *mblock_p;
+
+  GET_MBLOCK(mblock, mblock_p);
+  
+  xnd_p->mblock = mblock;
+  xnd_p->type = mblock_p->type;
+  xnd_p->xnd = mblock_p->xnd->master;
+}
+
+/* Allocator for RubyXND object. Called by Ruby before initialize. */
+static VALUE
+RubyXND_allocate(VALUE klass)
+{
+  XndObject *xnd;
+
+  xnd = ZALLOC(XndObject);
+
+  xnd->mblock = 0;
+  xnd->type = 0;
+  xnd->xnd.bitmap.data = NULL;
+  xnd->xnd.bitmap.size = 0;
+  xnd->xnd.bitmap.next = NULL;
+  xnd->xnd.index = 0;
+  xnd->xnd.type  = NULL;
+  xnd->xnd.ptr = NULL;
+
+  return WRAP_XND(klass, xnd);
+}
+
+static uint32_t
+device_flags(VALUE array)
+{
+  VALUE device, no;
+
+  Check_Type(array, T_ARRAY);
+  if (RARRAY_LEN(array) != 2) {
+    rb_raise(rb_eTypeError, "device argument must be of the form (device_name, device_no).");
+  }
+
+  device = rb_ary_entry(array, 0);
+  Check_Type(device, T_STRING);
+  if (RTEST(rb_funcall(device, rb_intern("=="), 1, rb_str_new_literal("cuda")))) {
+    rb_raise(rb_eValueError, "currently only 'cuda' is supported as a device name.");
+  }
+    
+  no = rb_ary_entry(array, 1);
+  Check_Type(no, T_FIXNUM);
+  if (FIX2NUM(no) != -1) {
+    rb_raise(rb_eValueError, "currently only 'cuda:managed' is supported as a device.");
+  }
+
+  return XND_CUDA_MANAGED;
+}
+
+/* Initialize a RubyXND object. */
+static VALUE
+RubyXND_initialize(VALUE self, VALUE type, VALUE data, VALUE device)
+{
+  VALUE mblock;
+  XndObject *xnd_p;
+  uint32_t flags = 0;
+
+  if (device != Qnil) {
+    flags = device_flags(device);
+    if (flags == UINT32_MAX) {
+      rb_raise(rb_eValueError, "device ID cannot be handled.");
+    }
+  }
+
+  mblock = mblock_from_typed_value(type, data, flags);
+    
+  GET_XND(self, xnd_p);
+  XND_from_mblock(xnd_p, mblock);
+
+#ifdef XND_DEBUG
+  assert(XND(xnd_p)->type);
+  assert(XND(xnd_p)->ptr);
+#endif
+
+  return self;
+}
+
+static size_t
+XND_get_size(VALUE xnd)
+{
+  size_t size;
+  int state;
+  VALUE rb_size;
+
+  rb_size = rb_protect(XND_size, xnd, &state);
+  size = state ? 0 : NUM2LL(rb_size);
+
+  return size;
+}
+
+/*************************** object properties ********************************/
+
+static VALUE
+XND_dtype(VALUE self)
+{
+  XndObject *self_p;
+  GET_XND(self, self_p);
+  const ndt_t *dtype = ndt_dtype(XND_TYPE(self_p));
+  
+  return rb_ndtypes_from_type(dtype);
+}
+
+/* Return the ndtypes object of this xnd object. */
+static VALUE
+XND_type(VALUE self)
+{
+  XndObject *xnd_p;
+
+  GET_XND(self, xnd_p);
+
+  return xnd_p->type;
+}
+
+#define BULK_CHUNK 256
+
+/* Convert the innermost dimension in chunks of BULK_CHUNK elements that are
+   appended to array with a single rb_ary_cat call. */
+#define BULK_EXPORT(type, conv)                                         \
+  do {                                                                  \
+    VALUE buf[BULK_CHUNK];                                              \
+    int64_t j, k;                                                       \
+                                                                        \
+    for (i = 0; i < n; i += k) {                                        \
+      k = n - i < BULK_CHUNK ? n - i : BULK_CHUNK;                      \
+      for (j = 0; j < k; j++) {                                         \
+        const char * const ptr =                                        \
+          x->ptr + (x->index + (i + j) * step) * itemsize;              \
+        const type v = *(const type *)ptr;                              \
+        buf[j] = conv;                                                  \
+      }                                                                 \
+      rb_ary_cat(array, buf, (long)k);                                  \
+    }                                                                   \
+  } while (0)
+
+/* Export a fixed dimension array of a primitive dtype without recursing
+   into _XND_value for every element. Honours maxshape like _XND_value.
+
+   @param x Fixed dimension view for which bulk_type_p() is true.
+ */
+static VALUE
+_XND_value_bulk(const xnd_t * const x, const int64_t maxshape)
+{
+  const ndt_t * const t = x->type;
+  const ndt_t * const u = t->FixedDim.type;
+  const int64_t shape = t->FixedDim.shape;
+  const int64_t step = t->Concrete.FixedDim.step;
+  const int64_t itemsize = u->datasize;
+  const int64_t m = shape > maxshape ? maxshape : shape;
+  const int ellipsis = m > 0 && m == maxshape;
+  const int64_t n = ellipsis ? m - 1 : m;
+  VALUE array;
+  int64_t i;
+
+  array = array_new(m);
+
+  if (u->tag == FixedDim) {
+    for (i = 0; i < n; i++) {
+      const xnd_t next = xnd_fixed_dim_next(x, i);
+      rb_ary_push(array, _XND_value_bulk(&next, maxshape));
+    }
+  }
+  else {
+    switch (u->tag) {
+    case Bool: BULK_EXPORT(bool, INT2BOOL(v)); break;
+    case Int8: BULK_EXPORT(int8_t, INT2NUM(v)); break;
+    case Int16: BULK_EXPORT(int16_t, INT2NUM(v)); break;
+    case Int32: BULK_EXPORT(int32_t, INT2NUM(v)); break;
+    case Int64: BULK_EXPORT(int64_t, LL2NUM(v)); break;
+    case Uint8: BULK_EXPORT(uint8_t, UINT2NUM(v)); break;
+    case Uint16: BULK_EXPORT(uint16_t, UINT2NUM(v)); break;
+    case Uint32: BULK_EXPORT(uint32_t, ULL2NUM(v)); break;
+    case Uint64: BULK_EXPORT(uint64_t, ULL2NUM(v)); break;
+    case Float32: BULK_EXPORT(float, DBL2NUM(v)); break;
+    case Float64: BULK_EXPORT(double, DBL2NUM(v)); break;
+    case Complex64: {
+      typedef struct { float real; float imag; } complex64_t;
+      BULK_EXPORT(complex64_t, rb_complex_new(DBL2NUM(v.real), DBL2NUM(v.imag)));
+      break;
+    }
+    case Complex128: {
+      typedef struct { double real; double imag; } complex128_t;
+      BULK_EXPORT(complex128_t, rb_complex_new(DBL2NUM(v.real), DBL2NUM(v.imag)));
+      break;
+    }
+    default:
+      rb_raise(rb_eRuntimeError, "unexpected dtype in bulk export.");
+    }
+  }
+
+  if (ellipsis) {
+    rb_ary_push(array, xnd_ellipsis());
+  }
+
+  return array;
+}
+
+#undef BULK_EXPORT
+
+static VALUE
+_XND_value(const xnd_t * const x, const int64_t maxshape)
+{
+  NDT_STATIC_CONTEXT(ctx);
+  const ndt_t * const t = x->type;
+
+#ifdef XND_DEBUG
+  assert(t);
+  assert(x);
+#endif
+
+  if (!ndt_is_concrete(t)) {
+    rb_raise(rb_eTypeError, "type must be concrete for returning value.");
+  }
+
+  /* bitmap access needs linear index. */
+  if (xnd_is_na(x)) {
+    return Qnil;
+  }
+
+  switch (t->tag) {
+  case FixedDim: {
+    VALUE array, v;
+    int64_t shape, i;
+
+    if (bulk_type_p(t)) {
+      return _XND_value_bulk(x, maxshape);
+    }
+
+    shape = t->FixedDim.shape;
+    if (shape > maxshape) {
+      shape = maxshape;
+    }
+
+    array = array_new(shape);
+
+    for (i = 0; i < shape; i++) {
+      if (i == maxshape-1) {
+        rb_ary_store(array, i, xnd_ellipsis());
+        break;
+      }
+
+      const xnd_t next = xnd_fixed_dim_next(x, i);
+      v = _XND_value(&next, maxshape);
+      rb_ary_store(array, i, v);
+    }
+
+    return array;
+  }
+
+  case VarDim: {
+    VALUE array, v;
+    int64_t start, step, shape;
+    int64_t i;
+
+    shape = ndt_var_indices(&start, &step, t, x->index, &ctx);
+    if (shape < 0) {
+      seterr(&ctx);
+      raise_error();
+    }
+    if (shape > maxshape) {
+      shape = maxshape;
+    }
+
+    array = array_new(shape);
+
+    for (i = 0; i < shape; i++) {
+      if (i == maxshape-1) {
+        rb_ary_store(array, i, xnd_ellipsis());
+        break;
+      }
+
+      xnd_t next = xnd_var_dim_next(x, start, step, i);
+      v = _XND_value(&next, maxshape);
+      rb_ary_store(array, i, v);
+    }
+
+    return array;
+  }
+
+  case VarDimElem: {
+    int64_t start, step, shape;
+
+    shape = ndt_var_indices(&start, &step, t, x->index, &ctx);
+    if (shape < 0) {
+      seterr(&ctx);
+      raise_error();      
+    }
+
+    const int64_t i = adjust_index(t->VarDimElem.index, shape, &ctx);
+    if (i < 0) {
+      seterr(&ctx);
+      raise_error();      
+    }
+
+    const xnd_t next = xnd_var_dim_next(x, start, step, i);
+    return _XND_value(&next, maxshape);
+  }
+    
+  case Tuple: {
+    VALUE tuple, v;
+    int64_t shape, i;
+
+    shape = t->Tuple.shape;
+    if (shape > maxshape) {
+      shape = maxshape;
+    }
+
+    tuple = array_new(shape);
+
+    for (i = 0; i < shape; i++) {
+      if (i == maxshape) {
+        rb_ary_store(tuple, i, xnd_ellipsis());
+        break;
+      }
+
+      const xnd_t next = xnd_tuple_next(x, i, &ctx);
+      if (next.ptr == NULL) {
+        seterr(&ctx);
+        raise_error();
+      }
+
+      v = _XND_value(&next, maxshape);
+      rb_ary_store(tuple, i, v);
+    }
+
+    return tuple;
+  }
+    
+  case Record: {
+    VALUE hash, v;
+    int64_t shape, i;
+
+    shape = t->Record.shape;
+    if (shape > maxshape) {
+      shape = maxshape;
+    }
+
+    hash = rb_hash_new();
+
+    for (i = 0; i < shape; ++i) {
+      if (i == maxshape - 1) {
+        rb_hash_aset(hash, xnd_ellipsis(), xnd_ellipsis());
+        break;
+      }
+
+      xnd_t next = xnd_record_next(x, i, &ctx);
+      if (next.ptr == NULL) {
+        seterr(&ctx);
+        raise_error();
+      }
+
+      v = _XND_value(&next, maxshape);
+      rb_hash_aset(hash, rb_str_new2(t->Record.names[i]), v);
+    }
+
+    return hash;
+  }
+
+  case Union: {
+    VALUE array, tag, v;
+
+    array = rb_ary_new2(2);
+    const uint8_t i = XND_UNION_TAG(x->ptr);
+    tag = rb_str_new2(t->Union.tags[i]);
+
+    rb_ary_store(array, 0, tag);
+
+    const xnd_t next = xnd_union_next(x, &ctx);
+    if (next.ptr == NULL) {
+      seterr(&ctx);
+      raise_error();
+    }
+    v = _XND_value(&next, maxshape);
+
+    rb_ary_store(array, 1, v);
+
+    return array;
+  }
+
+  case Ref: {
+    xnd_t next = xnd_ref_next(x, &ctx);
+    if (next.ptr == NULL) {
+      seterr(&ctx);
+      raise_error();
+    }
+
+    return _XND_value(&next, maxshape);
+  }
+
+  case Constr: {
+    xnd_t next = xnd_constr_next(x, &ctx);
+    if (next.ptr == NULL) {
+      seterr(&ctx);
+      raise_error();
+    }
+
+    return _XND_value(&next, maxshape);
+  }
+
+  case Nominal: {
+    xnd_t next = xnd_nominal_next(x, &ctx);
+    if (next.ptr == NULL) {
+      seterr(&ctx);
+      raise_error();      
+    }
+
+    if (t->Nominal.meth->repr != NULL) {
+      return t->Nominal.meth->repr(&next, &ctx);
+    }
+
+    return _XND_value(&next, maxshape);
+  }
+
+  case Bool: {
+    bool temp;
+    UNPACK_SINGLE(temp, x->ptr, bool, t->flags);
+    return INT2BOOL(temp);
+  }
+
+  case Int8: {
+    int8_t temp;
+    UNPACK_SINGLE(temp, x->ptr, int8_t, t->flags);
+    return INT2NUM(temp);
+  }
+
+  case Int16: {
+    int16_t temp;
+    UNPACK_SINGLE(temp, x->ptr, int16_t, t->flags);
+    return INT2NUM(temp);
+  }
+    
+  case Int32: {
+    int32_t temp;
+    UNPACK_SINGLE(temp, x->ptr, int32_t, t->flags);
+    return INT2NUM(temp);
+  }
+    
+  case Int64: {
+    int64_t temp;
+    UNPACK_SINGLE(temp, x->ptr, int64_t, t->flags);
+    return LL2NUM(temp);
+  }
+
+  case Uint8: {
+    uint8_t temp;
+    UNPACK_SINGLE(temp, x->ptr, uint8_t, t->flags);
+    return UINT2NUM(temp);
+  }
+
+  case Uint16: {
+    uint16_t temp;
+    UNPACK_SINGLE(temp, x->ptr, uint16_t, t->flags);
+    return UINT2NUM(temp);
+  }
+
+  case Uint32: {
+    uint32_t temp;
+    UNPACK_SINGLE(temp, x->ptr, uint32_t, t->flags);
+    return ULL2NUM(temp);
+  }
+
+  case Uint64: {
+    uint64_t temp;
+    UNPACK_SINGLE(temp, x->ptr, uint64_t, t->flags);
+    return ULL2NUM(temp);
+  }
+
+  case BFloat16: {
+    rb_raise(rb_eNotImpError, "bfloat16 is not implemented.");
+  }
+
+  case Float16: {
+    rb_raise(rb_eNotImpError, "float16 is not implemented.");
+  }
+
+  case Float32: {
+    float temp = 0.0;
+
+    rb_xnd_unpack_float32(&temp, (unsigned char*)x->ptr, le(t->flags));
+    return DBL2NUM(temp);
+  }
+
+  case Float64: {
+    double temp = 0.0;
+    
+    rb_xnd_unpack_float64(&temp, (unsigned char*)x->ptr, le(t->flags));
+    return DBL2NUM(temp);
+  }
+
+  case BComplex32: {
+    rb_raise(rb_eNotImpError, "bcomplex32 not implemented.");    
+  }
+
+  case Complex32: {
+    rb_raise(rb_eNotImpError, "complex32 not implemented.");
+  }
+
+  case Complex64: {
+    float real = 0.0, imag = 0.0;
+
+    rb_xnd_unpack_float32(&real, (unsigned char*)x->ptr, le(t->flags));
+    rb_xnd_unpack_float32(&imag, (unsigned char*)x->ptr+4, le(t->flags));
+
+    return rb_complex_new(DBL2NUM(real), DBL2NUM(imag));
+  }
+
+  case Complex128: {
+    double real = 0.0, imag = 0.0;
+
+    rb_xnd_unpack_float64(&real, (unsigned char*)x->ptr, le(t->flags));
+    rb_xnd_unpack_float64(&imag, (unsigned char*)x->ptr+8, le(t->flags));
+
+    return rb_complex_new(DBL2NUM(real), DBL2NUM(imag));
+  }
+
+  case FixedString: {
+    int64_t codepoints = t->FixedString.size;
+    
+    switch (t->FixedString.encoding) {
+    case Ascii: {
+      codepoints = u8_skip_trailing_zero((uint8_t *)x->ptr, codepoints);
+      return rb_usascii_str_new(x->ptr, codepoints);
+    }
+      
+    case Utf8: {
+      codepoints = u8_skip_trailing_zero((uint8_t *)x->ptr, codepoints);
+      return rb_utf8_str_new(x->ptr, codepoints);
+    }
+
+    case Utf16: {
+      rb_encoding *utf16 = rb_enc_find("UTF-16");      
+      codepoints = u16_skip_trailing_zero((uint16_t *)x->ptr, codepoints);
+
+      return rb_enc_str_new(x->ptr, codepoints*2, utf16);
+    }
+
+    case Utf32: {
+      rb_encoding *utf32 = rb_enc_find("UTF-32");
+      codepoints = u32_skip_trailing_zero((uint32_t *)x->ptr, codepoints);
+      
+      return rb_enc_str_new(x->ptr, codepoints*4, utf32);
+    }
+
+    case Ucs2: {
+      rb_raise(rb_eNotImpError, "UCS2 encoding not implemented.");
+    }
+
+    default: {
+      rb_raise(rb_eRuntimeError, "invalid string encoding.");
+    } 
+    }
+  }
+
+  case FixedBytes: {
+    return bytes_from_string_and_size(x->ptr, t->FixedBytes.size);
+  }
+
+  case String: {
+    const char *s = XND_STRING_DATA(x->ptr);
+    size_t size = strlen(s);
+
+    return rb_utf8_str_new(s, size);
+  }
+
+  case Bytes: {
+    char *s = (char *)XND_BYTES_DATA(x->ptr);
+    size_t size = s ? XND_BYTES_SIZE(x->ptr) : 0;
+
+    return bytes_from_string_and_size(s, size);
+  }
+
+  case Array: {
+    VALUE lst, v;
+    int64_t shape;
+
+    shape = XND_ARRAY_SHAPE(x->ptr);
+    if (shape > maxshape) {
+      shape = maxshape;
+    }
+
+    lst = rb_ary_new2(shape);
+
+    for (int i = 0; i < shape; ++i) {
+      if (i == maxshape-1) {
+        rb_ary_store(lst, i, xnd_ellipsis());
+        break;
+      }
+
+      const xnd_t next = xnd_array_next(x, i);
+      v = _XND_value(&next, maxshape);
+      if (v == NULL) {
+        return NULL;
+      }
+      rb_ary_stor(lst, i, v);
+    }
+
+    return lst;
+  }
+
+  case Categorical: {
+    int64_t k;
+
+    UNPACK_SINGLE(k, x->ptr, int64_t, t->flags);
+
+    switch(t->Categorical.types[k].tag) {
+    case ValBool: {
+      bool temp = t->Categorical.types[k].ValBool;
+      return INT2BOOL(temp);
+    }
+
+    case ValInt64: {
+      int64_t temp = t->Categorical.types[k].ValInt64;
+      return LL2NUM(temp);
+    }
+
+    case ValFloat64: {
+      double temp = t->Categorical.types[k].ValFloat64;
+      return DBL2NUM(temp);
+    }
+
+    case ValString: {
+      const char *temp = t->Categorical.types[k].ValString;
+      return rb_str_new2(temp);
+    }
+
+    case ValNA: {
+      return Qnil;
+    }
+
+    default: {
+      rb_raise(rb_eRuntimeError, "unexpected category tag.");
+    }
+    }
+  }
+
+  case Char: {
+    rb_raise(rb_eNotImpError, "char semantics need to be defined.");
+  }
+
+  case Module: {
+    rb_raise(rb_eNotImpError, "'Module' type not implemented yet.");
+  }
+
+    /* NOT REACHED: intercepted by ndt_is_abstract(). */
+  case AnyKind: case SymbolicDim: case EllipsisDim: case Typevar:
+  case ScalarKind: case SignedKind: case UnsignedKind: case FloatKind:
+  case ComplexKind: case FixedStringKind: case FixedBytesKind:
+  case Function:
+    rb_raise(rb_eArgError, "unexpected abstract type.");
+  }
+
+  rb_raise(rb_eRuntimeError, "invalid type tag %d.", t->tag);
+}
+
+/* Return the value of this xnd object. Aliased to to_a. */
+static VALUE
+XND_value(VALUE self)
+{
+  XndObject *xnd_p;
+
+  GET_XND(self, xnd_p);
+
+  return _XND_value(XND(xnd_p), INT64_MAX);
+}
+
+/*************************** slicing functions ********************************/
+
+#define KEY_INDEX 1
+#define KEY_FIELD 2
+#define KEY_SLICE 4
+#define KEY_ERROR 128
+
+/* 
+   @param src_p Pointer to the source XND object from which view is being created.
+   @param x Metadata for creating the view.
+ */
+static VALUE
+RubyXND_view_move_type(XndObject *src_p, xnd_t *x)
+{
+  XndObject *view_p;
+  VALUE type, view;
+
+  type = rb_ndtypes_from_type(x->type);
+  ndt_decref(x->type);
+  
+  view = XndObject_alloc(cXND);
+  GET_XND(view, view_p);
+
+  view_p->mblock = src_p->mblock;
+  view_p->type = type;
+  view_p->xnd = *x;
+
+  return view;
+}
+
+/* Convert a single Ruby object index into a form that XND can understand. 
+   
+   @param *key
+   @param obj
+   @param size Size of object. 1 for all scalars and the actual size otherwise.
+*/
+static uint8_t
+convert_single(xnd_index_t *key, VALUE obj, size_t size)
+{
+  if (RB_TYPE_P(obj, T_FIXNUM)) {
+    int64_t i = NUM2LL(obj);
+
+    key->tag = Index;
+    key->Index = i;
+
+    return KEY_INDEX;
+  }
+  else if (RB_TYPE_P(obj, T_STRING)) {
+    const char *s = StringValuePtr(obj);
+
+    key->tag = FieldName;
+    key->FieldName = s;
+
+    return KEY_FIELD;
+  }
+  else if (CLASS_OF(obj) == rb_cRange) {
+    if (size == 0) {
+      rb_raise(rb_eIndexError, "Cannot use Range on this type.");
+    };
+    
+    long long begin, end, step;
+
+    rb_range_unpack(obj, &begin, &end, &step, size);
+    key->tag = Slice;
+    key->Slice.start = begin;
+    key->Slice.stop = end;
+    key->Slice.step = step;
+
+    return KEY_SLICE;
+  }
+  else if (CLASS_OF(obj) == rb_cArithSeq) {
+    if (size == 0) {
+      rb_raise(rb_eIndexError, "Cannot use a stepped Range on this type.");
+    }
+
+    long long begin, end, step;
+
+    rb_arith_seq_unpack(obj, &begin, &end, &step, size);
+    key->tag = Slice;
+    key->Slice.start = begin;
+    key->Slice.stop = end;
+    key->Slice.step = step;
+
+    return KEY_SLICE;
+  }
+  // case of INF (infinite range syntax sugar)
+  else if (RB_TYPE_P(obj, T_FLOAT)) {
+    double value = RFLOAT_VALUE(obj);
+
+    if (isinf(value)) {
+      key->tag = Slice;
+      key->Slice.start = 0;
+      key->Slice.stop = INT64_MAX;
+      key->Slice.step = 1;
+
+      return KEY_SLICE;
+    }
+    else {
+      rb_raise(rb_eArgError, "wrong object specified in index.");
+    }
+  }
+  else {
+    rb_raise(rb_eArgError, "wrong object specified in index.");
+  }
+}
+
+static uint8_t
+convert_key(xnd_index_t *indices, int *len, int argc, VALUE *argv, size_t size)
+{
+  uint8_t flags = 0;
+  VALUE x;
+
+  if (argc > 1) {
     if (argc > NDT_MAX_DIM) {
       rb_raise(rb_eArgError, "too many indices %d.", argc);
     }
 
-    for (unsigned int i = 0; i < argc; i++) {
-      x = argv[i];
-      flags |= convert_single(indices+i, x, size);
-      if (flags & KEY_ERROR) {
-        return KEY_ERROR;
+    for (unsigned int i = 0; i < argc; i++) {
+      x = argv[i];
+      flags |= convert_single(indices+i, x, size);
+      if (flags & KEY_ERROR) {
+        return KEY_ERROR;
+      }
+    }
+
+    *len = argc;
+    return flags;
+  }
+  else if (argc == 1 && RB_TYPE_P(argv[0], T_ARRAY)) { // args as an array
+    *len = RARRAY_LEN(argv[0]);
+
+    for (int i = 0; i < *len; i++) {
+      VALUE args[1] = { INT2NUM(i) };
+      flags |= convert_single(indices+i, rb_ary_aref(1, args, argv[0]), size);
+      if (flags & KEY_ERROR) {
+        return KEY_ERROR;
+      }
+    }
+    return flags;
+  }
+
+  *len = 1;
+  return convert_single(indices, argv[0], size);
+}
+
+/****************************************************************************/
+/*                               XND::Index                                 */
+/****************************************************************************/
+
+/* A key for #[] and #[]= that is converted once and applied to any number
+   of arrays. Keys whose conversion depends on the size of the indexed array
+   (Ranges with negative bounds) are marked in resolve and converted again
+   against that size on every use; all other keys are used as compiled. */
+typedef struct IndexObject {
+  xnd_index_t indices[NDT_MAX_DIM];
+  int len;
+  uint32_t resolve;             /* bit i set: key i depends on the size. */
+  VALUE key;                    /* source keys; owns FieldName strings, which
+                                   dmark pins. */
+} IndexObject;
+
+#define GET_INDEX(obj, index_p) do {                            \
+    TypedData_Get_Struct((obj), IndexObject,                    \
+                         &IndexObject_type, (index_p));         \
+  } while (0)
+#define MAKE_INDEX(klass, index_p) TypedData_Make_Struct(klass, IndexObject, \
+                                                         &IndexObject_type, index_p)
+#define INDEX_CHECK_TYPE(obj) (rb_typeddata_is_kind_of(obj, &IndexObject_type))
+
+static void
+IndexObject_dmark(void *self)
+{
+  IndexObject *index = (IndexObject *)self;
+
+  rb_gc_mark(index->key);
+  /* An Array marks its elements as movable. Pin them, since compiled
+     FieldName keys point into the strings. */
+  if (RB_TYPE_P(index->key, T_ARRAY)) {
+    for (long i = 0; i < RARRAY_LEN(index->key); i++) {
+      rb_gc_mark(RARRAY_AREF(index->key, i));
+    }
+  }
+}
+
+static void
+IndexObject_dfree(void *self)
+{
+  xfree(self);
+}
+
+static size_t
+IndexObject_dsize(const void *self)
+{
+  return sizeof(IndexObject);
+}
+
+static const rb_data_type_t IndexObject_type = {
+  .wrap_struct_name = "IndexObject",
+  .function = {
+    .dmark = IndexObject_dmark,
+    .dfree = IndexObject_dfree,
+    .dsize = IndexObject_dsize,
+    .reserved = {0,0},
+  },
+  .parent = 0,
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE
+IndexObject_alloc(VALUE klass)
+{
+  IndexObject *index_p;
+  VALUE obj;
+
+  obj = MAKE_INDEX(klass, index_p);
+  index_p->len = 0;
+  index_p->resolve = 0;
+  index_p->key = Qnil;
+
+  return obj;
+}
+
+/* Return true if converting obj needs the size of the indexed array. */
+static int
+index_key_sized_p(VALUE obj)
+{
+  VALUE begin, end;
+
+  if (CLASS_OF(obj) != rb_cRange && CLASS_OF(obj) != rb_cArithSeq) {
+    return 0;
+  }
+
+  begin = rb_funcall(obj, rb_intern("begin"), 0, NULL);
+  end = rb_funcall(obj, rb_intern("end"), 0, NULL);
+
+  return (RB_INTEGER_TYPE_P(begin) && RTEST(rb_funcall(begin, rb_intern("negative?"), 0, NULL))) ||
+         (RB_INTEGER_TYPE_P(end) && RTEST(rb_funcall(end, rb_intern("negative?"), 0, NULL)));
+}
+
+/* XND::Index.new(*key). Accepts the same keys as XND#[]. */
+static VALUE
+IndexObject_initialize(int argc, VALUE *argv, VALUE self)
+{
+  IndexObject *index_p;
+  VALUE key, obj;
+  int i;
+
+  if (argc == 0) {
+    rb_raise(rb_eArgError, "expected atleast one key for XND::Index.");
+  }
+  if (argc == 1 && RB_TYPE_P(argv[0], T_ARRAY)) {
+    argc = (int)RARRAY_LEN(argv[0]);
+    argv = (VALUE *)RARRAY_CONST_PTR(argv[0]);
+  }
+  if (argc > NDT_MAX_DIM) {
+    rb_raise(rb_eArgError, "too many indices %d.", argc);
+  }
+
+  GET_INDEX(self, index_p);
+  key = rb_ary_new_capa(argc);
+  index_p->key = key;
+  index_p->len = 0;
+  index_p->resolve = 0;
+
+  for (i = 0; i < argc; i++) {
+    obj = argv[i];
+    if (RB_TYPE_P(obj, T_STRING)) {
+      /* the compiled FieldName points into this string. */
+      obj = rb_str_new_frozen(obj);
+    }
+    rb_ary_push(key, obj);
+
+    if (index_key_sized_p(obj)) {
+      index_p->resolve |= (uint32_t)1 << i;
+      continue;
+    }
+    convert_single(index_p->indices+i, obj, 1);
+  }
+  index_p->len = argc;
+
+  return self;
+}
+
+/* Replace the leading integer key with i and return self. The remaining
+   keys are not converted again, so an outer loop variable can be applied
+   to the same compiled key:
+
+     idx = XND::Index.new(0, 1..-1, "price")
+     n.times { |i| total += x[idx.rebase(i)].value }
+*/
+static VALUE
+IndexObject_rebase(VALUE self, VALUE i)
+{
+  IndexObject *index_p;
+
+  GET_INDEX(self, index_p);
+
+  if (index_p->len == 0 || (index_p->resolve & 1) ||
+      index_p->indices[0].tag != Index) {
+    rb_raise(rb_eArgError, "rebase needs an index with a leading Integer key.");
+  }
+
+  index_p->indices[0].Index = NUM2LL(i);
+  rb_ary_store(index_p->key, 0, i);
+
+  return self;
+}
+
+/* Return the source keys of this index. */
+static VALUE
+IndexObject_to_a(VALUE self)
+{
+  IndexObject *index_p;
+
+  GET_INDEX(self, index_p);
+
+  return rb_ary_dup(index_p->key);
+}
+
+/* Return the indices of a compiled key for subscripting self. Only keys
+   marked in resolve are converted, into the storage at buf. */
+static const xnd_index_t *
+index_indices(VALUE index, VALUE self, xnd_index_t *buf, int *len)
+{
+  IndexObject *index_p;
+  size_t size;
+  int i;
+
+  GET_INDEX(index, index_p);
+  *len = index_p->len;
+
+  if (index_p->resolve == 0) {
+    return index_p->indices;
+  }
+
+  size = XND_get_size(self);
+  memcpy(buf, index_p->indices, index_p->len * sizeof *buf);
+  for (i = 0; i < index_p->len; i++) {
+    if (index_p->resolve & ((uint32_t)1 << i)) {
+      convert_single(buf+i, rb_ary_entry(index_p->key, i), size);
+    }
+  }
+
+  return buf;
+}
+
+/* Implement the #[] Ruby method. */
+static VALUE
+XND_array_aref(int argc, VALUE *argv, VALUE self)
+{
+  NDT_STATIC_CONTEXT(ctx);
+  xnd_index_t indices[NDT_MAX_DIM];
+  const xnd_index_t *key = indices;
+  xnd_t x;
+  int len;
+  uint8_t flags;
+  XndObject *xnd_p;
+  size_t size;
+
+  if (argc == 0) {
+    rb_raise(rb_eArgError, "expected atleast one argument for #[].");
+  }
+
+  GET_XND(self, xnd_p);
+
+  if (argc == 1 && INDEX_CHECK_TYPE(argv[0])) {
+    key = index_indices(argv[0], self, indices, &len);
+  }
+  else {
+    size = XND_get_size(self);
+
+    flags = convert_key(indices, &len, argc, argv, size);
+    if (flags & KEY_ERROR) {
+      rb_raise(rb_eArgError, "something is wrong with the array key.");
+    }
+  }
+
+  x = xnd_subscript(&xnd_p->xnd, key, len, &ctx);
+  if (x.ptr == NULL) {
+    seterr(&ctx);
+    raise_error();
+  }
+
+  return RubyXND_view_move_type(xnd_p, &x);
+}
+
+/* Implement XND#at. Return the value at the integer indices in argv
+   without allocating an intermediate view.
+
+   Leading fixed dimensions are resolved by stepping the index directly,
+   so indexing an integer or float element down to a scalar allocates no
+   Ruby objects besides the result. Any remaining indices (var dimensions,
+   tuples, ...) take the general xnd_subscript path.
+*/
+static VALUE
+XND_at(int argc, VALUE *argv, VALUE self)
+{
+  NDT_STATIC_CONTEXT(ctx);
+  xnd_index_t indices[NDT_MAX_DIM];
+  XndObject *xnd_p;
+  xnd_t x, y;
+  VALUE type, value;
+  int i, k;
+
+  if (argc > NDT_MAX_DIM) {
+    rb_raise(rb_eArgError, "too many indices %d.", argc);
+  }
+
+  GET_XND(self, xnd_p);
+  x = xnd_p->xnd;
+
+  for (i = 0; i < argc; i++) {
+    const ndt_t * const t = x.type;
+    int64_t shape, index;
+
+    if (!RB_INTEGER_TYPE_P(argv[i])) {
+      rb_raise(rb_eTypeError, "XND#at expects Integer indices.");
+    }
+    if (t->tag != FixedDim) {
+      break;
+    }
+
+    shape = t->FixedDim.shape;
+    index = NUM2LL(argv[i]);
+    if (index < 0) {
+      index += shape;
+    }
+    if (index < 0 || index >= shape) {
+      rb_raise(rb_eIndexError, "index out of bounds.");
+    }
+
+    x = xnd_fixed_dim_next(&x, index);
+  }
+
+  if (i == argc) {
+    return _XND_value(&x, INT64_MAX);
+  }
+
+  for (k = 0; i + k < argc; k++) {
+    if (!RB_INTEGER_TYPE_P(argv[i+k])) {
+      rb_raise(rb_eTypeError, "XND#at expects Integer indices.");
+    }
+    indices[k].tag = Index;
+    indices[k].Index = NUM2LL(argv[i+k]);
+  }
+
+  y = xnd_subscript(&x, indices, k, &ctx);
+  if (y.ptr == NULL) {
+    seterr(&ctx);
+    raise_error();
+  }
+
+  /* hold the new type reference in an object so that it is released if
+     _XND_value raises. */
+  type = rb_ndtypes_from_type(y.type);
+  ndt_decref(y.type);
+
+  value = _XND_value(&y, INT64_MAX);
+  RB_GC_GUARD(type);
+
+  return value;
+}
+
+/* Compare between data of an XND object and Ruby object. */
+static VALUE
+convert_compare(VALUE self, VALUE other)
+{
+  VALUE vcmp = XND_value(self);
+
+  return rb_funcall(vcmp, rb_intern("=="), 1, other);
+}
+
+/* Implementation for #== method. 
+
+   @param other Other Ruby object to compare with.
+   @return VALUE [TrueClass|FalseClass]
+*/
+static VALUE
+XND_eqeq(VALUE self, VALUE other)
+{
+  NDT_STATIC_CONTEXT(ctx);
+  XndObject *left_p, *right_p;
+  int r;
+
+  if (!XND_CHECK_TYPE(other)) {
+    return convert_compare(self, other);
+  }
+
+  GET_XND(self, left_p);
+  GET_XND(other, right_p);
+
+  r = xnd_equal(XND(left_p), XND(right_p), &ctx);
+
+  if (r == 1) {
+    return Qtrue;
+  }
+  else {
+    return Qfalse;
+  }
+}
+
+/* Implement Ruby spaceship operator. */
+static VALUE
+XND_spaceship(VALUE self, VALUE other)
+{
+  rb_raise(rb_eNotImpError, "spaceship not implemented yet.");
+
+  return Qnil;
+}
+
+static VALUE
+XND_lt(VALUE self, VALUE other)
+{
+  rb_raise(rb_eNotImpError, "< not implemented yet.");
+  return Qnil;
+}
+
+static VALUE
+XND_lteq(VALUE self, VALUE other)
+{
+  rb_raise(rb_eNotImpError, "<= not implemented yet.");
+  return Qnil;
+}
+
+static VALUE
+XND_gt(VALUE self, VALUE other)
+{
+  rb_raise(rb_eNotImpError, "> not implemented yet.");
+  return Qnil;
+}
+
+static VALUE
+XND_gteq(VALUE self, VALUE other)
+{
+  rb_raise(rb_eNotImpError, ">= not implemented yet.");
+  return Qnil;
+}
+
+/* XND#strict_equal */
+static VALUE
+XND_strict_equal(VALUE self, VALUE other)
+{
+  NDT_STATIC_CONTEXT(ctx);
+  XndObject *left_p, *right_p;
+  int r;
+
+  if (!XND_CHECK_TYPE(other)) {
+    rb_raise(rb_eArgError, "argument type has to be XND.");
+  }
+  
+  GET_XND(self, left_p);
+  GET_XND(other, right_p);
+
+  r = xnd_strict_equal(XND(left_p), XND(right_p), &ctx);
+  if (r < 0) {
+    seterr(&ctx);
+    raise_error();
+  }
+
+  if (r) {
+    return Qtrue;
+  }
+  else {
+    return Qfalse;
+  }
+}
+
+static size_t
+_XND_size(const xnd_t *x)
+{
+  NDT_STATIC_CONTEXT(ctx);
+  const ndt_t *t = x->type;
+
+  if (!ndt_is_concrete(t)) {
+    rb_raise(rb_eTypeError, "NDT must be concrete to get size.");
+  }
+
+  if (t->ndim > 0 && ndt_is_optional(t)) {
+    rb_raise(rb_eNotImpError, "optional dimensions are not supported.");
+  }
+
+  if (xnd_is_na(x)) {
+    return 0;
+  }
+
+  switch (t->tag) {
+  case FixedDim: {
+    return safe_downcast(t->FixedDim.shape);
+  }
+
+  case VarDim: {
+    int64_t start, step, shape;
+
+    shape = ndt_var_indices(&start, &step, t, x->index, &ctx);
+    if (shape < 0) {
+      seterr(&ctx);
+      raise_error();
+    }
+
+    return safe_downcast(shape);
+  }
+
+  case VarDimElem: {
+    NDT_STATIC_CONTEXT(ctx);
+    int64_t start, step, shape;
+
+    shape = ndt_var_indices(&start, &step, t, x->index, &ctx);
+    if (shape < 0) {
+      seterr(&ctx);
+      raise_error();
+    }
+
+    const int64_t i = adjust_index(t->VarDimElem.index, shape, &ctx);
+    if (i < 0) {
+      seterr(&ctx);
+      raise_error();
+    }
+
+    const xnd_t next = xnd_var_dim_next(x, start, step, i);
+    return _XND_size(&next);
+  }
+
+  case Tuple: {
+    return safe_downcast(t->Tuple.shape);
+  }
+
+  case Record: {
+    return safe_downcast(t->Record.shape);
+  }
+
+  case Union: {
+    const xnd_t next = xnd_union_next(x, &ctx);
+    if (next.ptr == NULL) {
+      seterr(&ctx);
+      raise_error();
+    }
+
+    return _XND_size(&next);
+  }
+
+  case Ref: {
+    const xnd_t next = xnd_ref_next(x, &ctx);
+    if (next.ptr == NULL) {
+      seterr(&ctx);
+      raise_error();
+    }
+
+    return _XND_size(&next);
+  }
+
+  case Constr: {
+    const xnd_t next = xnd_constr_next(x, &ctx);
+    if (next.ptr == NULL) {
+      seterr(&ctx);
+      raise_error();
+    }
+
+    return _XND_size(&next);
+  }
+
+  case Nominal: {
+    const xnd_t next = xnd_nominal_next(x, &ctx);
+    if (next.ptr == NULL) {
+      seterr(&ctx);
+      raise_error();
+    }
+
+    return _XND_size(&next); 
+  }
+
+  default: {
+    rb_raise(rb_eNoMethodError, "This type has no size method.");
+  }
+  }  
+}
+
+/* Implement XND#size. */
+static VALUE
+XND_size(VALUE self)
+{
+  XndObject *self_p;
+    
+  GET_XND(self, self_p);
+  return ULL2NUM(_XND_size(XND(self_p)));
+}
+
+/* Implement #[]= */
+static VALUE
+XND_array_store(int argc, VALUE *argv, VALUE self)
+{
+  NDT_STATIC_CONTEXT(ctx);
+  xnd_index_t indices[NDT_MAX_DIM];
+  const xnd_index_t *key = indices;
+  xnd_t x;
+  int free_type = 0, ret, len;
+  uint8_t flags;
+  XndObject *self_p, *value_p;
+  MemoryBlockObject *self_mblock_p;
+  size_t size;
+  VALUE value;
+
+  if (argc < 2) {
+    rb_raise(rb_eArgError, "wrong number of arguments (given %d expected atleast 2)."
+             , argc);
+  }
+
+  GET_XND(self, self_p);
+
+  if (argc == 2 && INDEX_CHECK_TYPE(argv[0])) {
+    key = index_indices(argv[0], self, indices, &len);
+  }
+  else {
+    size = XND_get_size(self);
+    flags = convert_key(indices, &len, argc-1, argv, size);
+    if (flags & KEY_ERROR) {
+      rb_raise(rb_eIndexError, "wrong kind of key in []=");
+    }
+  }
+
+  x = xnd_subscript(&self_p->xnd, key, len, &ctx);
+  if (x.ptr == NULL) {
+    seterr(&ctx);
+    raise_error();
+  }
+  value = argv[argc-1];
+  GET_MBLOCK(self_p->mblock, self_mblock_p);
+
+  if (self_mblock_p->readonly) {
+    ndt_decref(x.type);
+    rb_raise(rb_eFrozenError, "cannot modify a read-only XND buffer.");
+  }
+
+  if (XND_CHECK_TYPE(value)) {
+    GET_XND(value, value_p);
+    
+    ret = xnd_copy(&x, XND(value_p), self_mblock_p->xnd->flags, &ctx);
+    if (ret < 0) {
+      seterr(&ctx);
+      raise_error();
+    }
+  }
+  else {
+    ret = mblock_init(&x, value);
+  }
+  ndt_decref(x.type);
+
+  return value;
+}
+
+/* Size of the Enumerator returned by XND#each without a block. */
+static VALUE
+XND_each_size(VALUE self, VALUE args, VALUE eobj)
+{
+  return XND_size(self);
+}
+
+/* Implement XND#each. Walk the outermost fixed or var dimension. Elements
+   of a scalar type are yielded as Ruby values, everything else as a view.
+   All views share the memory block and a single NDT for the element type. */
+static VALUE
+XND_each(VALUE self)
+{
+  NDT_STATIC_CONTEXT(ctx);
+  XndObject *self_p, *view_p;
+  const xnd_t *x;
+  const ndt_t *t, *u;
+  int64_t shape, start = 0, step = 0, i;
+  VALUE type, view;
+
+  RETURN_SIZED_ENUMERATOR(self, 0, 0, XND_each_size);
+
+  GET_XND(self, self_p);
+  x = XND(self_p);
+  t = x->type;
+
+  switch (t->tag) {
+  case FixedDim:
+    shape = t->FixedDim.shape;
+    u = t->FixedDim.type;
+    break;
+  case VarDim:
+    shape = ndt_var_indices(&start, &step, t, x->index, &ctx);
+    if (shape < 0) {
+      seterr(&ctx);
+      raise_error();
+    }
+    u = t->VarDim.type;
+    break;
+  default:
+    rb_raise(rb_eTypeError, "XND#each needs a fixed or var outer dimension.");
+  }
+
+  if (u->ndim == 0 && ndt_is_scalar(u)) {
+    for (i = 0; i < shape; i++) {
+      const xnd_t next = t->tag == FixedDim ? xnd_fixed_dim_next(x, i) :
+                         xnd_var_dim_next(x, start, step, i);
+      rb_yield(_XND_value(&next, INT64_MAX));
+    }
+
+    return self;
+  }
+
+  type = rb_ndtypes_from_type(u);
+  for (i = 0; i < shape; i++) {
+    view = XndObject_alloc(cXND);
+    GET_XND(view, view_p);
+
+    view_p->mblock = self_p->mblock;
+    view_p->type = type;
+    view_p->xnd = t->tag == FixedDim ? xnd_fixed_dim_next(x, i) :
+                  xnd_var_dim_next(x, start, step, i);
+
+    rb_yield(view);
+  }
+  RB_GC_GUARD(type);
+
+  return self;
+}
+
+/* Implement XND#_each_chunk. Yield views of rows consecutive elements of
+   the outermost dimension; the last view may be shorter. With reuse set,
+   the view object is updated in place while the sliced type stays equal,
+   so a block must not keep it beyond the iteration. */
+static VALUE
+XND_each_chunk(VALUE self, VALUE rb_rows, VALUE reuse)
+{
+  NDT_STATIC_CONTEXT(ctx);
+  XndObject *self_p, *view_p;
+  xnd_index_t key;
+  xnd_t next;
+  int64_t rows, shape, i;
+  VALUE view = Qnil;
+
+  GET_XND(self, self_p);
+
+  rows = NUM2LL(rb_rows);
+  if (rows <= 0) {
+    rb_raise(rb_eArgError, "rows must be positive.");
+  }
+
+  if (XND_TYPE(self_p)->tag != FixedDim && XND_TYPE(self_p)->tag != VarDim) {
+    rb_raise(rb_eTypeError, "XND#each_chunk needs a fixed or var outer dimension.");
+  }
+  shape = (int64_t)_XND_size(XND(self_p));
+
+  key.tag = Slice;
+  key.Slice.step = 1;
+
+  for (i = 0; i < shape; i += rows) {
+    key.Slice.start = i;
+    key.Slice.stop = shape - i > rows ? i + rows : shape;
+
+    next = xnd_subscript(XND(self_p), &key, 1, &ctx);
+    if (next.ptr == NULL) {
+      seterr(&ctx);
+      raise_error();
+    }
+
+    if (RTEST(reuse) && view != Qnil) {
+      GET_XND(view, view_p);
+      if (ndt_equal(next.type, view_p->xnd.type)) {
+        const ndt_t *t = view_p->xnd.type;
+
+        ndt_decref(next.type);
+        view_p->xnd = next;
+        view_p->xnd.type = t;
+
+        rb_yield(view);
+        continue;
       }
     }
 
-    *len = argc;
-    return flags;
+    view = RubyXND_view_move_type(self_p, &next);
+    rb_yield(view);
   }
-  else if (argc == 1 && RB_TYPE_P(argv[0], T_ARRAY)) { // args as an array
-    *len = RARRAY_LEN(argv[0]);
 
-    for (int i = 0; i < *len; i++) {
-      VALUE args[1] = { INT2NUM(i) };
-      flags |= convert_single(indices+i, rb_ary_aref(1, args, argv[0]), size);
-      if (flags & KEY_ERROR) {
-        return KEY_ERROR;
+  return self;
+}
+
+/* Implement XND#short_value */
+static VALUE
+XND_short_value(VALUE self, VALUE maxshape)
+{
+  if (maxshape == Qnil) {
+    return XND_value(self);
+  }
+  else {
+    long max = NUM2LONG(maxshape);
+    XndObject *self_p;
+
+    GET_XND(self, self_p);
+
+    if (max < 0) {
+      rb_raise(rb_eArgError, "maxshape must be positive.");
+    }
+
+    return _XND_value(XND(self_p), max);
+  }
+}
+
+/* Implementation of XND#_transpose */
+static VALUE
+XND_transpose(VALUE self, VALUE permute) {
+  NDT_STATIC_CONTEXT(ctx);
+  int p[NDT_MAX_ARGS];
+  const ndt_t *t;
+  xnd_t x;
+  XndObject *self_p;
+
+  GET_XND(self, self_p);
+
+  if (permute != Qnil) {
+    Check_Type(permute, T_ARRAY);
+    const size_t len = RARRAY_LEN(permute);
+
+    if (len > NDT_MAX_ARGS) {
+      rb_raise(rb_eValueError, "permutation list is too long.");
+    }
+
+    for (int i = 0; i < len; i++) {
+      VALUE v_obj = rb_ary_entry(permute, i);
+      Check_Type(v_obj, T_FIXNUM);
+      int v = FIX2INT(v_obj);
+      
+      if (v < 0 || v > INT_MAX) {
+        rb_raise(rb_eValueError, "permutation index is out of bounds.");
       }
+      p[i] = (int)v;
     }
-    return flags;
+    
+    t = ndt_transpose(XND_TYPE(self_p), p, (int)len, &ctx);
   }
-
-  *len = 1;
-  return convert_single(indices, argv[0], size);
-}
-
-/* Implement the #[] Ruby method. */
-static VALUE
-XND_array_aref(int argc, VALUE *argv, VALUE self)
-{
-  NDT_STATIC_CONTEXT(ctx);
-  xnd_index_t indices[NDT_MAX_DIM];
-  xnd_t x;
-  int len;
-  uint8_t flags;
-  XndObject *xnd_p;
-  size_t size;
-
-  if (argc == 0) {
-    rb_raise(rb_eArgError, "expected atleast one argument for #[].");
+  else {
+    t = ndt_transpose(XND_TYPE(self_p), NULL, 0, &ctx);
   }
 
-  GET_XND(self, xnd_p);
-  size = XND_get_size(self);
-  
-  flags = convert_key(indices, &len, argc, argv, size);
-  if (flags & KEY_ERROR) {
-    rb_raise(rb_eArgError, "something is wrong with the array key.");
-  }
-  
-  x = xnd_subscript(&xnd_p->xnd, indices, len, &ctx);
-  if (x.ptr == NULL) {
+  if (t == NULL) {
     seterr(&ctx);
     raise_error();
   }
 
-  return RubyXND_view_move_type(xnd_p, &x);
+  x = *XND(self_p);
+  x.type = t;
+
+  return RubyXND_view_move_type(self_p, &x);
 }
 
-/* Compare between data of an XND object and Ruby object. */
+/* XND#_reshape */
 static VALUE
-convert_compare(VALUE self, VALUE other)
+XND_reshape(VALUE self, VALUE obj_shape, VALUE order)
 {
-  VALUE vcmp = XND_value(self);
+  NDT_STATIC_CONTEXT(ctx);
+  int64_t shape[NDT_MAX_DIM];
+  XndObject *self_p;
+  char ord = 'C';
+  size_t n;
 
-  return rb_funcall(vcmp, rb_intern("=="), 1, other);
-}
+  if (order != Qnil) {
+    const char *c = RSTRING_PTR(order);
+    if (strlen(c) != 1) {
+      rb_raise(rb_eValueError, "'order' argument must be a 'C', 'F' or 'A'.");
+    }
+    ord = c[0];
+  }
 
-/* Implementation for #== method. 
+  Check_Type(obj_shape, T_ARRAY);
 
-   @param other Other Ruby object to compare with.
-   @return VALUE [TrueClass|FalseClass]
-*/
-static VALUE
-XND_eqeq(VALUE self, VALUE other)
-{
-  NDT_STATIC_CONTEXT(ctx);
-  XndObject *left_p, *right_p;
-  int r;
+  n = RARRAY_LEN(obj_shape);
+  if (n > NDT_MAX_DIM) {
+    rb_raise(rb_eValueError, "too many dimensions.");
+  }
 
-  if (!XND_CHECK_TYPE(other)) {
-    return convert_compare(self, other);
+  for (int i = 0; i < n; ++i) {
+    shape[i] = FIX2INT(rb_ary_entry(obj_shape, i));
+    if (shape[i] < 0) {
+      rb_raise(rb_eValueError, "negative dimension size.");
+    }
   }
 
-  GET_XND(self, left_p);
-  GET_XND(other, right_p);
+  GET_XND(self, self_p);
+  xnd_t view = xnd_reshape(XND(self_p), shape, (int)n, ord, &ctx);
+  if (xnd_err_occurred(&view)) {
+    seterr(&ctx);
+    raise_error();
+  }
 
-  r = xnd_equal(XND(left_p), XND(right_p), &ctx);
+  return RubyXND_view_move_type(self_p, &view);  
+}
 
-  if (r == 1) {
-    return Qtrue;
+/* Copies of fewer bytes run with the GVL held. Releasing it costs more
+   than it saves for them, and the data of a small String can be embedded
+   in the object itself, which GC compaction may move meanwhile. */
+#define NOGVL_MIN_SIZE (1 << 16)
+
+/* Run func(args) without the GVL if nbytes is large enough. func must
+   not touch Ruby objects. */
+static void
+call_without_gvl(void *(*func)(void *), void *args, int64_t nbytes)
+{
+  if (nbytes < NOGVL_MIN_SIZE) {
+    (void)func(args);
   }
   else {
-    return Qfalse;
+    rb_thread_call_without_gvl(func, args, NULL, NULL);
   }
 }
 
-/* Implement Ruby spaceship operator. */
-static VALUE
-XND_spaceship(VALUE self, VALUE other)
+struct copy_args {
+  xnd_t *dest;
+  const xnd_t *src;
+  uint32_t flags;
+  ndt_context_t *ctx;
+  int ret;
+};
+
+static void *
+copy_without_gvl(void *ptr)
 {
-  rb_raise(rb_eNotImpError, "spaceship not implemented yet.");
+  struct copy_args *args = (struct copy_args *)ptr;
 
-  return Qnil;
-}
+  args->ret = xnd_copy(args->dest, args->src, args->flags, args->ctx);
 
-static VALUE
-XND_lt(VALUE self, VALUE other)
-{
-  rb_raise(rb_eNotImpError, "< not implemented yet.");
-  return Qnil;
+  return NULL;
 }
 
-static VALUE
-XND_lteq(VALUE self, VALUE other)
-{
-  rb_raise(rb_eNotImpError, "<= not implemented yet.");
-  return Qnil;
-}
+struct memcpy_args {
+  char *dest;
+  const char *src;
+  int64_t size;
+};
 
-static VALUE
-XND_gt(VALUE self, VALUE other)
+static void *
+memcpy_without_gvl(void *ptr)
 {
-  rb_raise(rb_eNotImpError, "> not implemented yet.");
-  return Qnil;
-}
+  struct memcpy_args *args = (struct memcpy_args *)ptr;
 
-static VALUE
-XND_gteq(VALUE self, VALUE other)
-{
-  rb_raise(rb_eNotImpError, ">= not implemented yet.");
-  return Qnil;
+  memcpy(args->dest, args->src, args->size);
+
+  return NULL;
 }
 
-/* XND#strict_equal */
+/* XND#copy_contiguous */
 static VALUE
-XND_strict_equal(VALUE self, VALUE other)
+XND_copy_contiguous(int argc, VALUE *argv, VALUE self)
 {
   NDT_STATIC_CONTEXT(ctx);
-  XndObject *left_p, *right_p;
-  int r;
-
-  if (!XND_CHECK_TYPE(other)) {
-    rb_raise(rb_eArgError, "argument type has to be XND.");
-  }
-  
-  GET_XND(self, left_p);
-  GET_XND(other, right_p);
+  XndObject *self_p, *dest_p;
+  NdtObject *dtype_p;
+  VALUE dtype;
+  VALUE dest;
+  const ndt_t *t;
+  MemoryBlockObject *self_mblock_p;
 
-  r = xnd_strict_equal(XND(left_p), XND(right_p), &ctx);
-  if (r < 0) {
-    seterr(&ctx);
-    raise_error();
+  if (argc == 1) {
+    dtype = argv[0];
   }
-
-  if (r) {
-    return Qtrue;
+  else if (argc == 0) {
+    dtype = Qnil;
   }
   else {
-    return Qfalse;
+    rb_raise(rb_eArgError, "copy_contiguous can accept only one arg for dtype.");
   }
-}
 
-static size_t
-_XND_size(const xnd_t *x)
-{
-  NDT_STATIC_CONTEXT(ctx);
-  const ndt_t *t = x->type;
+  GET_XND(self, self_p);
 
-  if (!ndt_is_concrete(t)) {
-    rb_raise(rb_eTypeError, "NDT must be concrete to get size.");
+  if (dtype != Qnil) {
+    if (!rb_ndtypes_check_type(dtype)) {
+      rb_raise(rb_eTypeError, "dtype must be of type ndtypes.");
+    }
+    t = ndt_copy_contiguous_dtype(XND_TYPE(self_p),
+                                  rb_ndtypes_const_ndt(dtype),
+                                  XND_INDEX(self_p), &ctx);
   }
-
-  if (t->ndim > 0 && ndt_is_optional(t)) {
-    rb_raise(rb_eNotImpError, "optional dimensions are not supported.");
+  else {
+    t = ndt_copy_contiguous(XND_TYPE(self_p), XND_INDEX(self_p), &ctx);
   }
 
-  if (xnd_is_na(x)) {
-    return 0;
+  if (t == NULL) {
+    seterr(&ctx);
   }
 
-  switch (t->tag) {
-  case FixedDim: {
-    return safe_downcast(t->FixedDim.shape);
-  }
+  dest = rb_xnd_empty_from_type(cXND, t, 0);
+  ndt_decref(t);
 
-  case VarDim: {
-    int64_t start, step, shape;
+  GET_XND(dest, dest_p);
+  GET_MBLOCK(self_p->mblock, self_mblock_p);
 
-    shape = ndt_var_indices(&start, &step, t, x->index, &ctx);
-    if (shape < 0) {
-      seterr(&ctx);
-      raise_error();
-    }
+  struct copy_args args = { XND(dest_p), XND(self_p), self_mblock_p->xnd->flags,
+                            &ctx, 0 };
+  call_without_gvl(copy_without_gvl, &args, XND_TYPE(dest_p)->datasize);
+  RB_GC_GUARD(self);
 
-    return safe_downcast(shape);
+  if (args.ret < 0) {
+    seterr(&ctx);
+    raise_error();
   }
 
-  case VarDimElem: {
-    NDT_STATIC_CONTEXT(ctx);
-    int64_t start, step, shape;
+  return dest;
+}
 
-    shape = ndt_var_indices(&start, &step, t, x->index, &ctx);
-    if (shape < 0) {
-      seterr(&ctx);
-      raise_error();
-    }
+static int
+serialize_contiguous_p(const ndt_t *t)
+{
+  return ndt_is_c_contiguous(t) || ndt_is_f_contiguous(t) ||
+    ndt_is_var_contiguous(t);
+}
 
-    const int64_t i = adjust_index(t->VarDimElem.index, shape, &ctx);
-    if (i < 0) {
-      seterr(&ctx);
-      raise_error();
-    }
+/* Check that the data of x is contiguous and return a pointer to it. */
+static const char *
+serialize_data_ptr(const xnd_t *x)
+{
+  const ndt_t *t = x->type;
 
-    const xnd_t next = xnd_var_dim_next(x, start, step, i);
-    return _XND_size(&next);
+  if (!serialize_contiguous_p(t)) {
+    rb_raise(rb_eNotImpError, "serializing non-contiguos memory blocks is not implemented.");
   }
 
-  case Tuple: {
-    return safe_downcast(t->Tuple.shape);
+  if (t->ndim != 0) {
+    return x->ptr + x->index * t->Concrete.FixedDim.itemsize;
   }
 
-  case Record: {
-    return safe_downcast(t->Record.shape);
-  }
+  return x->ptr;
+}
 
-  case Union: {
-    const xnd_t next = xnd_union_next(x, &ctx);
-    if (next.ptr == NULL) {
-      seterr(&ctx);
-      raise_error();
-    }
+/* Destination of the data of a strided array gathered in C order. */
+typedef struct {
+  VALUE io;       /* flushed to io.write when full, or Qnil */
+  char *buf;      /* output buffer */
+  int64_t pos;    /* number of bytes in buf */
+  int64_t cap;    /* capacity of buf */
+} gather_sink_t;
+
+/* Arguments of gather_without_gvl. */
+struct gather_args {
+  gather_sink_t *g;
+  const xnd_t *x;
+};
 
-    return _XND_size(&next);
-  }
+static void gather_fixed(gather_sink_t *g, const xnd_t *x);
 
-  case Ref: {
-    const xnd_t next = xnd_ref_next(x, &ctx);
-    if (next.ptr == NULL) {
-      seterr(&ctx);
-      raise_error();
+static void *
+gather_without_gvl(void *ptr)
+{
+  struct gather_args *args = (struct gather_args *)ptr;
+
+  gather_fixed(args->g, args->x);
+
+  return NULL;
+}
+
+static void
+gather_put(gather_sink_t *g, const char *ptr, int64_t len)
+{
+  while (len > 0) {
+    int64_t n = g->cap - g->pos;
+    if (n > len) {
+      n = len;
     }
 
-    return _XND_size(&next);
+    memcpy(g->buf + g->pos, ptr, n);
+    g->pos += n;
+    ptr += n;
+    len -= n;
+
+    if (g->pos == g->cap && !NIL_P(g->io)) {
+      rb_io_write(g->io, rb_str_new(g->buf, g->pos));
+      g->pos = 0;
+    }
   }
+}
 
-  case Constr: {
-    const xnd_t next = xnd_constr_next(x, &ctx);
-    if (next.ptr == NULL) {
-      seterr(&ctx);
-      raise_error();
-    }
+/* Append the elements of the fixed dimension array x to g in C order.
+   Runs of adjacent elements in the innermost dimension are copied at once. */
+static void
+gather_fixed(gather_sink_t *g, const xnd_t *x)
+{
+  const ndt_t * const t = x->type;
+  int64_t i;
 
-    return _XND_size(&next);
+  if (t->tag != FixedDim) {
+    gather_put(g, x->ptr, t->datasize);
+    return;
   }
 
-  case Nominal: {
-    const xnd_t next = xnd_nominal_next(x, &ctx);
-    if (next.ptr == NULL) {
-      seterr(&ctx);
-      raise_error();
-    }
+  if (t->FixedDim.shape == 0) {
+    return;
+  }
 
-    return _XND_size(&next); 
+  if (t->FixedDim.type->tag != FixedDim && t->Concrete.FixedDim.step == 1) {
+    const xnd_t first = xnd_fixed_dim_next(x, 0);
+    gather_put(g, first.ptr, t->FixedDim.shape * t->FixedDim.type->datasize);
+    return;
   }
 
-  default: {
-    rb_raise(rb_eNoMethodError, "This type has no size method.");
+  for (i = 0; i < t->FixedDim.shape; i++) {
+    const xnd_t next = xnd_fixed_dim_next(x, i);
+    gather_fixed(g, &next);
   }
-  }  
 }
 
-/* Implement XND#size. */
+/* Return the contiguous type that a strided array x is serialized with,
+   as an NDT object. */
 static VALUE
-XND_size(VALUE self)
+serialize_gather_type(const xnd_t *x)
 {
-  XndObject *self_p;
-    
-  GET_XND(self, self_p);
-  return ULL2NUM(_XND_size(XND(self_p)));
+  NDT_STATIC_CONTEXT(ctx);
+  const ndt_t *t;
+  VALUE type;
+
+  if (!ndt_is_ndarray(x->type) || serial_needs_ext(x->type)) {
+    rb_raise(rb_eNotImpError, "serializing non-contiguos memory blocks is not implemented.");
+  }
+
+  t = ndt_copy_contiguous(x->type, x->index, &ctx);
+  if (t == NULL) {
+    seterr(&ctx);
+    raise_error();
+  }
+
+  type = rb_ndtypes_from_type(t);
+  ndt_decref(t);
+
+  return type;
 }
 
-/* Implement #[]= */
+/* Serialize the strided array x by gathering its elements directly into
+   the output. The result is the same as serializing a contiguous copy. */
 static VALUE
-XND_array_store(int argc, VALUE *argv, VALUE self)
+serialize_gather(const xnd_t *x)
 {
   NDT_STATIC_CONTEXT(ctx);
-  xnd_index_t indices[NDT_MAX_DIM];
-  xnd_t x;
-  int free_type = 0, ret, len;
-  uint8_t flags;
-  XndObject *self_p, *value_p;
-  MemoryBlockObject *self_mblock_p;
-  size_t size;
-  VALUE value;
-
-  if (argc < 2) {
-    rb_raise(rb_eArgError, "wrong number of arguments (given %d expected atleast 2)."
-             , argc);
-  }
+  bool overflow = false;
+  gather_sink_t g;
+  VALUE type, result;
+  const ndt_t *t;
+  int64_t tlen, size;
+  char *s;
 
-  GET_XND(self, self_p);
-  
-  size = XND_get_size(self);
-  flags = convert_key(indices, &len, argc-1, argv, size);
-  if (flags & KEY_ERROR) {
-    rb_raise(rb_eIndexError, "wrong kind of key in []=");
-  }
+  type = serialize_gather_type(x);
+  t = rb_ndtypes_const_ndt(type);
 
-  x = xnd_subscript(&self_p->xnd, indices, len, &ctx);
-  if (x.ptr == NULL) {
+  tlen = ndt_serialize(&s, t, &ctx);
+  if (tlen < 0) {
     seterr(&ctx);
     raise_error();
   }
-  value = argv[argc-1];
 
-  if (XND_CHECK_TYPE(value)) {
-    GET_XND(value, value_p);
-    GET_MBLOCK(self_p->mblock, self_mblock_p);
-    
-    ret = xnd_copy(&x, XND(value_p), self_mblock_p->xnd->flags, &ctx);
-    if (ret < 0) {
-      seterr(&ctx);
-      raise_error();
-    }
-  }
-  else {
-    ret = mblock_init(&x, value);
+  size = ADDi64(t->datasize, tlen, &overflow);
+  size = ADDi64(size, 8, &overflow);
+  if (overflow) {
+    ndt_free(s);
+    rb_raise(rb_eTypeError, "too large to serialize.");
   }
-  ndt_decref(x.type);
 
-  return value;
-}
+  result = rb_str_new(NULL, size);
 
-/* Implement XND#each */
-static VALUE
-XND_each(VALUE self)
-{
-  
+  g.io = Qnil;
+  g.buf = RSTRING_PTR(result);
+  g.pos = 0;
+  g.cap = t->datasize;
+
+  /* without an io the sink only copies memory. */
+  struct gather_args args = { &g, x };
+  call_without_gvl(gather_without_gvl, &args, t->datasize);
+
+  memcpy(g.buf + t->datasize, s, tlen);
+  memcpy(g.buf + t->datasize + tlen, &t->datasize, 8);
+  ndt_free(s);
+
+  RB_GC_GUARD(type);
+  return result;
 }
 
-/* Implement XND#short_value */
 static VALUE
-XND_short_value(VALUE self, VALUE maxshape)
+XND_serialize(VALUE self)
 {
-  if (maxshape == Qnil) {
-    return XND_value(self);
+  NDT_STATIC_CONTEXT(ctx);
+  bool overflow = false;
+  const xnd_t *x;
+  const ndt_t* t;
+  const char *ptr;
+  VALUE result;
+  char *cp, *s;
+  int64_t tlen, size;
+  XndObject *self_p;
+
+  GET_XND(self, self_p);
+  x = XND(self_p);
+  t = XND_TYPE(self_p);
+
+  if (!serialize_contiguous_p(t)) {
+    return serialize_gather(x);
   }
-  else {
-    long max = NUM2LONG(maxshape);
-    XndObject *self_p;
 
-    GET_XND(self, self_p);
+  ptr = serialize_data_ptr(x);
 
-    if (max < 0) {
-      rb_raise(rb_eArgError, "maxshape must be positive.");
-    }
+  if (serial_needs_ext(t)) {
+    return serialize_ext(x, ptr);
+  }
 
-    return _XND_value(XND(self_p), max);
+  tlen = ndt_serialize(&s, t, &ctx);
+  if (tlen < 0) {
+    seterr(&ctx);
+    raise_error();
+  }
+
+  size = ADDi64(t->datasize, tlen, &overflow);
+  size = ADDi64(size, 8, &overflow);
+  if (overflow) {
+    ndt_free(s);
+    /* FIXME: maybe create a new OverflowError for this. */
+    rb_raise(rb_eTypeError, "too large to serialize.");
   }
+
+  result = rb_str_new(NULL, size);
+  cp = RSTRING_PTR(result);
+
+  struct memcpy_args args = { cp, ptr, t->datasize };
+  call_without_gvl(memcpy_without_gvl, &args, t->datasize);
+  RB_GC_GUARD(self);
+  cp += t->datasize;
+  memcpy(cp, s, tlen); cp += tlen;
+  memcpy(cp, &t->datasize, 8);
+  ndt_free(s);
+
+  return result;
 }
 
-/* Implementation of XND#_transpose */
+/* Implement XND#save. Write the XND#serialize layout to the file at path so
+   that it can be mapped with XND.mmap. */
 static VALUE
-XND_transpose(VALUE self, VALUE permute) {
+XND_save(VALUE self, VALUE path)
+{
   NDT_STATIC_CONTEXT(ctx);
-  int p[NDT_MAX_ARGS];
-  const ndt_t *t;
-  xnd_t x;
   XndObject *self_p;
+  const ndt_t *t;
+  const char *ptr, *fname;
+  VALUE str;
+  char *s;
+  int64_t tlen;
+  FILE *fp;
+  int err = 0;
 
   GET_XND(self, self_p);
+  t = XND_TYPE(self_p);
 
-  if (permute != Qnil) {
-    Check_Type(permute, T_ARRAY);
-    const size_t len = RARRAY_LEN(permute);
+  FilePathValue(path);
+  fname = StringValueCStr(path);
 
-    if (len > NDT_MAX_ARGS) {
-      rb_raise(rb_eValueError, "permutation list is too long.");
+  if (serial_needs_ext(t) || !serialize_contiguous_p(t)) {
+    /* The data section cannot be written as is: write a serialized copy. */
+    str = XND_serialize(self);
+    ptr = RSTRING_PTR(str);
+    tlen = RSTRING_LEN(str);
+
+    fp = fopen(fname, "wb");
+    if (fp == NULL) {
+      rb_sys_fail_str(path);
+    }
+    if (fwrite(ptr, 1, tlen, fp) != (size_t)tlen) {
+      err = errno;
     }
+    if (fclose(fp) != 0 && err == 0) {
+      err = errno;
+    }
+    RB_GC_GUARD(str);
 
-    for (int i = 0; i < len; i++) {
-      VALUE v_obj = rb_ary_entry(permute, i);
-      Check_Type(v_obj, T_FIXNUM);
-      int v = FIX2INT(v_obj);
-      
-      if (v < 0 || v > INT_MAX) {
-        rb_raise(rb_eValueError, "permutation index is out of bounds.");
-      }
-      p[i] = (int)v;
+    if (err != 0) {
+      errno = err;
+      rb_sys_fail_str(path);
     }
-    
-    t = ndt_transpose(XND_TYPE(self_p), p, (int)len, &ctx);
-  }
-  else {
-    t = ndt_transpose(XND_TYPE(self_p), NULL, 0, &ctx);
+
+    return self;
   }
 
-  if (t == NULL) {
+  ptr = serialize_data_ptr(XND(self_p));
+  tlen = ndt_serialize(&s, t, &ctx);
+  if (tlen < 0) {
     seterr(&ctx);
     raise_error();
   }
 
-  x = *XND(self_p);
-  x.type = t;
+  fp = fopen(fname, "wb");
+  if (fp == NULL) {
+    err = errno;
+    ndt_free(s);
+    errno = err;
+    rb_sys_fail_str(path);
+  }
 
-  return RubyXND_view_move_type(self_p, &x);
+  if (fwrite(ptr, 1, t->datasize, fp) != (size_t)t->datasize ||
+      fwrite(s, 1, tlen, fp) != (size_t)tlen ||
+      fwrite(&t->datasize, 1, 8, fp) != 8) {
+    err = errno;
+  }
+  if (fclose(fp) != 0 && err == 0) {
+    err = errno;
+  }
+  ndt_free(s);
+
+  if (err != 0) {
+    errno = err;
+    rb_sys_fail_str(path);
+  }
+
+  return self;
 }
+  
 
-/* XND#_reshape */
+/*************************** Streaming ********************************/
+
+/* A stream starts with a header holding the type once:
+ *
+ *   STREAM_MAGIC | int64 tlen | serialized type
+ *
+ * followed by any number of frames, one per array of that type:
+ *
+ *   int64 datasize | data
+ *
+ * The data section of a frame is the same as in XND#serialize. */
+#define STREAM_MAGIC "xndstrm1"
+#define STREAM_MAGIC_LEN 8
+/* Bound on tlen when reading, so that a corrupt header cannot make us
+   allocate an arbitrary amount of memory. Real types are far smaller. */
+#define STREAM_MAX_TYPE_LEN (INT64_C(1) << 20)
+
+/* Write len bytes at ptr to io in chunks of at most chunk_size bytes. */
+static void
+stream_write(VALUE io, const char *ptr, int64_t len, int64_t chunk_size)
+{
+  while (len > 0) {
+    const int64_t n = len < chunk_size ? len : chunk_size;
+
+    rb_io_write(io, rb_str_new(ptr, n));
+    ptr += n;
+    len -= n;
+  }
+}
+
+/* Read exactly len bytes from io into ptr in chunks of at most chunk_size
+   bytes, reusing buf for each chunk. Return false if io is at EOF before
+   the first byte and raise EOFError if it ends later. */
+static bool
+stream_read(VALUE io, char *ptr, int64_t len, int64_t chunk_size, VALUE buf)
+{
+  int64_t done = 0;
+
+  while (done < len) {
+    const int64_t n = len-done < chunk_size ? len-done : chunk_size;
+    VALUE str;
+
+    str = rb_funcall(io, rb_intern("read"), 2, LL2NUM(n), buf);
+    if (NIL_P(str) && done == 0) {
+      return false;
+    }
+    if (NIL_P(str) || RSTRING_LEN(str) != n) {
+      rb_raise(rb_eEOFError, "unexpected end of xnd stream.");
+    }
+
+    memcpy(ptr+done, RSTRING_PTR(str), n);
+    done += n;
+  }
+
+  return true;
+}
+
+static int64_t
+stream_chunk_size(VALUE chunk_size)
+{
+  const int64_t n = NUM2LL(chunk_size);
+
+  if (n <= 0) {
+    rb_raise(rb_eArgError, "chunk_size must be positive.");
+  }
+
+  return n;
+}
+
+/* Implement XND#_stream_write. Write a frame holding the data of self to io.
+   If stream_type is nil, precede it by a stream header, otherwise check that
+   self matches the type of the stream. Return the type of the stream.
+   Strided arrays are gathered chunk by chunk without a contiguous copy. */
 static VALUE
-XND_reshape(VALUE self, VALUE obj_shape, VALUE order)
+XND_stream_write(VALUE self, VALUE io, VALUE chunk_size, VALUE stream_type)
 {
   NDT_STATIC_CONTEXT(ctx);
-  int64_t shape[NDT_MAX_DIM];
   XndObject *self_p;
-  char ord = 'C';
-  size_t n;
+  VALUE type;
+  const ndt_t *t;
+  int64_t n, tlen;
+  char *s;
 
-  if (order != Qnil) {
-    const char *c = RSTRING_PTR(order);
-    if (strlen(c) != 1) {
-      rb_raise(rb_eValueError, "'order' argument must be a 'C', 'F' or 'A'.");
-    }
-    ord = c[0];
-  }
+  GET_XND(self, self_p);
+  n = stream_chunk_size(chunk_size);
 
-  Check_Type(obj_shape, T_ARRAY);
+  if (serial_needs_ext(XND_TYPE(self_p))) {
+    rb_raise(rb_eNotImpError,
+             "streaming arrays with bitmaps or pointers is not implemented.");
+  }
 
-  n = RARRAY_LEN(obj_shape);
-  if (n > NDT_MAX_DIM) {
-    rb_raise(rb_eValueError, "too many dimensions.");
+  if (serialize_contiguous_p(XND_TYPE(self_p))) {
+    type = TYPE_OWNER(self_p);
   }
+  else {
+    type = serialize_gather_type(XND(self_p));
+  }
+  t = rb_ndtypes_const_ndt(type);
 
-  for (int i = 0; i < n; ++i) {
-    shape[i] = FIX2INT(rb_ary_entry(obj_shape, i));
-    if (shape[i] < 0) {
-      rb_raise(rb_eValueError, "negative dimension size.");
+  if (NIL_P(stream_type)) {
+    VALUE buf;
+
+    tlen = ndt_serialize(&s, t, &ctx);
+    if (tlen < 0) {
+      seterr(&ctx);
+      raise_error();
     }
+
+    buf = rb_str_buf_new(STREAM_MAGIC_LEN + 8 + tlen);
+    rb_str_cat(buf, STREAM_MAGIC, STREAM_MAGIC_LEN);
+    rb_str_cat(buf, (const char *)&tlen, 8);
+    rb_str_cat(buf, s, tlen);
+    ndt_free(s);
+
+    rb_io_write(io, buf);
+    stream_type = type;
+  }
+  else if (!rb_ndtypes_check_type(stream_type) ||
+           !ndt_equal(t, rb_ndtypes_const_ndt(stream_type))) {
+    rb_raise(rb_eArgError, "type %"PRIsVALUE" does not match stream type %"PRIsVALUE".",
+             type, stream_type);
   }
 
-  GET_XND(self, self_p);
-  xnd_t view = xnd_reshape(XND(self_p), shape, (int)n, ord, &ctx);
-  if (xnd_err_occurred(&view)) {
-    seterr(&ctx);
-    raise_error();
+  rb_io_write(io, rb_str_new((const char *)&t->datasize, 8));
+
+  if (type == TYPE_OWNER(self_p)) {
+    stream_write(io, serialize_data_ptr(XND(self_p)), t->datasize, n);
+  }
+  else {
+    gather_sink_t g;
+    VALUE tmp;
+
+    g.io = io;
+    g.buf = ALLOCV_N(char, tmp, n);
+    g.pos = 0;
+    g.cap = n;
+    gather_fixed(&g, XND(self_p));
+    if (g.pos > 0) {
+      rb_io_write(io, rb_str_new(g.buf, g.pos));
+    }
+    ALLOCV_END(tmp);
   }
 
-  return RubyXND_view_move_type(self_p, &view);  
+  return stream_type;
 }
 
-/* XND#copy_contiguous */
+/* Implement XND._stream_read_header. Return the type of the stream or nil
+   if io is at EOF. */
 static VALUE
-XND_copy_contiguous(int argc, VALUE *argv, VALUE self)
+XND_s_stream_read_header(VALUE klass, VALUE io)
 {
   NDT_STATIC_CONTEXT(ctx);
-  XndObject *self_p, *dest_p;
-  NdtObject *dtype_p;
-  VALUE dtype;
-  VALUE dest;
+  char magic[STREAM_MAGIC_LEN];
   const ndt_t *t;
-  MemoryBlockObject *self_mblock_p;
+  VALUE buf, s, type;
+  int64_t tlen;
 
-  if (argc == 1) {
-    dtype = argv[0];
-  }
-  else if (argc == 0) {
-    dtype = Qnil;
-  }
-  else {
-    rb_raise(rb_eArgError, "copy_contiguous can accept only one arg for dtype.");
+  buf = rb_str_buf_new(0);
+  if (!stream_read(io, magic, STREAM_MAGIC_LEN, STREAM_MAGIC_LEN, buf)) {
+    return Qnil;
   }
 
-  GET_XND(self, self_p);
+  if (memcmp(magic, STREAM_MAGIC, STREAM_MAGIC_LEN) != 0) {
+    rb_raise(rb_eValueError, "invalid format for xnd stream.");
+  }
 
-  if (dtype != Qnil) {
-    if (!rb_ndtypes_check_type(dtype)) {
-      rb_raise(rb_eTypeError, "dtype must be of type ndtypes.");
-    }
-    t = ndt_copy_contiguous_dtype(XND_TYPE(self_p),
-                                  rb_ndtypes_const_ndt(dtype),
-                                  XND_INDEX(self_p), &ctx);
+  if (!stream_read(io, (char *)&tlen, 8, 8, buf) || tlen < 0 ||
+      tlen > STREAM_MAX_TYPE_LEN) {
+    rb_raise(rb_eValueError, "invalid format for xnd stream.");
   }
-  else {
-    t = ndt_copy_contiguous(XND_TYPE(self_p), XND_INDEX(self_p), &ctx);
+
+  s = rb_str_new(NULL, tlen);
+  if (!stream_read(io, RSTRING_PTR(s), tlen, tlen, buf)) {
+    rb_raise(rb_eEOFError, "unexpected end of xnd stream.");
   }
 
+  t = ndt_deserialize(RSTRING_PTR(s), tlen, &ctx);
+  RB_GC_GUARD(s);
   if (t == NULL) {
     seterr(&ctx);
+    raise_error();
   }
 
-  dest = rb_xnd_empty_from_type(cXND, t, 0);
+  type = rb_ndtypes_from_type(t);
   ndt_decref(t);
 
-  GET_XND(dest, dest_p);
-  GET_MBLOCK(self_p->mblock, self_mblock_p);
-
-  if (xnd_copy(XND(dest_p), XND(self_p), self_mblock_p->xnd->flags, &ctx) < 0) {
-    seterr(&ctx);
-    raise_error();
+  /* the writer only emits concrete types without bitmaps or pointers. */
+  t = rb_ndtypes_const_ndt(type);
+  if (!ndt_is_concrete(t) || serial_needs_ext(t)) {
+    rb_raise(rb_eValueError, "invalid format for xnd stream.");
   }
 
-  return dest;
+  return type;
 }
 
+/* Implement XND._stream_read. Read the next frame of a stream of arrays of
+   type from io. Return nil if io is at EOF. */
 static VALUE
-XND_serialize(VALUE self)
+XND_s_stream_read(VALUE klass, VALUE io, VALUE type, VALUE chunk_size)
 {
-  NDT_STATIC_CONTEXT(ctx);
-  bool overflow = false;
-  const xnd_t *x;
-  const ndt_t* t;
-  VALUE result;
-  char *cp, *s;
-  int64_t tlen, size;
+  MemoryBlockObject *mblock_p;
   XndObject *self_p;
+  VALUE mblock, self, buf;
+  const ndt_t *t;
+  int64_t datasize, n;
 
-  GET_XND(self, self_p);
-  x = XND(self_p);
-  t = XND_TYPE(self_p);
-
-  if (!ndt_is_pointer_free(t)) {
-    rb_raise(rb_eNotImpError, "serializing memory blocks with pointers is not implemented.");
-  }
-
-  if (ndt_is_optional(t) || ndt_subtree_is_optional(t)) {
-    rb_raise(rb_eNotImpError, "serializing bitmaps is not implemented.");
+  if (!rb_ndtypes_check_type(type)) {
+    rb_raise(rb_eTypeError, "type must be of type NDT.");
   }
+  t = rb_ndtypes_const_ndt(type);
+  n = stream_chunk_size(chunk_size);
 
-  if (!ndt_is_c_contiguous(t) && !ndt_is_f_contiguous(t) &&
-      !ndt_is_var_contiguous(t)) {
-    rb_raise(rb_eNotImpError, "serializing non-contiguos memory blocks is not implemented.");
+  buf = rb_str_buf_new(0);
+  if (!stream_read(io, (char *)&datasize, 8, 8, buf)) {
+    return Qnil;
   }
 
-  tlen = ndt_serialize(&s, t, &ctx);
-  if (tlen < 0) {
-    seterr(&ctx);
-    raise_error();
+  if (datasize != t->datasize) {
+    rb_raise(rb_eValueError, "invalid format for xnd stream.");
   }
 
-  size = ADDi64(t->datasize, tlen, &overflow);
-  size = ADDi64(size, 8, &overflow);
-  if (overflow) {
-    ndt_free(s);
-    /* FIXME: maybe create a new OverflowError for this. */
-    rb_raise(rb_eTypeError, "too large to serialize.");
-  }
+  mblock = mblock_empty(type, XND_OWN_EMBEDDED);
+  GET_MBLOCK(mblock, mblock_p);
 
-  result = rb_str_new(NULL, size);
-  cp = RSTRING_PTR(result);
+  self = XndObject_alloc(cXND);
+  GET_XND(self, self_p);
+  XND_from_mblock(self_p, mblock);
 
-  char *ptr = x->ptr;
-  if (t->ndim != 0) {
-    ptr = x->ptr + x->index * t->Concrete.FixedDim.itemsize;
+  if (!stream_read(io, mblock_p->xnd->master.ptr, datasize, n, buf) &&
+      datasize > 0) {
+    rb_raise(rb_eEOFError, "unexpected end of xnd stream.");
   }
 
-  memcpy(cp, ptr, t->datasize); cp += t->datasize;
-  memcpy(cp, s, tlen); cp += tlen;
-  memcpy(cp, &t->datasize, 8);
-  ndt_free(s);
-
-  return result;
+  return self;
 }
-  
 
 /*************************** Singleton methods ********************************/
 
 
-/* Implement XND.deserialize */
+/* Implement XND.deserialize. If copy is false and the data embedded in the
+   frozen String v is suitably aligned, the result points into v instead of
+   a copy. */
 static VALUE
-XND_s_deserialize(VALUE klass, VALUE v)
+XND_s_deserialize(VALUE klass, VALUE v, VALUE copy)
 {
-  NDT_STATIC_CONTEXT(ctx);
-  VALUE mblock, self;
-  bool overflow = false;
-  int64_t mblock_size;
+  VALUE mblock, self, type;
   MemoryBlockObject *mblock_p;
   XndObject *self_p;
+  const ndt_t *t;
+  serial_ext_t ext;
 
   Check_Type(v, T_STRING);
 
-  const int64_t size = RSTRING_LEN(v);
-  if (size < 8) {
-    goto invalid_format;
+  if (!RTEST(copy) && !OBJ_FROZEN(v)) {
+    rb_raise(rb_eArgError, "deserializing without copy requires a frozen String.");
   }
 
   const char *s = RSTRING_PTR(v);
-  memcpy(&mblock_size, s+size-8, 8);
-  if (mblock_size < 0) {
-    goto invalid_format;
-  }
+  t = deserialize_type(s, RSTRING_LEN(v), &ext);
+  type = rb_ndtypes_from_type(t);
+  ndt_decref(t);
+  t = rb_ndtypes_const_ndt(type);
 
-  const int64_t tmp = ADDi64(mblock_size, 8, &overflow);
-  const int64_t tlen = size - tmp;
-  if (overflow || tlen < 0) {
-    goto invalid_format;
-  }
+  if (ext.bits != NULL) {
+    mblock = mblock_empty(type, XND_OWN_EMBEDDED);
+    GET_MBLOCK(mblock, mblock_p);
 
-  const ndt_t *t = ndt_deserialize(s+mblock_size, tlen, &ctx);
-  if (t == NULL) {
-    seterr(&ctx);
+    deserialize_ext(&mblock_p->xnd->master, s, &ext);
+  }
+  else if (!RTEST(copy) && mblock_can_borrow(t, s)) {
+    mblock = mblock_borrow(type, v, (char *)s, true);
+  }
+  else {
+    mblock = mblock_empty(type, XND_OWN_EMBEDDED);
+    GET_MBLOCK(mblock, mblock_p);
+  
+    memcpy(mblock_p->xnd->master.ptr, s, t->datasize);
   }
 
-  if (t->datasize != mblock_size) {
-    goto invalid_format;
+  self = XndObject_alloc(cXND);
+  GET_XND(self, self_p);
+  XND_from_mblock(self_p, mblock);
+
+  return self;
+}
+
+/* Implement XND.mmap. Map a file written by XND#save. */
+static VALUE
+XND_s_mmap(VALUE klass, VALUE path, VALUE mode)
+{
+  XndObject *self_p;
+  VALUE mblock, self;
+  bool readonly;
+
+  Check_Type(mode, T_SYMBOL);
+  if (SYM2ID(mode) == rb_intern("r")) {
+    readonly = true;
+  }
+  else if (SYM2ID(mode) == rb_intern("rw")) {
+    readonly = false;
+  }
+  else {
+    rb_raise(rb_eArgError, "mode must be :r or :rw.");
   }
 
-  VALUE type = rb_ndtypes_from_type(t);
-  ndt_decref(t);
+  mblock = mblock_from_file(path, readonly);
 
-  mblock = mblock_empty(type, XND_OWN_EMBEDDED);
-  GET_MBLOCK(mblock, mblock_p);
-  rb_xnd_gc_guard_register_mblock_type(mblock_p, type);
-  
-  memcpy(mblock_p->xnd->master.ptr, s, mblock_size);
+  self = XndObject_alloc(cXND);
+  GET_XND(self, self_p);
+  XND_from_mblock(self_p, mblock);
+
+  return self;
+}
+
+/* Implement XND.from_buffer. The returned XND borrows the bytes of the frozen
+   String str without copying them. */
+static VALUE
+XND_s_from_buffer(VALUE klass, VALUE str, VALUE origin_type)
+{
+  XndObject *self_p;
+  VALUE self, mblock, type;
+
+  Check_Type(str, T_STRING);
+  if (!OBJ_FROZEN(str)) {
+    rb_raise(rb_eArgError, "buffer String must be frozen.");
+  }
+
+  type = rb_ndtypes_from_object(origin_type);
+  mblock = mblock_from_buffer(type, str);
 
   self = XndObject_alloc(cXND);
   GET_XND(self, self_p);
   XND_from_mblock(self_p, mblock);
-    
-  rb_xnd_gc_guard_register_xnd_mblock(self_p, mblock);
-  rb_xnd_gc_guard_register_xnd_type(self_p, type);
 
   return self;
-  
- invalid_format:
-  rb_raise(rb_eValueError, "invalid format for xnd deserialization.");
 }
 
 static VALUE
 RubyXND_s_empty(VALUE klass, VALUE origin_type, VALUE device)
 {
   XndObject *self_p;
-  MemoryBlockObject *mblock_p;
   VALUE self, mblock;
   VALUE type;
-  VALUE mblock_type, xnd_type;
   uint32_t flags = 0;
 
   self = XndObject_alloc(cXND);
@@ -2343,15 +5144,216 @@ RubyXND_s_empty(VALUE klass, VALUE origin_type, VALUE device)
   mblock = mblock_empty(type, flags);
   
   XND_from_mblock(self_p, mblock);
-  GET_MBLOCK(mblock, mblock_p);
-  
-  rb_xnd_gc_guard_register_xnd_mblock(self_p, mblock);
-  rb_xnd_gc_guard_register_xnd_type(self_p, type);
-  rb_xnd_gc_guard_register_mblock_type(mblock_p, type);
 
   return self;
 }
 
+/* Return a Hash with the state of the buffer pool of empty mblocks. */
+static VALUE
+RubyXND_s_pool_stats(VALUE klass)
+{
+  VALUE hash = rb_hash_new();
+
+  rb_hash_aset(hash, ID2SYM(rb_intern("hits")), LL2NUM(pool.hits));
+  rb_hash_aset(hash, ID2SYM(rb_intern("misses")), LL2NUM(pool.misses));
+  rb_hash_aset(hash, ID2SYM(rb_intern("buffers")), LL2NUM(pool.buffers));
+  rb_hash_aset(hash, ID2SYM(rb_intern("bytes")), LL2NUM(pool.bytes));
+  rb_hash_aset(hash, ID2SYM(rb_intern("limit")), LL2NUM(pool.limit));
+
+  return hash;
+}
+
+/* Free all buffers of the pool and return the number of bytes freed. */
+static VALUE
+RubyXND_s_pool_trim(VALUE klass)
+{
+  return LL2NUM(pool_shrink(0));
+}
+
+/* Set the number of bytes the pool may hold, freeing buffers beyond it. */
+static VALUE
+RubyXND_s_set_pool_limit(VALUE klass, VALUE limit)
+{
+  const int64_t n = NUM2LL(limit);
+
+  if (n < 0) {
+    rb_raise(rb_eArgError, "pool limit must not be negative.");
+  }
+  pool.limit = n;
+  pool_shrink(n);
+
+  return limit;
+}
+
+/* Return v with the XND objects backed by arena a replaced by copies,
+   looking into Arrays and the values of Hashes. */
+static VALUE
+arena_copy_out(arena_t *a, VALUE v)
+{
+  if (rb_obj_is_kind_of(v, cXND)) {
+    XndObject *xnd_p;
+
+    GET_XND(v, xnd_p);
+    if (xnd_p->mblock && ((MemoryBlockObject *)DATA_PTR(xnd_p->mblock))->arena == a) {
+      return rb_funcall(v, rb_intern("copy_contiguous"), 0, NULL);
+    }
+    return v;
+  }
+
+  if (RB_TYPE_P(v, T_ARRAY)) {
+    const long n = RARRAY_LEN(v);
+    VALUE copy = rb_ary_new_capa(n);
+
+    for (long i = 0; i < n; i++) {
+      rb_ary_push(copy, arena_copy_out(a, rb_ary_entry(v, i)));
+    }
+    return copy;
+  }
+
+  if (RB_TYPE_P(v, T_HASH)) {
+    VALUE keys = rb_funcall(v, rb_intern("keys"), 0, NULL);
+    VALUE copy = rb_hash_new();
+
+    for (long i = 0; i < RARRAY_LEN(keys); i++) {
+      VALUE key = rb_ary_entry(keys, i);
+      rb_hash_aset(copy, key, arena_copy_out(a, rb_hash_aref(v, key)));
+    }
+    return copy;
+  }
+
+  return v;
+}
+
+/* Free the buffer of the arena. The mblocks that are still alive are
+   released. */
+static void
+arena_detach(arena_t *a)
+{
+  for (int64_t i = 0; i < a->nblocks; i++) {
+    MemoryBlockObject *mblock_p = a->blocks[i];
+    if (mblock_p != NULL) {
+      mblock_p->xnd->master.ptr = NULL;
+      mblock_p->arena = NULL;
+      mblock_p->released = true;
+    }
+  }
+
+  ndt_free(a->blocks);
+  ndt_aligned_free(a->base);
+  a->blocks = NULL;
+  a->base = NULL;
+  a->nblocks = 0;
+  a->capacity = 0;
+}
+
+static void
+ArenaObject_dmark(void *self)
+{
+  arena_t *a = (arena_t *)self;
+
+  rb_gc_mark(a->next);
+  rb_gc_mark(a->fiber);
+}
+
+static void
+ArenaObject_dfree(void *self)
+{
+  arena_t *a = (arena_t *)self;
+
+  arena_detach(a);
+  xfree(a);
+  narenas--;
+}
+
+static size_t
+ArenaObject_dsize(const void *self)
+{
+  const arena_t *a = (const arena_t *)self;
+
+  return sizeof(arena_t) + a->size + a->capacity * sizeof *a->blocks;
+}
+
+static const rb_data_type_t ArenaObject_type = {
+  .wrap_struct_name = "ArenaObject",
+  .function = {
+    .dmark = ArenaObject_dmark,
+    .dfree = ArenaObject_dfree,
+    .dsize = ArenaObject_dsize,
+    .reserved = {0,0},
+  },
+  .parent = 0,
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+/* Stop serving allocations from the arena, which is the innermost open
+   arena of the current fiber. */
+static void
+arena_unlink(VALUE arena)
+{
+  arena_t *a;
+
+  GET_ARENA(arena, a);
+  if (a->open) {
+    a->open = false;
+    rb_thread_local_aset(rb_thread_current(), id_arena, a->next);
+  }
+}
+
+static VALUE
+arena_body(VALUE arena)
+{
+  arena_t *a;
+  VALUE v = rb_yield_values(0);
+
+  /* The copies must not come from the arena that is about to go away. */
+  arena_unlink(arena);
+  GET_ARENA(arena, a);
+  return arena_copy_out(a, v);
+}
+
+static VALUE
+arena_release(VALUE arena)
+{
+  arena_t *a;
+
+  arena_unlink(arena);
+  GET_ARENA(arena, a);
+  arena_detach(a);
+
+  return Qnil;
+}
+
+/* Run the block with the data of new arrays taken from an arena of the
+   given number of bytes and return its value. */
+static VALUE
+XND_s_arena(VALUE klass, VALUE bytes)
+{
+  const int64_t size = NUM2LL(bytes);
+  VALUE arena;
+  arena_t *a;
+
+  rb_need_block();
+  if (size <= 0) {
+    rb_raise(rb_eArgError, "arena size must be positive.");
+  }
+
+  arena = TypedData_Make_Struct(cRubyXND_Arena, arena_t, &ArenaObject_type, a);
+  narenas++;
+  a->next = Qnil;
+  a->fiber = Qnil;
+  a->base = ndt_aligned_calloc(POOL_ALIGN, size);
+  if (a->base == NULL) {
+    rb_raise(rb_eNoMemError, "cannot allocate the arena.");
+  }
+  a->size = size;
+  a->fiber = rb_fiber_current();
+  a->next = rb_thread_local_aref(rb_thread_current(), id_arena);
+  a->open = true;
+  rb_thread_local_aset(rb_thread_current(), id_arena, arena);
+
+  return rb_ensure(arena_body, arena, arena_release, arena);
+}
+
 /*************************** C-API ********************************/
 
 size_t
@@ -2396,21 +5398,14 @@ rb_xnd_const_xnd(VALUE xnd)
 VALUE
 rb_xnd_from_xnd(xnd_t *x)
 {
-  VALUE mblock, xnd, type;
+  VALUE mblock, xnd;
   XndObject *xnd_p;
-  MemoryBlockObject *mblock_p;
   
   mblock = mblock_from_xnd(x);
   xnd = XndObject_alloc(cXND);
   GET_XND(xnd, xnd_p);
-  GET_MBLOCK(mblock, mblock_p);
-  type = mblock_p->type;
   
   XND_from_mblock(xnd_p, mblock);
-  
-  rb_xnd_gc_guard_register_xnd_mblock(xnd_p, mblock);
-  rb_xnd_gc_guard_register_xnd_type(xnd_p, type);
-  rb_xnd_gc_guard_register_mblock_type(mblock_p, type);
 
   return xnd;
 }
@@ -2419,7 +5414,6 @@ rb_xnd_from_xnd(xnd_t *x)
 VALUE
 rb_xnd_empty_from_type(VALUE klass, const ndt_t *t, uint32_t flags)
 {
-  MemoryBlockObject *mblock_p;
   XndObject *xnd_p;
   VALUE type, mblock, xnd;
 
@@ -2431,10 +5425,6 @@ rb_xnd_empty_from_type(VALUE klass, const ndt_t *t, uint32_t flags)
 
   XND_from_mblock(xnd_p, mblock);
 
-  rb_xnd_gc_guard_register_xnd_mblock(xnd_p, mblock);
-  rb_xnd_gc_guard_register_xnd_type(xnd_p, type);
-  rb_xnd_gc_guard_register_mblock_type(mblock_p, type);
-
   return xnd;
 }
 
@@ -2472,6 +5462,18 @@ rb_xnd_is_cuda_managed(VALUE xnd)
   return (mblock_p->xnd->flags & XND_CUDA_MANAGED);
 }
 
+int
+rb_xnd_is_readonly(VALUE xnd)
+{
+  XndObject *xnd_p;
+  MemoryBlockObject *mblock_p;
+
+  GET_XND(xnd, xnd_p);
+  GET_MBLOCK(xnd_p->mblock, mblock_p);
+
+  return mblock_p->readonly;
+}
+
 /*
  * This function handles two common view cases:
  *
@@ -2508,7 +5510,18 @@ void Init_ruby_xnd(void)
   cRubyXND = rb_define_class("RubyXND", rb_cObject);
   cXND = rb_define_class("XND", cRubyXND);
   cRubyXND_MBlock = rb_define_class_under(cRubyXND, "MBlock", rb_cObject);
-  mRubyXND_GCGuard = rb_define_module_under(cRubyXND, "GCGuard");
+  cRubyXND_InitPlan = rb_define_class_under(cRubyXND, "InitPlan", rb_cObject);
+  rb_undef_alloc_func(cRubyXND_InitPlan);
+  id_init_plan = rb_intern("__xnd_init_plan");
+  cRubyXND_Mapping = rb_define_class_under(cRubyXND, "Mapping", rb_cObject);
+  rb_undef_alloc_func(cRubyXND_Mapping);
+  cRubyXND_Arena = rb_define_class_under(cRubyXND, "Arena", rb_cObject);
+  rb_undef_alloc_func(cRubyXND_Arena);
+  id_arena = rb_intern("__xnd_arena");
+  cXND_Index = rb_define_class_under(cXND, "Index", rb_cObject);
+  if (rb_const_defined(rb_cEnumerator, rb_intern("ArithmeticSequence"))) {
+    rb_cArithSeq = rb_const_get(rb_cEnumerator, rb_intern("ArithmeticSequence"));
+  }
 
   /* errors */
   rb_eValueError = rb_define_class("ValueError", rb_eRuntimeError);
@@ -2519,16 +5532,27 @@ void Init_ruby_xnd(void)
 
   /* singleton methods */
   rb_define_singleton_method(cRubyXND, "empty", RubyXND_s_empty, 2);
-  rb_define_singleton_method(cXND, "deserialize", XND_s_deserialize, 1);
+  rb_define_singleton_method(cRubyXND, "pool_stats", RubyXND_s_pool_stats, 0);
+  rb_define_singleton_method(cRubyXND, "pool_trim", RubyXND_s_pool_trim, 0);
+  rb_define_singleton_method(cRubyXND, "pool_limit=", RubyXND_s_set_pool_limit, 1);
+  rb_define_singleton_method(cXND, "arena", XND_s_arena, 1);
+  rb_define_singleton_method(cXND, "_deserialize", XND_s_deserialize, 2);
+  rb_define_singleton_method(cXND, "from_buffer", XND_s_from_buffer, 2);
+  rb_define_singleton_method(cXND, "_mmap", XND_s_mmap, 2);
+  rb_define_singleton_method(cXND, "_stream_read_header", XND_s_stream_read_header, 1);
+  rb_define_singleton_method(cXND, "_stream_read", XND_s_stream_read, 3);
   
   /* instance methods */
   rb_define_method(cXND, "type", XND_type, 0);
   rb_define_method(cXND, "dtype", XND_dtype, 0);
   rb_define_method(cXND, "value", XND_value, 0);
   rb_define_method(cXND, "[]", XND_array_aref, -1);
+  rb_define_method(cXND, "at", XND_at, -1);
   rb_define_method(cXND, "[]=", XND_array_store, -1);
   rb_define_method(cXND, "==", XND_eqeq, 1);
   rb_define_method(cXND, "serialize", XND_serialize, 0);
+  rb_define_method(cXND, "save", XND_save, 1);
+  rb_define_method(cXND, "_stream_write", XND_stream_write, 3);
   rb_define_method(cXND, "copy_contiguous", XND_copy_contiguous, -1);
   rb_define_method(cXND, "_transpose", XND_transpose, 1);
   rb_define_method(cXND, "_reshape", XND_reshape, 2);
@@ -2546,9 +5570,13 @@ void Init_ruby_xnd(void)
 
   /* iterators */
   rb_define_method(cXND, "each", XND_each, 0);
+  rb_define_method(cXND, "_each_chunk", XND_each_chunk, 2);
 
-  /* GC guard */
-  rb_xnd_init_gc_guard();
+  /* XND::Index */
+  rb_define_alloc_func(cXND_Index, IndexObject_alloc);
+  rb_define_method(cXND_Index, "initialize", IndexObject_initialize, -1);
+  rb_define_method(cXND_Index, "rebase", IndexObject_rebase, 1);
+  rb_define_method(cXND_Index, "to_a", IndexObject_to_a, 0);
 
 #ifdef XND_DEBUG
   run_float_pack_unpack_tests();
@@ -59,6 +59,8 @@ extern "C" {
   XndObject * rb_xnd_get_xnd_object(VALUE obj);
   MemoryBlockObject * rb_xnd_get_mblock_object(VALUE mblock);
   int rb_xnd_is_cuda_managed(VALUE xnd);
+  /* Return true if the data of xnd must not be written to. */
+  int rb_xnd_is_readonly(VALUE xnd);
  
 #ifdef __cplusplus
 }
@@ -45,21 +45,28 @@
 #endif
 
 #include <float.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 #include "ruby.h"
 #include "ruby/encoding.h"
+#include "ruby/io.h"
+#include "ruby/thread.h"
 #include "ruby_ndtypes.h"
 #include "ruby_xnd.h"
 #include "util.h"
 #include "float_pack_unpack.h"
 
-extern VALUE mRubyXND_GCGuard;
-
 /* typedefs */
 typedef struct XndObject XndObject;
 typedef struct MemoryBlockObject MemoryBlockObject;
 
-#include "gc_guard.h"
-
 /* macros */
 #if SIZEOF_LONG == SIZEOF_VOIDP
 # define PTR2NUM(x)   (LONG2NUM((long)(x)))
@@ -82,4 +89,9 @@ typedef struct MemoryBlockObject MemoryBlockObject;
 #define IEEE_BIG_ENDIAN_P NULL
 #endif
 
+/* True if data with the endian flags of a type can be accessed with plain
+   loads and stores on this machine. */
+#define XND_NATIVE_ENDIAN_P(flags) \
+  ((IEEE_LITTLE_ENDIAN_P && le(flags)) || (IEEE_BIG_ENDIAN_P && !le(flags)))
+
 #endif  /* RUBY_XND_INTERNAL_H */
@@ -158,6 +158,52 @@ rb_range_unpack(VALUE range, long long *begin, long long *end, long long *step,
   }
 }
 
+/* Unpack an Enumerator::ArithmeticSequence such as (1..7).step(2) or
+   9.step(0, -3) into slice bounds that libxnd understands. Negative
+   bounds are mapped against size like rb_range_unpack. Open bounds are
+   mapped to values that libxnd clamps to the start or end of the
+   dimension in the direction of the step. */
+void
+rb_arith_seq_unpack(VALUE seq, long long *begin, long long *end, long long *step, size_t size)
+{
+  VALUE rb_begin = rb_funcall(seq, rb_intern("begin"), 0, NULL);
+  VALUE rb_end = rb_funcall(seq, rb_intern("end"), 0, NULL);
+  int exclude_end = RTEST(rb_funcall(seq, rb_intern("exclude_end?"), 0, NULL));
+
+  *step = NUM2LL(rb_funcall(seq, rb_intern("step"), 0, NULL));
+  if (*step == 0) {
+    rb_raise(rb_eArgError, "slice step cannot be zero.");
+  }
+
+  if (NIL_P(rb_begin) || RB_FLOAT_TYPE_P(rb_begin)) {
+    *begin = *step > 0 ? 0 : INT64_MAX;
+  }
+  else {
+    *begin = NUM2LL(rb_begin);
+    if (*begin < 0) {
+      *begin = mod(*begin, (long long)size);
+    }
+  }
+
+  if (NIL_P(rb_end) || RB_FLOAT_TYPE_P(rb_end)) {
+    *end = *step > 0 ? INT64_MAX : INT64_MIN;
+    return;
+  }
+
+  *end = NUM2LL(rb_end);
+  if (*end < 0) {
+    *end = mod(*end, (long long)size);
+  }
+
+  if (!exclude_end) {
+    *end += *step > 0 ? 1 : -1;
+    /* stepping down through index 0: -1 would mean the last element. */
+    if (*end < 0) {
+      *end = INT64_MIN;
+    }
+  }
+}
+
 int
 ndt_exists(void)
 {
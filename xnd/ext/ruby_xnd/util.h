@@ -56,6 +56,10 @@ VALUE array_new(int64_t size);
 
 VALUE bytes_from_string_and_size(const char *str, int64_t size);
 
+void rb_range_unpack(VALUE range, long long *begin, long long *end, long long *step, size_t size);
+
+void rb_arith_seq_unpack(VALUE seq, long long *begin, long long *end, long long *step, size_t size);
+
 int ndt_exists(void);
 
 #endif  /* UTIL_H */
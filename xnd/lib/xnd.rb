@@ -52,6 +52,9 @@ class XND
 end
 
 class XND < RubyXND
+  # XND#each walks the outermost dimension.
+  include Enumerable
+
   # Immutable array type used when specifying XND tuples without wanting to
   # specify the type. It is highly recommended to simply specify the type
   # and use Ruby Arrays for specifying the data.
@@ -101,6 +104,9 @@ class XND < RubyXND
   end
   
   MAX_DIM = NDTypes::MAX_DIM
+
+  # Default number of bytes passed to each IO#write/IO#read when streaming.
+  STREAM_CHUNK_SIZE = 1 << 20
   
   # Methods for type inference.
   module TypeInference
@@ -296,6 +302,32 @@ class XND < RubyXND
       
       RubyXND.empty type, device
     end
+
+    # Deserialize a String created by XND#serialize. With copy: false the
+    # data is not copied and the result is a read-only view into +str+,
+    # which must be frozen. The data is still copied if it is not
+    # sufficiently aligned for the type.
+    def deserialize str, copy: true
+      _deserialize str, copy
+    end
+
+    # Map a file written by XND#save into memory. The data is paged in
+    # lazily by the kernel and shared between processes mapping the same
+    # file. With mode: :rw, writes to the XND are written to the file.
+    def mmap path, mode: :r
+      _mmap path, mode
+    end
+
+    # Read an array written by XND#serialize_to from +io+. The data is read
+    # directly into the new array in chunks of +chunk_size+ bytes.
+    def deserialize_from io, chunk_size: STREAM_CHUNK_SIZE
+      type = _stream_read_header(io)
+      raise EOFError, "end of file reached" if type.nil?
+
+      x = _stream_read(io, type, chunk_size)
+      raise EOFError, "unexpected end of xnd stream." if x.nil?
+      x
+    end
   end
 
   def initialize data, type: nil, dtype: nil, levels: nil, typedef: nil,
@@ -337,6 +369,25 @@ class XND < RubyXND
     super(type, data, device)
   end
 
+  # Write this array to +io+ as a single array stream without building the
+  # whole serialized String. The data is written in chunks of +chunk_size+
+  # bytes. Use XND::StreamWriter to write several arrays of one type.
+  def serialize_to io, chunk_size: STREAM_CHUNK_SIZE
+    _stream_write io, chunk_size, nil
+    self
+  end
+
+  # Yield views of +rows+ consecutive elements of the outermost dimension.
+  # The last view holds the remaining elements. With +reuse+ the same view
+  # object is updated and yielded again while the chunks have equal types,
+  # so it must not be kept after the block returns.
+  def each_chunk rows, reuse: false, &block
+    unless block_given?
+      return enum_for(:each_chunk, rows, reuse: reuse) { (size + rows - 1) / rows }
+    end
+    _each_chunk rows, reuse, &block
+  end
+
   def reshape shape, order: nil
     _reshape(shape, order)
   end
@@ -358,4 +409,56 @@ class XND < RubyXND
   def to_s
     short_value(10).to_s
   end
+
+  # Write a stream of arrays that share one type. The type is written once
+  # in the stream header, followed by one frame per array.
+  #
+  # @example
+  #
+  # w = XND::StreamWriter.new io
+  # w << x << y
+  class StreamWriter
+    attr_reader :type
+
+    def initialize io, chunk_size: STREAM_CHUNK_SIZE
+      @io = io
+      @chunk_size = chunk_size
+      @type = nil
+    end
+
+    def write x
+      @type = x._stream_write @io, @chunk_size, @type
+      self
+    end
+    alias << write
+  end
+
+  # Read a stream written by XND::StreamWriter or XND#serialize_to.
+  class StreamReader
+    include Enumerable
+
+    def initialize io, chunk_size: STREAM_CHUNK_SIZE
+      @io = io
+      @chunk_size = chunk_size
+      @type = nil
+    end
+
+    # The type of the arrays in the stream, or nil for an empty stream.
+    def type
+      @type ||= XND._stream_read_header(@io)
+    end
+
+    # Return the next array, or nil at the end of the stream.
+    def read
+      type.nil? ? nil : XND._stream_read(@io, type, @chunk_size)
+    end
+
+    def each
+      return to_enum(:each) unless block_given?
+
+      while (x = read)
+        yield x
+      end
+    end
+  end
 end # class XND
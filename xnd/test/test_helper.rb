@@ -4,6 +4,8 @@ require 'xnd'
 require 'minitest/autorun'
 require 'minitest/hooks'
 require 'minitest/fail_fast'
+require 'tmpdir'
+require 'stringio'
 
 #Minitest::Test.parallelize_me!
 
@@ -91,11 +93,13 @@ def check_serialize x
   begin
     b = x.serialize
     y = XND.deserialize(b)
+    z = XND.deserialize(b.freeze, copy: false)
   rescue NotImplementedError
     return
   end
 
   assert_equal x, y
+  assert_equal x, z
 end
 
 # ======================================================================
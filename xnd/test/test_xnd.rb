@@ -356,6 +356,85 @@ class TestFixedDim < Minitest::Test
 
     assert_equal x.value, v
   end
+
+  def test_fixed_dim_bulk_init
+    [
+      [[[1, 2, 3], [4, 5, 6]], "2 * 3 * int8"],
+      [[[1, 2, 3], [4, 5, 6]], "2 * 3 * uint16"],
+      [[[true, false], [false, true]], "2 * 2 * bool"],
+      [[[1.5, 2.5], [-3.25, 0.0]], "2 * 2 * float32"],
+      [[[1.5, 2.5], [-3.25, 0.0]], "2 * 2 * float64"],
+      [[Complex(1, 2), Complex(-3.5, 0.5)], "2 * complex128"],
+      [[[1, 2], [3, 4]], "!2 * 2 * int64"]
+    ].each do |v, s|
+      x = XND.new v, type: s
+      assert_equal v, x.value
+    end
+
+    # values that need a method call for conversion
+    x = XND.new [Rational(1, 2), 2**40, 3], type: "3 * float64"
+    assert_equal [0.5, 2.0**40, 3.0], x.value
+
+    x = XND.new [1, 0, 2.0, 0.0], type: "4 * bool"
+    assert_equal [true, false, true, false], x.value
+
+    assert_raises(RangeError) { XND.new [[1, 2], [3, 128]], type: "2 * 2 * int8" }
+    assert_raises(RangeError) { XND.new [1, 2**64], type: "2 * uint64" }
+    assert_raises(RangeError) { XND.new [1.0, 1e300], type: "2 * float32" }
+    assert_raises(TypeError) { XND.new [1, nil], type: "2 * int64" }
+    assert_raises(TypeError) { XND.new [1, "a"], type: "2 * float64" }
+    assert_raises(TypeError) { XND.new [[1, 2], 3], type: "2 * 2 * int64" }
+    assert_raises(ArgumentError) { XND.new [[1, 2], [3]], type: "2 * 2 * int64" }
+  end
+
+  def test_fixed_dim_bulk_value
+    v = (0...600).map { |i| i * 0.25 }
+    x = XND.new v, type: "600 * float64"
+    assert_equal v, x.value
+    assert_equal v[0...3] + [XND::Ellipsis.new], x.short_value(4)
+    assert_equal [], x.short_value(0)
+
+    v = [[1, 2, 3], [4, 5, 6]]
+    ["int8", "int32", "uint64", "float32", "complex64"].each do |dtype|
+      x = XND.new v, type: "2 * 3 * #{dtype}"
+      assert_equal v, x.value
+      assert_equal [1, 4], x[INF, 0].value
+      assert_equal [3, 6], x[INF, 2].value
+      assert_equal [[2, 3], [5, 6]], x[INF, 1..2].value
+      assert_equal [[1, 2, XND::Ellipsis.new], XND::Ellipsis.new], x.short_value(3)
+    end
+
+    x = XND.new [[true, false], [false, true]], type: "!2 * 2 * bool"
+    assert_equal [false, true], x[INF, 1].value
+  end
+
+  def test_fixed_dim_at
+    v = [[1, 2, 3], [4, 5, 6]]
+    ["int8", "int64", "uint16", "float32", "float64"].each do |dtype|
+      x = XND.new v, type: "2 * 3 * #{dtype}"
+      (0...2).each do |i|
+        (-3...3).each do |j|
+          assert_equal x[i, j].value, x.at(i, j)
+        end
+      end
+      assert_equal [4, 5, 6], x.at(1)
+      assert_equal 6, x[1].at(-1)
+      assert_equal 5, x[INF, 1].at(1)
+      assert_equal [[2, 3], [5, 6]], x[INF, 1..2].value
+      assert_raises(IndexError) { x.at(2, 0) }
+      assert_raises(IndexError) { x.at(0, -4) }
+      assert_raises(TypeError) { x.at(0, 1..2) }
+    end
+
+    x = XND.new [1, nil, 3], type: "3 * ?int64"
+    assert_equal [1, nil, 3], (0...3).map { |i| x.at(i) }
+
+    x = XND.new [[1], [2, 3]], type: "var * var * int64"
+    assert_equal 3, x.at(1, 1)
+
+    x = XND.new [[1, "a"], [2, "b"]], type: "2 * (int64, string)"
+    assert_equal "b", x.at(1, 1)
+  end
 end # class TestFixedDim
 
 class TestFortran < Minitest::Test
@@ -3220,7 +3299,6 @@ end # class TestTypeInference
 
 class TestEach < Minitest::Test
   def test_each
-    skip
     DTYPE_EMPTY_TEST_CASES.each do |v, s|
       [
         [[[v] * 1] * 1, "!1 * 1 * #{s}"],
@@ -3237,12 +3315,60 @@ class TestEach < Minitest::Test
           lst << v
         end
 
-        x.each_with_index do |i, z|
+        x.each_with_index do |z, i|
           assert_equal z.value, lst[i].value
+          assert_equal x[i].value, z.value
         end
       end
     end
   end
+
+  def test_each_scalar
+    x = XND.new [1, nil, 3], type: "3 * ?int64"
+    assert_equal [1, nil, 3], x.each.to_a
+
+    x = XND.new [[1], [], [2, 3]], type: "var * var * int64"
+    assert_equal [[1], [], [2, 3]], x.map(&:value)
+    assert_equal [2, 3], x[2].to_a
+
+    x = XND.new ["a", "b"], type: "2 * string"
+    assert_equal ["a", "b"], x.to_a
+  end
+
+  def test_each_enumerator
+    x = XND.new [[1, 2], [3, 4], [5, 6]], type: "3 * 2 * float64"
+    e = x.each
+    assert_equal 3, e.size
+    assert_equal [[1.0, 2.0], [3.0, 4.0], [5.0, 6.0]], e.map(&:value)
+    e.next
+    assert_equal [3.0, 4.0], e.next.value
+
+    assert_raises(TypeError) { XND.new(1, type: "int64").each { } }
+  end
+
+  def test_each_chunk
+    x = XND.new (0...10).map { |i| [i, -i] }, type: "10 * 2 * int64"
+
+    chunks = x.each_chunk(4).map(&:value)
+    assert_equal [x[0...4].value, x[4...8].value, x[8...10].value], chunks
+    assert_equal 3, x.each_chunk(4).size
+    assert_equal [x.value], x.each_chunk(10).map(&:value)
+
+    seen = []
+    views = []
+    x.each_chunk(3, reuse: true) do |c|
+      seen << c.value
+      views << c
+    end
+    assert_equal x.each_chunk(3).map(&:value), seen
+    assert_same views[0], views[2]
+    refute_same views[2], views[3]
+
+    x = XND.new [[1], [2, 3], [], [4]], type: "var * var * int64"
+    assert_equal [[[1], [2, 3]], [[], [4]]], x.each_chunk(2).map(&:value)
+
+    assert_raises(ArgumentError) { x.each_chunk(0) { } }
+  end
 end # class TestEach
 
 class TestAPI < Minitest::Test
@@ -3279,6 +3405,69 @@ class TestToS < Minitest::Test
   end
 end # class TestToS
 
+class TestInitPlan < Minitest::Test
+  def test_plan_reuse
+    t = NDT.new "2 * {a: int64, b: (string, ?float64)}"
+    v1 = [{'a' => 1, 'b' => ["x", 1.5]}, {'a' => 2, 'b' => ["y", nil]}]
+    v2 = [{'a' => -1, 'b' => ["z", nil]}, {'a' => -2, 'b' => ["", 2.5]}]
+
+    3.times do
+      assert_equal v1, XND.new(v1, type: t).value
+      assert_equal v2, XND.new(v2, type: t).value
+    end
+
+    assert_raises(ArgumentError) { XND.new [{'a' => 1}, {'a' => 2}], type: t }
+    assert_raises(TypeError) { XND.new [1, 2], type: t }
+    assert_equal v1, XND.new(v1, type: t).value
+  end
+
+  def test_plan_nested
+    t = NDT.new "var(offsets=[0,2]) * var(offsets=[0,1,3]) * (int8, string)"
+    v = [[[1, "a"]], [[2, "b"], [3, "c"]]]
+
+    2.times do
+      assert_equal v, XND.new(v, type: t).value
+    end
+
+    t = NDT.new "3 * (?int64, 2 * float32)"
+    v = [[1, [1.0, 2.0]], [nil, [3.0, 4.0]], [3, [5.0, 6.0]]]
+
+    2.times do
+      assert_equal v, XND.new(v, type: t).value
+    end
+  end
+
+  def test_plan_frozen_type
+    t = NDT.new("2 * (int64, string)").freeze
+    v = [[1, "a"], [2, "b"]]
+
+    2.times do
+      assert_equal v, XND.new(v, type: t).value
+    end
+  end
+end # class TestInitPlan
+
+class TestGC < Minitest::Test
+  def test_view_keeps_memory_alive
+    views = 10.times.map do |i|
+      x = XND.new [[i, i + 1], [i + 2, i + 3]], type: "2 * 2 * int64"
+      x[1]
+    end
+    GC.start
+
+    views.each_with_index do |v, i|
+      assert_equal [i + 2, i + 3], v.value
+      assert_equal NDT.new("2 * int64"), v.type
+    end
+  end
+
+  def test_buffer_keeps_string_alive
+    x = XND.from_buffer([1.0, 2.0].pack("d*").freeze, "2 * float64")
+    GC.start
+    assert_equal [1.0, 2.0], x.value
+  end
+end # class TestGC
+
 class TestBuffer < Minitest::Test
   def test_from_nmatrix
     
@@ -3291,6 +3480,148 @@ class TestBuffer < Minitest::Test
   def test_from_narray
     
   end
+
+  def test_from_string
+    v = [1.5, -2.25, 3.0, 4.75]
+    s = v.pack("d*").freeze
+    x = XND.from_buffer(s, "2 * 2 * float64")
+    assert_equal [[1.5, -2.25], [3.0, 4.75]], x.value
+    assert_equal [-2.25, 4.75], x[INF, 1].value
+
+    y = XND.from_buffer([1, 2, 3].pack("l<*").freeze, NDT.new("3 * <int32"))
+    assert_equal [1, 2, 3], y.value
+
+    assert_raises(FrozenError) { x[0, 0] = 1.0 }
+    assert_raises(FrozenError) { x[1][0] = 1.0 }
+    assert_raises(ArgumentError) { XND.from_buffer(v.pack("d*"), "4 * float64") }
+    assert_raises(ValueError) { XND.from_buffer(s, "3 * float64") }
+    assert_raises(NotImplementedError) { XND.from_buffer(s, "4 * ?float64") }
+  end
+
+  def test_deserialize_view
+    x = XND.new (0...100).map(&:to_f), type: "10 * 10 * float64"
+    b = x.serialize.freeze
+
+    y = XND.deserialize(b, copy: false)
+    assert_equal x, y
+    assert_raises(FrozenError) { y[0, 0] = 1.0 }
+
+    z = XND.deserialize(b)
+    z[0, 0] = 1.0
+    assert_equal 1.0, z[0, 0].value
+
+    assert_raises(ArgumentError) { XND.deserialize(x.serialize, copy: false) }
+  end
+
+  def test_serialize_ext
+    [
+      [[1, nil, 3], "3 * ?int64"],
+      [[[1, nil], [nil, 4], [5, 6]], "3 * 2 * ?int32"],
+      [["abc", "", "d" * 100], "3 * string"],
+      [["abc", nil, "xyz"], "3 * ?string"],
+      [["ab".b, "\x00\xff".b], "2 * bytes"],
+      [[{"a" => "x", "b" => nil}, {"a" => "yz", "b" => 2.5}], "2 * {a: string, b: ?float64}"],
+      [[["x", 1], ["y", 2]], "var * (string, int8)"]
+    ].each do |v, t|
+      x = XND.new v, type: t
+      y = XND.deserialize(x.serialize)
+      assert_equal x.type, y.type
+      assert_equal v, y.value
+    end
+
+    # The basic layout is unchanged for arrays without bitmaps or pointers.
+    x = XND.new [1, 2, 3], type: "3 * int64"
+    b = x.serialize
+    assert_equal [24], b[-8..-1].unpack("q")
+    assert_equal [1, 2, 3].pack("q*"), b[0, 24]
+
+    b = XND.new(["abc", "de"], type: "2 * string").serialize
+    b[-16, 8] = [1 << 40].pack("q")
+    assert_raises(ValueError) { XND.deserialize(b) }
+  end
+
+  def test_mmap
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "x.xnd")
+      x = XND.new [[1, 2, 3], [4, 5, 6]], type: "2 * 3 * int64"
+      x.save path
+      assert_equal x.serialize, File.binread(path)
+
+      y = XND.mmap path
+      assert_equal x, y
+      assert_raises(FrozenError) { y[0, 0] = 10 }
+
+      z = XND.mmap path, mode: :rw
+      z[1, 2] = 60
+      assert_equal 60, XND.mmap(path)[1, 2].value
+      assert_equal 60, XND.deserialize(File.binread(path))[1, 2].value
+
+      assert_raises(ArgumentError) { XND.mmap path, mode: :w }
+      File.binwrite(path, "abc")
+      assert_raises(ValueError) { XND.mmap path }
+    end
+  end
+
+  def test_serialize_to
+    x = XND.new (0...1000).to_a, type: "10 * 100 * int32"
+    io = StringIO.new
+    x.serialize_to io, chunk_size: 7
+    io.rewind
+    assert_equal x, XND.deserialize_from(io, chunk_size: 13)
+    assert_raises(EOFError) { XND.deserialize_from(io) }
+
+    io = StringIO.new
+    assert_raises(ArgumentError) { x.serialize_to io, chunk_size: 0 }
+    x.serialize_to io
+    io.truncate(io.size - 1)
+    io.rewind
+    assert_raises(EOFError) { XND.deserialize_from(io) }
+
+    io = StringIO.new("xndstrm1" + [1 << 40].pack("q"))
+    assert_raises(ValueError) { XND.deserialize_from(io) }
+
+    ["10 * ?int64", "N * int64"].each do |type|
+      t = NDT.new(type).serialize
+      io = StringIO.new("xndstrm1" + [t.bytesize].pack("q") + t)
+      assert_raises(ValueError) { XND.deserialize_from(io) }
+    end
+  end
+
+  def test_serialize_strided
+    x = XND.new (0...24).to_a, type: "4 * 6 * int16"
+    [x.transpose, x[INF, 1..4], x[INF, 2], x[1..2, 3..5].transpose].each do |y|
+      c = y.copy_contiguous
+      assert_equal c.serialize, y.serialize
+      assert_equal c, XND.deserialize(y.serialize)
+
+      io = StringIO.new
+      y.serialize_to io, chunk_size: 5
+      io.rewind
+      assert_equal c, XND.deserialize_from(io)
+    end
+
+    io = StringIO.new
+    w = XND::StreamWriter.new io
+    w << x.transpose << x.transpose.copy_contiguous
+    io.rewind
+    assert_equal 2, XND::StreamReader.new(io).count
+  end
+
+  def test_stream
+    arrays = [[1.0, 2.0], [3.0, 4.0], [5.0, 6.0]].map { |v| XND.new v, type: "2 * float64" }
+    io = StringIO.new
+    w = XND::StreamWriter.new io
+    arrays.each { |x| w << x }
+    assert_raises(ArgumentError) { w << XND.new([1, 2], type: "2 * int64") }
+
+    io.rewind
+    r = XND::StreamReader.new io
+    assert_equal NDT.new("2 * float64"), r.type
+    assert_equal arrays, r.to_a
+    assert_nil r.read
+
+    assert_equal [], XND::StreamReader.new(StringIO.new).to_a
+  end
 end # class TestBuffer
 
 class TestReshape < Minitest::Test
@@ -3405,3 +3736,243 @@ class TestView < Minitest::Test
   end
 end # class TestView
 
+
+class TestIndex < Minitest::Test
+  def test_index_subscript
+    x = XND.new [[1, 2, 3], [4, 5, 6]], type: "2 * 3 * int64"
+
+    [[1], [0, 2], [INF, 1], [0, 1..2], [-1, 0..-1]].each do |key|
+      idx = XND::Index.new(*key)
+      assert_equal x[*key], x[idx]
+      assert_equal key, idx.to_a
+    end
+
+    y = XND.new [[7, 8], [9, 10]], type: "2 * 2 * int64"
+    idx = XND::Index.new(INF, 0..-1)
+    assert_equal x[INF, 0..-1], x[idx]
+    assert_equal [[7, 8], [9, 10]], y[idx].value
+  end
+
+  def test_index_rebase
+    x = XND.new [{"a" => 1, "b" => 2.5}, {"a" => 3, "b" => 4.5}],
+                type: "2 * {a: int64, b: float64}"
+    idx = XND::Index.new(0, "b")
+    assert_equal [2.5, 4.5], (0...2).map { |i| x[idx.rebase(i)].value }
+    assert_equal [1, "b"], idx.to_a
+
+    assert_raises(ArgumentError) { XND::Index.new(0..1).rebase(0) }
+  end
+
+  def test_index_field_compact
+    skip "GC.compact is not available" unless GC.respond_to?(:compact)
+
+    x = XND.new [{"a" => 1, "b" => 2.5}], type: "1 * {a: int64, b: float64}"
+    idx = XND::Index.new(0, "b")
+    GC.compact
+    assert_equal 2.5, x[idx].value
+  end
+
+  def test_index_store
+    x = XND.new [[1, 2, 3], [4, 5, 6]], type: "2 * 3 * int64"
+    idx = XND::Index.new(0, 0)
+    2.times { |i| x[idx.rebase(i)] = 0 }
+    assert_equal [[0, 2, 3], [0, 5, 6]], x.value
+  end
+
+  def test_index_step
+    x = XND.new (0...10).to_a, type: "10 * int64"
+
+    assert_equal [1, 3, 5, 7], x[(1..7).step(2)].value
+    assert_equal [1, 3, 5], x[(1...7).step(2)].value
+    assert_equal [0, 4, 8], x[(0..).step(4)].value
+    assert_equal [2, 5, 8], x[(2..-1).step(3)].value
+    assert_equal [9, 6, 3, 0], x[9.step(0, -3)].value
+    assert_equal [9, 6, 3], x[XND::Index.new(9.step(1, -3))].value
+  end
+end # class TestIndex
+
+class TestPool < Minitest::Test
+  N = 1 << 12
+
+  def teardown
+    XND.pool_limit = 1 << 26
+  end
+
+  def drop_array
+    x = XND.empty "#{N} * float64"
+    x[0] = 1.5
+    nil
+  end
+
+  def test_pool_reuse
+    XND.pool_trim
+    hits = XND.pool_stats[:hits]
+
+    10.times do
+      drop_array
+      GC.start
+    end
+
+    assert_operator XND.pool_stats[:hits], :>, hits
+    assert_equal [0.0] * N, XND.empty("#{N} * float64").value
+  end
+
+  def test_pool_trim
+    10.times { drop_array }
+    GC.start
+
+    bytes = XND.pool_stats[:bytes]
+    assert_equal bytes, XND.pool_trim
+    assert_equal 0, XND.pool_stats[:bytes]
+    assert_equal 0, XND.pool_stats[:buffers]
+  end
+
+  def test_pool_limit
+    XND.pool_limit = 0
+    10.times { drop_array }
+    GC.start
+
+    stats = XND.pool_stats
+    assert_equal 0, stats[:limit]
+    assert_equal 0, stats[:bytes]
+    assert_raises(ArgumentError) { XND.pool_limit = -1 }
+  end
+
+  def test_pool_types
+    XND.pool_trim
+    misses = XND.pool_stats[:misses]
+
+    XND.empty "#{N} * ?float64"
+    XND.empty "#{N} * string"
+    XND.empty "16 * float64"
+    assert_equal misses, XND.pool_stats[:misses]
+
+    XND.empty "#{N} * int64"
+    assert_equal misses + 1, XND.pool_stats[:misses]
+  end
+end
+
+class TestArena < Minitest::Test
+  def test_arena_value
+    x = XND.arena(1 << 16) do
+      a = XND.new [1, 2, 3], type: "3 * int64"
+      a[1] = 20
+      a
+    end
+
+    assert_equal [1, 20, 3], x.value
+  end
+
+  def test_arena_containers
+    v = XND.arena(1 << 16) do
+      [XND.new([1.5, 2.5]), { "x" => XND.new([3, 4], type: "2 * int32") }, 7]
+    end
+
+    assert_equal [1.5, 2.5], v[0].value
+    assert_equal [3, 4], v[1]["x"].value
+    assert_equal 7, v[2]
+  end
+
+  def test_arena_escape
+    escaped = nil
+    XND.arena(1 << 16) do
+      escaped = XND.empty "16 * float64"
+      nil
+    end
+
+    assert_raises(RuntimeError) { escaped.value }
+    assert_raises(RuntimeError) { escaped[0] }
+  end
+
+  def test_arena_exception
+    escaped = nil
+    assert_raises(IndexError) do
+      XND.arena(1 << 16) do
+        escaped = XND.empty "16 * float64"
+        raise IndexError
+      end
+    end
+
+    assert_raises(RuntimeError) { escaped.value }
+  end
+
+  def test_arena_fallback
+    large = string = nil
+    XND.arena(64) do
+      large = XND.empty "100 * int64"
+      string = XND.new ["a", "b"]
+      nil
+    end
+
+    assert_equal [0] * 100, large.value
+    assert_equal ["a", "b"], string.value
+  end
+
+  def test_arena_nested
+    inner = nil
+    outer = XND.arena(1 << 16) do
+      inner = XND.arena(1 << 16) { XND.new [1, 2, 3], type: "3 * int64" }
+      assert_equal [1, 2, 3], inner.value
+      XND.new [4, 5], type: "2 * int64"
+    end
+
+    assert_equal [4, 5], outer.value
+    assert_raises(RuntimeError) { inner.value }
+  end
+
+  def test_arena_fibers
+    other = Fiber.new do
+      y = XND.new [1, 2, 3], type: "3 * int64"
+      Fiber.yield
+      y.value
+    end
+
+    inner = Fiber.new do
+      XND.arena(1 << 16) do
+        Fiber.yield
+        XND.new [4, 5], type: "2 * int64"
+      end
+    end
+
+    XND.arena(1 << 16) do
+      other.resume
+      inner.resume
+      nil
+    end
+    z = XND.new [6], type: "1 * int64"
+    x = inner.resume
+
+    assert_equal [1, 2, 3], other.resume
+    assert_equal [4, 5], x.value
+    assert_equal [6], z.value
+  end
+
+  def test_arena_abandoned_fiber
+    escaped = []
+    10.times do
+      fiber = Fiber.new do
+        XND.arena(1 << 16) do
+          escaped << XND.empty("16 * float64")
+          Fiber.yield
+        end
+      end
+      fiber.resume
+    end
+    GC.start
+
+    xs = Array.new(100) { |i| XND.new [i, i + 1], type: "2 * int64" }
+    xs.each_with_index { |x, i| assert_equal [i, i + 1], x.value }
+    escaped.each do |x|
+      begin
+        assert_equal [0.0] * 16, x.value
+      rescue RuntimeError
+        # the arena went away with its fiber
+      end
+    end
+  end
+
+  def test_arena_errors
+    assert_raises(ArgumentError) { XND.arena(0) { } }
+    assert_raises(LocalJumpError) { XND.arena(1024) }
+  end
+end